@@ -1,39 +1,130 @@
 #pragma once
-#include "value.h"
+#include "symbols.h"
+#include "environment.h"
+#include "memo.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
-enum class ASTKind { Number, String, Identifier, Call };
+struct Interpreter;
+struct Chunk;
+struct JitCode;
 
+enum class ASTKind : uint8_t { Number, String, Identifier, Call };
+
+// Variable builtins the Resolver turns into direct slot accesses.
+enum class VarOp : uint8_t { None, Get, Set, Declare };
+
+using NodeId = uint32_t;
+
+// Plain-old-data node stored by value in an AST pool. Children are
+// referenced by 32-bit index, never by pointer.
 struct ASTNode {
     ASTKind kind;
+    VarOp var = VarOp::None;
+    bool closure = false;            // lambda0/lambda whose body reads enclosing parameters
+    // static resolution (see resolver.h): an Identifier, a get/set/declare
+    // Call with a literal name, or the parameter a plain Call's name would
+    // fall back to when no function has that name, lives at (depth, slot)
+    static constexpr int32_t Unresolved = -1;
+    static constexpr int32_t Global = -2;
+    int32_t depth = Unresolved;      // frames outward from the current one, or Global
+    uint32_t slot = 0;
     // payloads
+    Symbol sym = NoSymbol;           // for String/Identifier/Call name
+    uint32_t argc = 0;               // for Call: argument count...
+    uint32_t args = 0;               // ...and offset of the first one in AST::kids
     double number = 0.0;
-    std::string text;                // for String/Identifier/Call name
-    std::vector<ASTPtr> args;        // for Call args
 
-    static ASTPtr Number(double v){
-        auto n = std::make_shared<ASTNode>();
-        n->kind = ASTKind::Number; n->number = v; return n;
-    }
-    static ASTPtr String(std::string s){
-        auto n = std::make_shared<ASTNode>();
-        n->kind = ASTKind::String; n->text = std::move(s); return n;
-    }
-    static ASTPtr Identifier(std::string s){
-        auto n = std::make_shared<ASTNode>();
-        n->kind = ASTKind::Identifier; n->text = std::move(s); return n;
-    }
-    static ASTPtr Call(std::string name, std::vector<ASTPtr> a){
-        auto n = std::make_shared<ASTNode>();
-        n->kind = ASTKind::Call; n->text = std::move(name); n->args = std::move(a); return n;
+    const std::string& text() const { return symbolName(sym); }
+};
+
+// One parse's nodes in a single contiguous pool, freed in one shot. The
+// arguments of a Call are a contiguous run of NodeIds in `kids`.
+struct AST : std::enable_shared_from_this<AST> {
+    std::vector<ASTNode> nodes;
+    std::vector<NodeId> kids;
+    std::vector<NodeId> stmts;       // top-level statements, in order
+    uint64_t serial = nextSerial();  // differs between parses, even into a recycled pool
+
+    void clear(){ nodes.clear(); kids.clear(); stmts.clear(); serial = nextSerial(); }
+
+    NodeId Number(double v){ ASTNode n{ASTKind::Number}; n.number = v; return add(n); }
+    NodeId String(Symbol s){ ASTNode n{ASTKind::String}; n.sym = s; return add(n); }
+    NodeId Identifier(Symbol s){ ASTNode n{ASTKind::Identifier}; n.sym = s; return add(n); }
+    NodeId Call(Symbol name, const NodeId* a, size_t count){
+        ASTNode n{ASTKind::Call};
+        n.sym = name; n.argc = uint32_t(count); n.args = uint32_t(kids.size());
+        kids.insert(kids.end(), a, a+count);
+        return add(n);
     }
+
+private:
+    NodeId add(const ASTNode& n){ nodes.push_back(n); return NodeId(nodes.size()-1); }
+    static uint64_t nextSerial(){ static std::atomic<uint64_t> next{0}; return ++next; }
 };
 
-struct Function {
+// Non-owning handle used to walk an AST; valid while the AST is alive and
+// no nodes are being added to it.
+struct NodeRef {
+    AST* ast = nullptr;
+    ASTNode* n = nullptr;
+
+    NodeRef() = default;
+    NodeRef(AST& a, NodeId id): ast(&a), n(&a.nodes[id]) {}
+
+    ASTNode* operator->() const { return n; }
+    ASTNode& operator*() const { return *n; }
+    NodeRef arg(size_t i) const { return NodeRef(*ast, ast->kids[n->args+i]); }
+    explicit operator bool() const { return n!=nullptr; }
+};
+
+// Arguments of a native call: a window onto Interpreter::stack, valid until
+// the builtin re-enters the interpreter.
+struct Args {
+    Value* argv = nullptr;
+    size_t argc = 0;
+
+    size_t size() const { return argc; }
+    bool empty() const { return argc==0; }
+    Value& operator[](size_t i) const { return argv[i]; }
+    Value* begin() const { return argv; }
+    Value* end() const { return argv+argc; }
+};
+
+using NativeFn = Value(*)(Interpreter&, Args);
+
+// The arithmetic or comparison a builtin does on two numbers, for the tree
+// engine's quickened call sites (see Interpreter::Site).
+enum class BinaryOp : uint8_t { None, Add, Sub, Mul, Div, Mod, Eq, Ne, Lt, Le, Gt, Ge };
+
+struct Function : Object {
+    Function(): Object(ObjKind::Function) {}
     // User-defined or builtin
-    std::vector<std::string> params;
-    ASTPtr body; // for user-defined
+    std::vector<Symbol> params;
+    ASTPtr code;     // keeps the pool holding `body` alive
+    NodeRef body;    // for user-defined
+    Ref<Environment> captured; // parameters of the enclosing calls, for closures
+    bool resolved = false; // body has been through the Resolver
+    std::shared_ptr<Chunk> compiled; // VM bytecode for `body`, built on first call
+    uint32_t calls = 0;              // calls so far while not compiled, for --jit (see jit.h)
+    std::shared_ptr<JitCode> jit;    // machine code for `body` once hot
+    bool jitRejected = false;        // body uses something the JIT cannot compile
+    Memo memo;                       // results of earlier calls, if the body is pure (see memo.h)
     bool isBuiltin = false;
-    std::function<Value(std::vector<Value>&)> builtin; // if builtin
+    NativeFn native = nullptr; // if builtin
+    uint32_t minArity = 0;     // checked by the caller before `native` runs
+    bool pure = false;         // result depends only on the arguments; see optimizer.h
+    BinaryOp binary = BinaryOp::None; // what it does with two numbers, if that is all
+    // special forms get the unevaluated call; the engines implement them inline
+    bool isSpecial = false;
 };
+
+inline Value::Value(FuncPtr f): Value(static_cast<Object*>(f.get()), FuncTag) {}
+inline Function* Value::func() const { return static_cast<Function*>(obj()); }
+inline FuncPtr Value::asFunc() const {
+    if (!isFunc()) typeError("function");
+    return FuncPtr(static_cast<Function*>(obj()));
+}
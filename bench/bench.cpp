@@ -0,0 +1,591 @@
+// callix_bench: micro- and macrobenchmarks for the lexer, parser, both
+// engines (with and without --jit), Environment lookups, every builtin, the
+// parallel builtins against the same work done sequentially, and the cost of
+// an embedder's execution context and of one Program run on many threads,
+// the array kernels in each instruction set against a script's loop,
+// print's number formatting and output buffering, memoized calls, a
+// script's latency through --serve against a process of its own (and beside
+// clients that connect and send nothing), and short
+// runs on the Scheduler, alone and beside runs that never end.
+//
+//   callix_bench [--filter SUBSTR] [--reps N] [--quick]
+//
+// Each benchmark runs once to warm up, then N times (default 5); the JSON
+// on stdout has the best and median time per operation of each. Latency
+// benchmarks time every operation instead and add the 90th and 99th
+// percentiles. Inputs are
+// generated deterministically, so runs on one machine are comparable.
+// --quick shrinks the inputs about tenfold for a smoke run.
+#include "parser.h"
+#include "interpreter.h"
+#include "vm.h"
+#include "optimizer.h"
+#include "pool.h"
+#include "callix.h"
+#include "simd.h"
+#include "server.h"
+#include "scheduler.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <spawn.h>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+extern char** environ;
+
+struct Result {
+    std::string name, mode;
+    uint64_t ops;
+    double best, median;   // ns per op
+    double p90 = 0, p99 = 0; // latency benchmarks only
+};
+
+struct Bench {
+    std::string filter;
+    int reps = 5;
+    bool quick = false;
+    std::vector<Result> results;
+
+    bool wanted(const std::string& name, const std::string& mode) const {
+        std::string full = mode.empty() ? name : name+"["+mode+"]";
+        if (!filter.empty() && full.find(filter)==std::string::npos) return false;
+        std::cerr << full << "\n";
+        return true;
+    }
+
+    // `ops` operations per call of fn
+    void run(const std::string& name, const std::string& mode, uint64_t ops, const std::function<void()>& fn){
+        if (!wanted(name, mode)) return;
+        fn();
+        std::vector<double> ns;
+        for (int r=0;r<reps;++r){
+            auto t0 = std::chrono::steady_clock::now();
+            fn();
+            auto t1 = std::chrono::steady_clock::now();
+            ns.push_back(std::chrono::duration<double, std::nano>(t1-t0).count()/double(ops));
+        }
+        std::sort(ns.begin(), ns.end());
+        results.push_back(Result{name, mode, ops, ns.front(), ns[ns.size()/2]});
+    }
+
+    // fn times single operations and returns how long each took, in ns
+    void latency(const std::string& name, const std::string& mode, const std::function<std::vector<double>()>& fn){
+        if (!wanted(name, mode)) return;
+        std::vector<double> ns = fn();
+        if (ns.empty()) return;
+        std::sort(ns.begin(), ns.end());
+        auto at = [&](double q){ return ns[std::min(ns.size()-1, size_t(q*double(ns.size())))]; };
+        results.push_back(Result{name, mode, ns.size(), ns.front(), at(0.5), at(0.9), at(0.99)});
+    }
+
+    size_t scale(size_t n) const { return quick ? std::max<size_t>(n/10, 1) : n; }
+
+    void json(std::ostream& out) const {
+        out << "{\n  \"suite\": \"callix_bench\",\n  \"reps\": " << reps
+            << ",\n  \"quick\": " << (quick ? "true" : "false") << ",\n  \"results\": [\n";
+        for (size_t i=0;i<results.size();++i){
+            const Result& r = results[i];
+            char line[384], tail[96] = "";
+            if (r.p99>0) std::snprintf(tail, sizeof tail, ", \"p90_ns\": %.0f, \"p99_ns\": %.0f", r.p90, r.p99);
+            std::snprintf(line, sizeof line,
+                "    {\"name\": \"%s\", \"mode\": \"%s\", \"ops\": %llu, \"best_ns_per_op\": %.3f, \"median_ns_per_op\": %.3f%s}%s\n",
+                r.name.c_str(), r.mode.c_str(), (unsigned long long)r.ops, r.best, r.median, tail, i+1<results.size() ? "," : "");
+            out << line;
+        }
+        out << "  ]\n}\n";
+    }
+};
+
+struct Mode { const char* name; bool vm, jit; };
+static const Mode kModes[] = { {"tree", false, false}, {"vm", true, false}, {"tree-jit", false, true}, {"vm-jit", true, true} };
+
+// An interpreter with `setup` already run, for timing further statements.
+// Memoization is off unless asked for, so what is timed are the calls.
+struct Session {
+    Interpreter I;
+    VM vm{I};
+    Optimizer opt{I};
+    const Mode& mode;
+
+    Session(const Mode& m, const std::string& setup, bool memo = false): mode(m) { I.jit = m.jit; I.memo = memo; run(setup); }
+
+    void run(const std::string& src){
+        Parser P(src);
+        ASTPtr program = P.parseProgram();
+        opt.program(*program);
+        if (mode.vm) vm.run(program); else I.run(program);
+    }
+};
+
+struct NullBuf : std::streambuf {
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+// ---- generated inputs ----
+
+// A mix of every statement shape, `n` statements long.
+static std::string mixedScript(size_t n){
+    std::string s;
+    s.reserve(n*48);
+    s += "declare(\"v\", 0);\n";
+    for (size_t i=0;i<n;++i){
+        switch(i%4){
+            case 0: s += "set(\"v\", add(get(\"v\"), " + std::to_string(i%97) + "));\n"; break;
+            case 1: s += "check(gt(v, 1000000), set(\"v\", 0), v);\n"; break;
+            case 2: s += "switch(mod(v, 3), 0, \"zero\", 1, \"one\", \"many\");\n"; break;
+            case 3: s += "multiply(subtract(v, 1), division(v, 2.5));\n"; break;
+        }
+    }
+    return s;
+}
+
+// f0(x) = add(1, f1(x)), ..., f{depth-1}(x) = x: each call waits on the next.
+static std::string callChain(size_t depth){
+    std::string s;
+    for (size_t i=0;i+1<depth;++i)
+        s += "newname(\"f"+std::to_string(i)+"\", lambda(\"x\", add(1, f"+std::to_string(i+1)+"(x))));\n";
+    s += "newname(\"f"+std::to_string(depth-1)+"\", lambda(\"x\", x));\n";
+    return s;
+}
+
+// drive(i) calls `call` for i = 0..n-1 in a tail-recursive loop.
+static std::string driver(const std::string& call, size_t n){
+    return "newname(\"drive\", lambda(\"i\", check(lt(i, "+std::to_string(n)+"), seq("+call+", drive(add(i, 1))), i)));\n";
+}
+
+// check(eq(x, 0), 0, check(eq(x, 1), 1, ... x)) nested `depth` deep.
+static std::string nestedCheck(size_t depth){
+    std::string s;
+    for (size_t i=0;i<depth;++i) s += "check(eq(x, "+std::to_string(i)+"), "+std::to_string(i)+", ";
+    s += "x";
+    s.append(depth, ')');
+    return s;
+}
+
+static uint64_t fibCalls(size_t n){ return n<2 ? 1 : 1+fibCalls(n-1)+fibCalls(n-2); }
+
+// ---- benchmarks ----
+
+static void benchFrontEnd(Bench& B){
+    std::string src = mixedScript(B.scale(200000));
+    size_t tokens;
+    { Parser P(src); P.tokenize(); tokens = P.toks.size(); }
+    B.run("lex/tokenize", "", tokens, [&]{ Parser P(src); P.tokenize(); });
+    B.run("parse/parseProgram", "", B.scale(200000), [&]{ Parser P(src); P.parseProgram(); });
+    std::string deep = "declare(\"x\", 1);\n" + nestedCheck(B.scale(2000)) + ";\n";
+    B.run("parse/deep_check", "", 1, [&]{ Parser P(deep); P.parseProgram(); });
+}
+
+static void benchCalls(Bench& B){
+    for (size_t depth: {10, 100, 1000}){
+        size_t calls = B.scale(200000)/depth;
+        std::string setup = callChain(depth)+driver("f0(i)", calls);
+        for (const Mode& m: kModes){
+            Session S(m, setup);
+            B.run("eval/call_chain/depth="+std::to_string(depth), m.name, calls*depth, [&]{ S.run("drive(0);"); });
+        }
+    }
+    // self-recursion the JIT can take
+    std::string fib = "newname(\"fib\", lambda(\"n\", check(lt(n, 2), n, add(fib(subtract(n, 1)), fib(subtract(n, 2))))));\n";
+    size_t n = B.quick ? 20 : 25;
+    for (const Mode& m: kModes){
+        Session S(m, fib);
+        uint64_t calls = fibCalls(n);
+        B.run("eval/fib/n="+std::to_string(n), m.name, calls, [&]{ S.run("fib("+std::to_string(n)+");"); });
+        // the same with memoization, per call the plain version makes; each
+        // run redefines fib, which empties its cache
+        Session M(m, "", true);
+        B.run("memo/fib/n="+std::to_string(n), m.name, calls, [&]{ M.run(fib+"fib("+std::to_string(n)+");"); });
+    }
+    // deep check nesting in a hot function
+    size_t arms = 200, iters = B.scale(20000);
+    std::string setup = "newname(\"deep\", lambda(\"x\", "+nestedCheck(arms)+"));\n"+driver("deep(mod(i, "+std::to_string(arms+1)+"))", iters);
+    for (const Mode& m: kModes){
+        Session S(m, setup);
+        B.run("eval/deep_check/arms="+std::to_string(arms), m.name, iters, [&]{ S.run("drive(0);"); });
+    }
+    // closures and a tail-recursive loop
+    size_t loop = B.scale(1000000);
+    std::string closures = "newname(\"mk\", lambda(\"n\", lambda(\"x\", add(x, n))));\n"
+                           "newname(\"ap\", lambda(\"f\", \"v\", f(v)));\n"+driver("ap(mk(i), i)", B.scale(100000));
+    std::string tail = "newname(\"loop\", lambda(\"i\", \"n\", check(lt(i, n), loop(add(i, 1), n), i)));\n";
+    for (const Mode& m: kModes){
+        Session S(m, closures);
+        B.run("eval/closures", m.name, B.scale(100000), [&]{ S.run("drive(0);"); });
+        Session T(m, tail);
+        B.run("eval/tail_loop", m.name, loop, [&]{ T.run("loop(0, "+std::to_string(loop)+");"); });
+    }
+}
+
+static void benchEnvironment(Bench& B){
+    size_t n = B.scale(1000000);
+    Symbol target = intern("bench_target");
+    for (size_t depth: {0, 1, 4, 16, 64}){
+        Environment root;
+        root.refs = 1;   // on the stack, never freed through a Ref
+        root.declare(target, Value(1.0));
+        for (size_t i=0;i<8;++i) root.declare(intern("bench_filler"+std::to_string(i)), Value(double(i)));
+        Ref<Environment> chain;   // each link holds its parent
+        Environment* top = &root;
+        for (size_t d=0; d<depth; ++d){
+            chain = makeRef<Environment>(top, std::vector<Value>{Value(double(d))});
+            chain->declare(intern("bench_local"+std::to_string(d)), Value(double(d)));
+            top = chain.get();
+        }
+        double sink = 0;
+        B.run("env/get_by_name/depth="+std::to_string(depth), "", n, [&]{
+            Value v;
+            for (size_t i=0;i<n;++i){ top->get(target, v); sink += v.num(); }
+        });
+        uint32_t slot = root.index[target];
+        B.run("env/up_slot/depth="+std::to_string(depth), "", n, [&]{
+            for (size_t i=0;i<n;++i) sink += top->up(uint32_t(depth)).slots[slot].num();
+        });
+        if (sink<0) std::cerr << sink;
+    }
+}
+
+static void benchBuiltins(Bench& B){
+    Interpreter I;
+    // arguments for each builtin in builtins.cpp
+    Parser P("newname(\"bench_id\", lambda(\"x\", x));");
+    ASTPtr program = P.parseProgram();
+    I.run(program);
+    Value fn = Value(I.functions[intern("bench_id")]);
+    Value name = Value("bench_var"), other = Value("bench_fn");
+    I.globals.declare(symbolOf(name), Value(1.0));
+    struct Case { const char* name; std::vector<Value> args; const char* label = nullptr; };
+    std::vector<Case> cases = {
+        {"print", {Value(1.5), Value("text")}},
+        {"declare", {name, Value(2.0)}},
+        {"set", {name, Value(3.0)}},
+        {"get", {name}},
+        {"add", {Value(1.0), Value(2.0), Value(3.0)}},
+        {"add", {Value(std::string("12.5")), Value(std::string("2"))}, "add/numeric-strings"},
+        {"multiply", {Value(1.5), Value(2.0), Value(3.0)}},
+        {"subtract", {Value(10.0), Value(2.0), Value(3.0)}},
+        {"division", {Value(100.0), Value(2.0), Value(5.0)}},
+        {"mod", {Value(10.0), Value(3.0)}},
+        {"eq", {Value(1.0), Value(1.0)}},
+        {"ne", {Value(1.0), Value(2.0)}},
+        {"lt", {Value(1.0), Value(2.0)}},
+        {"le", {Value(1.0), Value(2.0)}},
+        {"gt", {Value(1.0), Value(2.0)}},
+        {"ge", {Value(1.0), Value(2.0)}},
+        {"new", {other, Value(1.0)}},          // always an error: times the throw
+        {"newname", {other, fn}},
+    };
+    NullBuf null;
+    std::ostream discard(&null);
+    Output sink(discard);
+    I.out = &sink;
+    size_t n = B.scale(1000000);
+    for (const Case& c: cases){
+        Symbol s = intern(c.name);
+        const Function& F = *I.functions.at(s);
+        size_t count = std::strcmp(c.name, "new")==0 ? n/100 : n;
+        B.run(std::string("builtin/")+(c.label ? c.label : c.name), "", count, [&]{
+            for (size_t i=0;i<count;++i){
+                size_t base = I.stack.size();
+                I.stack.insert(I.stack.end(), c.args.begin(), c.args.end());
+                try { I.callNative(F, s, I.stack.data()+base, c.args.size()); } catch (const std::runtime_error&){}
+                I.stack.resize(base);
+            }
+        });
+    }
+}
+
+static void benchOutput(Bench& B){
+    // formatting a number the way print used to (iostream) and does now
+    size_t n = B.scale(1000000);
+    std::vector<double> xs(n);
+    for (size_t i=0;i<n;++i) xs[i] = i%3 ? double(i) : double(i)/7.0;
+    NullBuf null;
+    std::ostream discard(&null);
+    B.run("output/number/ostream", "", n, [&]{ for (double x: xs) discard << x; });
+    Output sink(discard);
+    B.run("output/number/to_chars", "", n, [&]{ for (double x: xs) sink.number(x); });
+    // a print-heavy script
+    std::string setup = driver("print(i, division(i, 7), \"text\")", n);
+    for (const Mode& m: kModes){
+        if (m.jit) continue;
+        Session S(m, setup);
+        S.I.out = &sink;
+        B.run("output/print", m.name, n, [&]{ S.run("drive(0);"); });
+    }
+}
+
+static void benchParallel(Bench& B){
+    size_t tasks = B.scale(640);
+    std::string setup = "newname(\"fib\", lambda(\"n\", check(lt(n, 2), n, add(fib(subtract(n, 1)), fib(subtract(n, 2))))));\n"
+                        "newname(\"work\", lambda(\"i\", fib(add(15, mod(i, 4)))));\n"+driver("work(i)", tasks);
+    std::string threads = "threads="+std::to_string(ThreadPool::instance().size());
+    for (const Mode& m: kModes){
+        Session S(m, setup);
+        B.run("parallel/sequential", m.name, tasks, [&]{ S.run("drive(0);"); });
+        B.run("parallel/preduce/"+threads, m.name, tasks, [&]{ S.run("preduce("+std::to_string(tasks)+", \"work\", \"add\", 0);"); });
+        B.run("parallel/pfor/"+threads, m.name, tasks, [&]{ S.run("pfor("+std::to_string(tasks)+", \"work\");"); });
+    }
+}
+
+static void benchArrays(Bench& B){
+    // in cache, then well beyond it, where memory bandwidth is the limit
+    for (size_t n: {B.scale(4096), B.scale(16u<<20)}){
+        std::vector<double> a(n), b(n), out(n);
+        for (size_t i=0;i<n;++i){ a[i] = double(i%1000)*0.5; b[i] = double(i%7)+1.0; }
+        size_t reps = std::max<size_t>(1, B.scale(64u<<20)/n);
+        std::vector<const VecKernels*> kernels = {&kScalarKernels};
+#if defined(__x86_64__)
+        kernels.push_back(&kSse2Kernels);
+        if (__builtin_cpu_supports("avx2")) kernels.push_back(&kAvx2Kernels);
+#endif
+        double sink = 0;
+        std::string size = "/n="+std::to_string(n);
+        for (const VecKernels* k: kernels){
+            B.run("array/add"+size, k->name, n*reps, [&]{
+                for (size_t r=0;r<reps;++r) k->binary(VecOp::Add, a.data(), false, b.data(), false, out.data(), n);
+            });
+            B.run("array/lt"+size, k->name, n*reps, [&]{
+                for (size_t r=0;r<reps;++r) k->binary(VecOp::Lt, a.data(), false, b.data(), true, out.data(), n);
+            });
+            B.run("array/sum"+size, k->name, n*reps, [&]{ for (size_t r=0;r<reps;++r) sink += k->sum(a.data(), n); });
+            B.run("array/dot"+size, k->name, n*reps, [&]{ for (size_t r=0;r<reps;++r) sink += k->dot(a.data(), b.data(), n); });
+            B.run("array/min"+size, k->name, n*reps, [&]{ for (size_t r=0;r<reps;++r) sink += k->min(a.data(), n); });
+        }
+        if (sink==1) std::cerr << sink;
+    }
+    // the same sum of squares by array builtins and by a script loop
+    size_t n = B.scale(1000000);
+    for (const Mode& m: kModes){
+        Session S(m, "declare(\"xs\", range("+std::to_string(n)+"));\n"
+                     "newname(\"sumsq\", lambda(\"i\", \"n\", \"s\", check(lt(i, n), sumsq(add(i, 1), n, add(s, multiply(i, i))), s)));");
+        B.run("array/sumsq/builtins", m.name, n, [&]{ S.run("dot(xs, xs);"); });
+        B.run("array/sumsq/loop", m.name, n, [&]{ S.run("sumsq(0, "+std::to_string(n)+", 0);"); });
+    }
+}
+
+static void benchEmbedding(Bench& B){
+    size_t n = B.scale(100000);
+    auto runtime = Runtime::standard();
+    B.run("embed/context", "", n, [&]{
+        for (size_t i=0;i<n;++i){ Interpreter I(runtime); VM vm(I); }
+    });
+    auto tiny = Program::parse("declare(\"x\", add(1, 2));");
+    for (const Mode& m: kModes){
+        if (m.jit) continue;
+        B.run("embed/context+run", m.name, n, [&]{
+            for (size_t i=0;i<n;++i){
+                Interpreter I(runtime);
+                if (m.vm) VM(I).run(*tiny); else I.run(*tiny);
+            }
+        });
+    }
+    // one shared Program, a fresh context per thread
+    auto work = Program::parse("newname(\"fib\", lambda(\"n\", check(lt(n, 2), n, add(fib(subtract(n, 1)), fib(subtract(n, 2))))));\n"
+                               "print(fib("+std::to_string(B.quick ? 15 : 20)+"));");
+    NullBuf null;
+    std::ostream discard(&null);
+    size_t cores = ThreadPool::instance().size();
+    std::vector<std::unique_ptr<Output>> sinks;
+    for (size_t t=0;t<cores;++t) sinks.emplace_back(new Output(discard));
+    for (const Mode& m: kModes){
+        for (size_t threads: {size_t(1), cores}){
+            B.run("embed/run/threads="+std::to_string(threads), m.name, threads, [&]{
+                runConcurrently(*work, threads, m.vm, [&](Interpreter& I, size_t t){ I.out = sinks[t].get(); I.jit = m.jit; I.memo = false; });
+            });
+            if (cores==1) break;
+        }
+    }
+}
+
+// A short script submitted to a --serve server, one client at a time,
+// several at once, and with as many connections as the server has threads
+// open and silent, against running it in a new process (the callix next to
+// callix_bench) each time.
+static void benchServe(Bench& B){
+    const std::string script = "newname(\"sq\", lambda(\"x\", multiply(x, x)));\nprint(add(sq(3), sq(4)));\n";
+    size_t n = B.scale(2000);
+    auto now = []{ return std::chrono::steady_clock::now(); };
+    auto ns = [](auto d){ return std::chrono::duration<double, std::nano>(d).count(); };
+    std::string tmp = "/tmp/callix_bench."+std::to_string(getpid());
+    {
+        Server server(tmp+".sock", 4);
+        std::thread accepting([&]{ server.serve(); });
+        NullBuf null;
+        std::ostream discard(&null);
+        auto client = [&](size_t count, std::vector<double>& times){
+            Output sink(discard);
+            for (size_t i=0;i<count;++i){
+                auto t0 = now();
+                submit(tmp+".sock", script, 0, sink, discard);
+                times.push_back(ns(now()-t0));
+            }
+        };
+        B.latency("serve/script", "warm", [&]{
+            std::vector<double> times;
+            client(n, times);
+            return times;
+        });
+        B.latency("serve/script", "warm-clients=4", [&]{
+            std::vector<std::vector<double>> each(4);
+            std::vector<std::thread> clients;
+            for (auto& times: each) clients.emplace_back([&]{ client(n/4, times); });
+            for (auto& c: clients) c.join();
+            std::vector<double> all;
+            for (auto& times: each) all.insert(all.end(), times.begin(), times.end());
+            return all;
+        });
+        B.latency("serve/script", "warm-idle=4", [&]{
+            sockaddr_un a{};
+            a.sun_family = AF_UNIX;
+            std::strcpy(a.sun_path, (tmp+".sock").c_str());
+            std::vector<int> idle;
+            for (int i=0;i<4;++i){
+                int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (fd>=0 && connect(fd, reinterpret_cast<sockaddr*>(&a), sizeof a)==0) idle.push_back(fd);
+                else if (fd>=0) close(fd);
+            }
+            std::vector<double> times;
+            client(n, times);
+            for (int fd: idle) close(fd);
+            return times;
+        });
+        server.stop();
+        accepting.join();
+    }
+    char self[4096];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof self-1);
+    if (len<=0) return;
+    std::string exe(self, size_t(len));
+    exe = exe.substr(0, exe.rfind('/')+1)+"callix";
+    if (access(exe.c_str(), X_OK)!=0) return;
+    B.latency("serve/script", "cold", [&]{
+        std::string file = tmp+".fun";
+        { std::ofstream(file) << script; }
+        posix_spawn_file_actions_t quiet;
+        posix_spawn_file_actions_init(&quiet);
+        posix_spawn_file_actions_addopen(&quiet, 1, "/dev/null", O_WRONLY, 0);
+        char* args[] = {&exe[0], &file[0], nullptr};
+        std::vector<double> times;
+        for (size_t i=0;i<=n/10;++i){
+            auto t0 = now();
+            pid_t pid;
+            int status;
+            if (posix_spawn(&pid, exe.c_str(), &quiet, nullptr, args, environ)!=0) break;
+            waitpid(pid, &status, 0);
+            if (i>0) times.push_back(ns(now()-t0));   // the first one warms the page cache
+        }
+        posix_spawn_file_actions_destroy(&quiet);
+        std::remove(file.c_str());
+        return times;
+    });
+}
+
+static void benchScheduler(Bench& B){
+    auto small = Program::parse("newname(\"sq\", lambda(\"x\", multiply(x, x)));\nadd(sq(3), sq(4));\n", Runtime::standard(), true);
+    auto spin = Program::parse("newname(\"spin\", lambda(\"n\", spin(add(n, 1))));\nspin(0);\n", Runtime::standard(), true);
+    size_t n = B.scale(10000);
+    auto now = []{ return std::chrono::steady_clock::now(); };
+    std::mutex lock;
+    std::condition_variable done;
+    for (bool vm: {false, true}){
+        const char* mode = vm ? "vm" : "tree";
+        Scheduler S(4);
+        B.run("sched/runs", mode, n, [&]{
+            size_t left = n;
+            for (size_t i=0;i<n;++i) S.submit(small, vm, nullptr, [&](std::exception_ptr){
+                std::lock_guard<std::mutex> g(lock);
+                if (--left==0) done.notify_one();
+            });
+            std::unique_lock<std::mutex> g(lock);
+            done.wait(g, [&]{ return left==0; });
+        });
+        // from submit() to the end of each of n/10 runs queued at once
+        auto burst = [&](size_t runaways){
+            for (size_t r=0;r<runaways;++r)
+                S.submit(spin, vm, [](Interpreter& I){ I.budget.nanos = 100000000; }, nullptr);
+            size_t count = n/10, left = count;
+            std::vector<double> times(count);
+            for (size_t i=0;i<count;++i){
+                auto t0 = now();
+                S.submit(small, vm, nullptr, [&, i, t0](std::exception_ptr){
+                    times[i] = std::chrono::duration<double, std::nano>(now()-t0).count();
+                    std::lock_guard<std::mutex> g(lock);
+                    if (--left==0) done.notify_one();
+                });
+            }
+            std::unique_lock<std::mutex> g(lock);
+            done.wait(g, [&]{ return left==0; });
+            return times;
+        };
+        B.latency("sched/burst", mode, [&]{ return burst(0); });
+        B.latency("sched/burst-beside-runaways=4", mode, [&]{ return burst(4); });
+    }
+}
+
+static void benchScripts(Bench& B){
+    // the whole pipeline: parse, optimize, run
+    size_t n = B.scale(1000000);
+    std::string src = mixedScript(n);
+    for (const Mode& m: kModes){
+        if (m.jit) continue;   // no user functions to compile
+        B.run("script/statements="+std::to_string(n), m.name, n, [&]{
+            Interpreter I; VM vm(I);
+            Parser P(src);
+            auto program = Program::build(P.parseProgram(), I.runtime, m.vm);
+            if (m.vm) vm.run(*program); else I.run(*program);
+        });
+        B.run("script/statements="+std::to_string(n), std::string(m.name)+"-stream", n, [&]{
+            Interpreter I; VM vm(I); Optimizer opt(I);
+            Parser P(src);
+            while (ASTPtr stmt = P.parseStatement()){
+                opt.program(*stmt);
+                if (m.vm) vm.run(stmt); else I.run(stmt);
+            }
+        });
+    }
+}
+
+int main(int argc, char** argv){
+    Bench B;
+    for (int a=1; a<argc; ++a){
+        if (std::strcmp(argv[a], "--filter")==0 && a+1<argc) B.filter = argv[++a];
+        else if (std::strcmp(argv[a], "--reps")==0 && a+1<argc) B.reps = std::max(1, std::atoi(argv[++a]));
+        else if (std::strcmp(argv[a], "--quick")==0) B.quick = true;
+        else { std::cerr << "usage: callix_bench [--filter SUBSTR] [--reps N] [--quick]\n"; return 2; }
+    }
+    try {
+        benchFrontEnd(B);
+        benchCalls(B);
+        benchEnvironment(B);
+        benchBuiltins(B);
+        benchOutput(B);
+        benchParallel(B);
+        benchArrays(B);
+        benchEmbedding(B);
+        benchServe(B);
+        benchScheduler(B);
+        benchScripts(B);
+    } catch (const std::exception& ex){
+        std::cerr << "Error: " << ex.what() << "\n";
+        return 1;
+    }
+    B.json(std::cout);
+    return 0;
+}
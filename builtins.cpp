@@ -1,179 +1,462 @@
 #include "builtins.h"
+#include "pool.h"
+#include "simd.h"
+#include <algorithm>
 #include <cmath>
-#include <iostream>
+#include <mutex>
+#include <sstream>
 #include <stdexcept>
 
-static double asNumStrict(const Value& v){
-    if (v.isNum()) return v.asNum();
-    if (v.isStr()){
-        try { return std::stod(v.asStr()); } catch(...){}
+bool numberOf(const Value& v, double& out){
+    if (v.isNum()){ out = v.num(); return true; }
+    if (!v.isStr()) return false;
+    StrObj* o = v.strObj();
+    if (o->reading==StrObj::Unread){
+        if (inParallel()) return parseNumber(o->s, out);
+        o->read();
     }
+    out = o->num;
+    return o->reading==StrObj::Number;
+}
+
+double asNumStrict(const Value& v){
+    double d;
+    if (v.isNum()) return v.num();
+    if (numberOf(v, d)) return d;
     throw std::runtime_error("Expected number; got non-numeric value");
 }
 
-void installBuiltins(Interpreter& I){
+// An argument of an array operation: an array, or a number (or numeric
+// string) standing for every element.
+struct Operand {
+    const double* p;
+    size_t n = 1;
+    bool scalar = true;
+    double x = 0;
+
+    explicit Operand(const Value& v){
+        if (v.isArr()){ p = v.arrObj()->data; n = v.arrObj()->size; scalar = false; }
+        else { x = asNumStrict(v); p = &x; }
+    }
+    Operand(const Operand&) = delete;
+};
+
+// Where an elementwise result of length n goes: into an operand nothing else
+// refers to, else a new array.
+static Value resultFor(Value& a, const Value& b, size_t n){
+    if (a.isArr() && a.sole()) return std::move(a);
+    if (b.isArr() && b.sole() && b.arrObj()->size==n) return b;
+    return Value(new ArrObj(n));
+}
+
+// a op b, elementwise when either is an array. a is consumed.
+static Value broadcast(VecOp op, Value a, const Value& b, const char* who){
+    Operand x(a), y(b);
+    if (!x.scalar && !y.scalar && x.n!=y.n)
+        throw std::runtime_error(std::string(who)+": arrays of lengths "+std::to_string(x.n)+" and "+std::to_string(y.n));
+    if (op==VecOp::Div)
+        for (size_t i=0;i<y.n;++i) if (y.p[i]==0.0) throw std::runtime_error("Division by zero");
+    if (x.scalar && y.scalar){
+        double r;
+        vec().binary(op, x.p, true, y.p, true, &r, 1);
+        return Value(r);
+    }
+    size_t n = x.scalar ? y.n : x.n;
+    Value out = resultFor(a, b, n);
+    vec().binary(op, x.p, x.scalar, y.p, y.scalar, out.arrObj()->data, n);
+    return out;
+}
+
+// The rest of a variadic add/multiply/subtract/division from args[from],
+// the first array: acc (the result so far; nil if from is 0) op each
+// argument in turn. The arguments are consumed.
+static Value foldArrays(VecOp op, Args args, size_t from, Value acc, const char* who){
+    size_t i = from;
+    if (acc.isNil()) acc = std::move(args[i++]);
+    for (; i<args.size(); ++i) acc = broadcast(op, std::move(acc), args[i], who);
+    return acc;
+}
+
+template<class Op, VecOp V>
+static Value compare(Interpreter&, Args args){
+    if (args.size()!=2) throw std::runtime_error("comparison requires 2 args");
+    if (args[0].isArr() || args[1].isArr()) return broadcast(V, std::move(args[0]), args[1], "comparison");
+    return Value(Op()(asNumStrict(args[0]), asNumStrict(args[1])) ? 1.0 : 0.0);
+}
+
+// Index argument of the array builtins: a whole number in [0, limit].
+static size_t indexArg(const Value& v, size_t limit, const char* who){
+    double d = asNumStrict(v);
+    if (!(d>=0 && d<=double(limit)) || d!=std::floor(d)){
+        std::ostringstream msg;
+        msg << who << ": " << d << " is not a whole number from 0 to " << limit;
+        throw std::runtime_error(msg.str());
+    }
+    return size_t(d);
+}
+
+// sum/min/max over every number and array element given.
+static double reduceAll(Args args, double (*kernel)(const double*, size_t), double (*join)(double, double), double init){
+    double r = init;
+    for (const Value& a: args){
+        Operand x(a);
+        if (x.n) r = join(r, x.scalar ? x.x : kernel(x.p, x.n));
+    }
+    return r;
+}
+
+FuncPtr makeLambda(NodeRef call){
+    static const Symbol lambda0 = intern("lambda0");
+    size_t n = call->argc;
+    if (call->sym==lambda0 && n!=1) throw std::runtime_error("lambda0(body)");
+    if (n<1) throw std::runtime_error("lambda requires at least body");
+    auto F = makeRef<Function>();
+    for (size_t i=0;i+1<n;i++){
+        NodeRef p = call.arg(i);
+        if (p->kind!=ASTKind::String) throw std::runtime_error("lambda params must be string literals");
+        F->params.push_back(p->sym);
+    }
+    F->code = call.ast->shared_from_this();
+    F->body = call.arg(n-1);
+    F->resolved = true;   // the Resolver scoped the body with these params
+    return F;
+}
+
+// A function argument of pfor/preduce: a function value, or the name of a
+// builtin or newname'd function such as "add".
+struct Callable {
+    FuncPtr fn;
+    Symbol name = NoSymbol;
+
+    Callable(Interpreter& I, const Value& v, const char* who){
+        if (v.isFunc()){ fn = v.asFunc(); return; }
+        if (v.isStr()){
+            name = symbolOf(v, &I.names);
+            auto it = I.functions.find(name);
+            if (it!=I.functions.end() && !it->second->isSpecial){ fn = it->second; return; }
+        }
+        throw std::runtime_error(std::string(who)+": expected a function or the name of one");
+    }
+    // the same function in worker context W
+    FuncPtr in(Interpreter& W) const { return name!=NoSymbol ? W.functions.at(name) : makeRef<Function>(*fn); }
+};
+
+// Makes I read-only while it runs the tasks itself, as the worker contexts
+// are, so the tasks behave the same wherever they run.
+struct ReadOnly {
+    Interpreter& I;
+    bool was;
+    explicit ReadOnly(Interpreter& in): I(in), was(in.readOnly) { I.readOnly = true; }
+    ~ReadOnly(){ I.readOnly = was; }
+};
+
+enum class Parallel { For, Reduce, Map };
+
+// Work of pfor(from, to, f), preduce(from, to, f, combine, init) and
+// pmap(from, to, f). The range is cut into chunks that depend only on its
+// length, each chunk is folded in order (or stored, for pmap), and the chunk
+// results are folded in order on the calling thread, so the result does not
+// depend on how many threads ran or which ran what. Inside a parallel task,
+// or on a single core, the same chunks run on the calling thread.
+static Value parallelRange(Interpreter& I, Args args, Parallel kind){
+    bool reduce = kind==Parallel::Reduce, map = kind==Parallel::Map;
+    const char* who = reduce ? "preduce" : map ? "pmap" : "pfor";
+    size_t ranged = args.size()==(reduce ? 5u : 3u);   // 1 when `from` is given
+    double from = ranged ? asNumStrict(args[0]) : 0.0, to = asNumStrict(args[ranged]);
+    Callable f(I, args[ranged+1], who);
+    std::unique_ptr<Callable> combine;
+    Value init;
+    if (reduce){
+        combine = std::make_unique<Callable>(I, args[ranged+2], who);
+        init = args[ranged+3];
+    }
+    if (to-from>=9.0e15) throw std::runtime_error(std::string(who)+": range too large");
+    uint64_t count = to>from ? uint64_t(std::ceil(to-from)) : 0;
+    if (map && count>UINT32_MAX) throw std::runtime_error("pmap: range too large");
+    Value mapped = map ? Value(new ArrObj(count)) : Value();
+    double* results = map ? mapped.arrObj()->data : nullptr;
+
+    static constexpr uint64_t kChunks = 1024;
+    uint64_t chunks = std::min(count, kChunks), per = chunks ? count/chunks : 0, extra = chunks ? count%chunks : 0;
+    std::vector<Value> partial(reduce ? chunks : 0);
+    std::vector<FuncPtr> fs, combines;
+    std::vector<Interpreter*> contexts;
+    auto body = [&](size_t c, size_t t){
+        Interpreter& W = *contexts[t];
+        uint64_t first = c*per+std::min<uint64_t>(c, extra), end = first+per+(c<extra);
+        Value acc;
+        for (uint64_t k=first; k<end; ++k){
+            Value i(from+double(k));
+            Value r = W.apply(fs[t], &i, 1);
+            if (map) results[k] = asNumStrict(r);
+            if (!reduce) continue;
+            if (k==first){ acc = std::move(r); continue; }
+            Value pair[2] = {std::move(acc), std::move(r)};
+            acc = W.apply(combines[t], pair, 2);
+        }
+        if (reduce) partial[c] = std::move(acc);
+    };
+
+    ThreadPool& pool = ThreadPool::instance();
+    bool ran = false;
+    if (!I.readOnly && pool.size()>1 && chunks>1){
+        contexts = I.workers(pool.size());
+        for (Interpreter* W: contexts){
+            fs.push_back(f.in(*W));
+            if (reduce) combines.push_back(combine->in(*W));
+        }
+        ran = pool.run(chunks, body);
+    }
+    ReadOnly serial(I);
+    if (!ran){
+        contexts.assign(1, &I);
+        fs.assign(1, f.fn);
+        if (reduce) combines.assign(1, combine->fn);
+        for (size_t c=0;c<chunks;++c) body(c, 0);
+    }
+    if (!reduce) return mapped;
+    Value acc = init;
+    for (Value& p: partial){
+        Value pair[2] = {std::move(acc), std::move(p)};
+        acc = I.apply(combine->fn, pair, 2);
+    }
+    return acc;
+}
+
+static std::mutex outputLock;   // print from parallel tasks writes whole lines
+
+void installBuiltins(Runtime& R){
 
     // print(x, y, ...)
-    I.registerBuiltin("print", [](std::vector<Value>& args)->Value{
+    R.registerBuiltin("print", [](Interpreter& I, Args args)->Value{
+        std::unique_lock<std::mutex> g(outputLock, std::defer_lock);
+        if (inParallel()) g.lock();
+        Output& out = *I.out;
         for (size_t i=0;i<args.size();++i){
-            if (args[i].isNum()) std::cout << args[i].asNum();
-            else if (args[i].isStr()) std::cout << args[i].asStr();
-            else if (args[i].isFunc()) std::cout << "<function>";
-            else std::cout << "nil";
-            if (i+1<args.size()) std::cout << " ";
+            if (args[i].isNum()) out.number(args[i].asNum());
+            else if (args[i].isStr()) out.write(args[i].str());
+            else if (args[i].isFunc()) out.write("<function>", 10);
+            else if (args[i].isArr()){
+                const ArrObj& a = *args[i].arrObj();
+                out.put('[');
+                for (size_t k=0;k<a.size;++k){
+                    if (k) out.write(", ", 2);
+                    out.number(a.data[k]);
+                }
+                out.put(']');
+            }
+            else out.write("nil", 3);
+            if (i+1<args.size()) out.put(' ');
         }
-        std::cout << "\n";
+        out.put('\n');
         return Value();
     });
 
     // declare(name, value?)
-    I.registerBuiltin("declare", [&I](std::vector<Value>& args)->Value{
-        if (args.empty() || !args[0].isStr()) throw std::runtime_error("declare(name, value?) requires string name");
-        std::string name = args[0].asStr();
+    R.registerBuiltin("declare", [](Interpreter& I, Args args)->Value{
+        if (!args[0].isStr()) throw std::runtime_error("declare(name, value?) requires string name");
+        I.beforeWrite("declare");
         Value val = (args.size()>=2 ? args[1] : Value(0.0));
-        I.globals.declare(name, val);
+        I.globals.declare(symbolOf(args[0], &I.names), val);
         return val;
-    });
+    }, 1);
 
     // set(name, value)
-    I.registerBuiltin("set", [&I](std::vector<Value>& args)->Value{
+    R.registerBuiltin("set", [](Interpreter& I, Args args)->Value{
         if (args.size()!=2 || !args[0].isStr()) throw std::runtime_error("set(name, value) with string name");
-        I.globals.set(args[0].asStr(), args[1]);
+        I.beforeWrite("set");
+        I.globals.set(symbolOf(args[0], &I.names), args[1]);
         return args[1];
-    });
+    }, 2);
 
     // get(name)
-    I.registerBuiltin("get", [&I](std::vector<Value>& args)->Value{
+    R.registerBuiltin("get", [](Interpreter& I, Args args)->Value{
         if (args.size()!=1 || !args[0].isStr()) throw std::runtime_error("get(name) with string name");
         Value v;
-        if (!I.globals.get(args[0].asStr(), v)) throw std::runtime_error("Undefined variable: "+args[0].asStr());
+        if (!I.globals.get(symbolOf(args[0], &I.names), v)) throw std::runtime_error("Undefined variable: "+args[0].asStr());
         return v;
-    });
+    }, 1);
 
-    // Arithmetic: variadic add/multiply; binary subtract/division/mod
-    I.registerBuiltin("add", [](std::vector<Value>& args)->Value{
-        double s=0; for(auto& a: args) s+=asNumStrict(a); return Value(s);
-    });
-    I.registerBuiltin("multiply", [](std::vector<Value>& args)->Value{
+    // Arithmetic: variadic add/multiply; binary subtract/division/mod.
+    // These and the comparisons are pure, so the Optimizer may fold them.
+    // Given arrays they work elementwise (see below).
+    R.registerBuiltin("add", [](Interpreter&, Args args)->Value{
+        double s=0;
+        for (size_t i=0;i<args.size();++i){
+            if (args[i].isArr()) return foldArrays(VecOp::Add, args, i, i ? Value(s) : Value(), "add");
+            s+=asNumStrict(args[i]);
+        }
+        return Value(s);
+    }, 0, true);
+    R.registerBuiltin("multiply", [](Interpreter&, Args args)->Value{
         if (args.empty()) return Value(1.0);
-        double p=1; for(auto& a: args) p*=asNumStrict(a); return Value(p);
-    });
-    I.registerBuiltin("subtract", [](std::vector<Value>& args)->Value{
-        if (args.empty()) throw std::runtime_error("subtract requires at least 1 arg");
+        double p=1;
+        for (size_t i=0;i<args.size();++i){
+            if (args[i].isArr()) return foldArrays(VecOp::Mul, args, i, i ? Value(p) : Value(), "multiply");
+            p*=asNumStrict(args[i]);
+        }
+        return Value(p);
+    }, 0, true);
+    R.registerBuiltin("subtract", [](Interpreter&, Args args)->Value{
+        if (args[0].isArr()) return foldArrays(VecOp::Sub, args, 0, Value(), "subtract");
         double x = asNumStrict(args[0]);
-        for(size_t i=1;i<args.size();++i) x -= asNumStrict(args[i]);
+        for(size_t i=1;i<args.size();++i){
+            if (args[i].isArr()) return foldArrays(VecOp::Sub, args, i, Value(x), "subtract");
+            x -= asNumStrict(args[i]);
+        }
         return Value(x);
-    });
-    I.registerBuiltin("division", [](std::vector<Value>& args)->Value{
-        if (args.size()<2) throw std::runtime_error("division(a,b,...)");
+    }, 1, true);
+    R.registerBuiltin("division", [](Interpreter&, Args args)->Value{
+        if (args[0].isArr()) return foldArrays(VecOp::Div, args, 0, Value(), "division");
         double x=asNumStrict(args[0]);
         for(size_t i=1;i<args.size();++i){
+            if (args[i].isArr()) return foldArrays(VecOp::Div, args, i, Value(x), "division");
             double d=asNumStrict(args[i]);
             if (d==0.0) throw std::runtime_error("Division by zero");
             x/=d;
         }
         return Value(x);
-    });
-    I.registerBuiltin("mod", [](std::vector<Value>& args)->Value{
+    }, 2, true);
+    R.registerBuiltin("mod", [](Interpreter&, Args args)->Value{
         if (args.size()!=2) throw std::runtime_error("mod(a,b)");
+        if (args[0].isArr() || args[1].isArr()){
+            Operand a(args[0]), b(args[1]);
+            if (!a.scalar && !b.scalar && a.n!=b.n)
+                throw std::runtime_error("mod: arrays of lengths "+std::to_string(a.n)+" and "+std::to_string(b.n));
+            for (size_t i=0;i<b.n;++i) if (b.p[i]==0.0) throw std::runtime_error("Modulo by zero");
+            size_t n = a.scalar ? b.n : a.n;
+            Value out = resultFor(args[0], args[1], n);
+            double* o = out.arrObj()->data;
+            for (size_t i=0;i<n;++i) o[i] = std::fmod(a.scalar ? a.x : a.p[i], b.scalar ? b.x : b.p[i]);
+            return out;
+        }
         double a=asNumStrict(args[0]), b=asNumStrict(args[1]);
         if (b==0.0) throw std::runtime_error("Modulo by zero");
         return Value(std::fmod(a,b));
-    });
+    }, 2, true);
 
     // Comparisons
-    auto cmp = [](auto op){
-        return [op](std::vector<Value>& args)->Value{
-            if (args.size()!=2) throw std::runtime_error("comparison requires 2 args");
-            double a=asNumStrict(args[0]), b=asNumStrict(args[1]);
-            return Value(op(a,b)?1.0:0.0);
-        };
+    R.registerBuiltin("eq", compare<std::equal_to<double>, VecOp::Eq>, 2, true);
+    R.registerBuiltin("ne", compare<std::not_equal_to<double>, VecOp::Ne>, 2, true);
+    R.registerBuiltin("lt", compare<std::less<double>, VecOp::Lt>, 2, true);
+    R.registerBuiltin("le", compare<std::less_equal<double>, VecOp::Le>, 2, true);
+    R.registerBuiltin("gt", compare<std::greater<double>, VecOp::Gt>, 2, true);
+    R.registerBuiltin("ge", compare<std::greater_equal<double>, VecOp::Ge>, 2, true);
+
+    // what the tree engine's call sites may do themselves with two numbers
+    const std::pair<const char*, BinaryOp> binary[] = {
+        {"add", BinaryOp::Add}, {"subtract", BinaryOp::Sub}, {"multiply", BinaryOp::Mul},
+        {"division", BinaryOp::Div}, {"mod", BinaryOp::Mod}, {"eq", BinaryOp::Eq}, {"ne", BinaryOp::Ne},
+        {"lt", BinaryOp::Lt}, {"le", BinaryOp::Le}, {"gt", BinaryOp::Gt}, {"ge", BinaryOp::Ge},
     };
-    I.registerBuiltin("eq", cmp([](double a,double b){return a==b;}));
-    I.registerBuiltin("ne", cmp([](double a,double b){return a!=b;}));
-    I.registerBuiltin("lt", cmp([](double a,double b){return a< b;}));
-    I.registerBuiltin("le", cmp([](double a,double b){return a<=b;}));
-    I.registerBuiltin("gt", cmp([](double a,double b){return a> b;}));
-    I.registerBuiltin("ge", cmp([](double a,double b){return a>=b;}));
-
-    // seq(e1, e2, ..., en) -> returns last value
-    I.registerBuiltin("seq", [](std::vector<Value>& args)->Value{
-        if (args.empty()) return Value();
-        return args.back();
-    });
+    for (auto& [name, op]: binary) R.builtins[intern(name)]->binary = op;
 
-    // check(cond1, expr1, cond2, expr2, ..., elseExpr?)
-    I.registerBuiltin("check", [&I](std::vector<Value>& args)->Value{
-        // Arguments are already evaluated; BUT we need lazy branches.
-        // Trick: expect branches to be functions (lambdas via new) or zero-arg calls passed as evaluated Value(func)
-        // To keep it simple for the user, we’ll re-evaluate *original expressions* is not possible here.
-        // So require users to wrap branch exprs with zero-arg functions created by new().
-        // However to keep UX nicer, we accept literal/number/string directly as immediate result.
-        // Pattern: cond1, thenExprValueOrFn, cond2, then..., [elseValueOrFn]
-        size_t n=args.size();
-        size_t pairs = n/2;
-        bool hasElse = (n%2)==1;
-        for(size_t i=0;i<pairs;i++){
-            Value cond = args[2*i];
-            Value thenv = args[2*i+1];
-            if (cond.truthy()){
-                if (thenv.isFunc()){
-                    auto F = thenv.asFunc();
-                    if (!F->params.empty()) throw std::runtime_error("then-branch function must be 0-arg");
-                    Environment local(&I.globals);
-                    return I.eval(F->body, local);
-                }
-                return thenv;
-            }
-        }
-        if (hasElse){
-            Value elsev = args.back();
-            if (elsev.isFunc()){
-                auto F = elsev.asFunc();
-                if (!F->params.empty()) throw std::runtime_error("else-branch function must be 0-arg");
-                Environment local(&I.globals);
-                return I.eval(F->body, local);
-            }
-            return elsev;
+    // Arrays of numbers. The arithmetic builtins and the comparisons work on
+    // them element by element, a number standing for every element; arrays
+    // must have the same length. Comparisons give arrays of 1s and 0s.
+    // array(x, ...) -> the numbers given, with arrays spliced in
+    // range(n) / range(from, to) / range(from, to, step) -> from, from+step,
+    //   ... up to, not including, to
+    // fill(n, x) -> n copies of x
+    // length(a) -> element count; bytes of a string
+    // at(a, i) -> element i, counting from 0
+    // slice(a, from, to) -> elements from to to-1
+    // sum(x, ...), min(x, ...), max(x, ...) -> over every number and element
+    //   given; min and max skip NaNs
+    // dot(a, b) -> sum of a[i]*b[i]
+    // Sums are added in a fixed order, so they are the same on every CPU.
+    R.registerBuiltin("array", [](Interpreter&, Args args)->Value{
+        size_t n = 0;
+        for (const Value& a: args) n += a.isArr() ? a.arrObj()->size : 1;
+        auto* out = new ArrObj(n);
+        Value r(out);
+        double* o = out->data;
+        for (const Value& a: args){
+            if (!a.isArr()){ *o++ = asNumStrict(a); continue; }
+            const ArrObj& x = *a.arrObj();
+            std::copy(x.data, x.data+x.size, o);
+            o += x.size;
         }
-        return Value();
-    });
+        return r;
+    }, 0, true);
+    R.registerBuiltin("range", [](Interpreter&, Args args)->Value{
+        if (args.size()>3) throw std::runtime_error("range(n), range(from, to) or range(from, to, step)");
+        double from = args.size()>1 ? asNumStrict(args[0]) : 0.0, to = asNumStrict(args[args.size()>1]);
+        double step = args.size()>2 ? asNumStrict(args[2]) : 1.0;
+        if (step==0.0 || step!=step) throw std::runtime_error("range: step must be a nonzero number");
+        double count = std::ceil((to-from)/step);
+        if (!(count<4294967296.0)) throw std::runtime_error("range: too many elements");
+        size_t n = count>0 ? size_t(count) : 0;
+        auto* out = new ArrObj(n);
+        Value r(out);
+        for (size_t k=0;k<n;++k) out->data[k] = from+double(k)*step;
+        return r;
+    }, 1, true);
+    R.registerBuiltin("fill", [](Interpreter&, Args args)->Value{
+        if (args.size()!=2) throw std::runtime_error("fill(n, x)");
+        size_t n = indexArg(args[0], UINT32_MAX, "fill");
+        double x = asNumStrict(args[1]);
+        auto* out = new ArrObj(n);
+        Value r(out);
+        std::fill(out->data, out->data+n, x);
+        return r;
+    }, 2, true);
+    R.registerBuiltin("length", [](Interpreter&, Args args)->Value{
+        if (args.size()!=1) throw std::runtime_error("length(a)");
+        if (args[0].isStr()) return Value(double(args[0].str().size()));
+        return Value(double(args[0].asArr().size));
+    }, 1, true);
+    R.registerBuiltin("at", [](Interpreter&, Args args)->Value{
+        if (args.size()!=2) throw std::runtime_error("at(a, i)");
+        const ArrObj& a = args[0].asArr();
+        if (a.size==0) throw std::runtime_error("at: empty array");
+        return Value(a.data[indexArg(args[1], a.size-1, "at")]);
+    }, 2, true);
+    R.registerBuiltin("slice", [](Interpreter&, Args args)->Value{
+        if (args.size()!=3) throw std::runtime_error("slice(a, from, to)");
+        const ArrObj& a = args[0].asArr();
+        size_t from = indexArg(args[1], a.size, "slice"), to = indexArg(args[2], a.size, "slice");
+        if (to<from) throw std::runtime_error("slice: from is past to");
+        auto* out = new ArrObj(to-from);
+        Value r(out);
+        std::copy(a.data+from, a.data+to, out->data);
+        return r;
+    }, 3, true);
+    R.registerBuiltin("sum", [](Interpreter&, Args args)->Value{
+        return Value(reduceAll(args, vec().sum, [](double x, double y){ return x+y; }, 0.0));
+    }, 1, true);
+    R.registerBuiltin("min", [](Interpreter&, Args args)->Value{
+        return Value(reduceAll(args, vec().min, [](double x, double y){ return y<x ? y : x; }, HUGE_VAL));
+    }, 1, true);
+    R.registerBuiltin("max", [](Interpreter&, Args args)->Value{
+        return Value(reduceAll(args, vec().max, [](double x, double y){ return y>x ? y : x; }, -HUGE_VAL));
+    }, 1, true);
+    R.registerBuiltin("dot", [](Interpreter&, Args args)->Value{
+        if (args.size()!=2) throw std::runtime_error("dot(a, b)");
+        const ArrObj& a = args[0].asArr();
+        const ArrObj& b = args[1].asArr();
+        if (a.size!=b.size) throw std::runtime_error("dot: arrays of lengths "+std::to_string(a.size)+" and "+std::to_string(b.size));
+        return Value(vec().dot(a.data, b.data, a.size));
+    }, 2, true);
 
+    // Special forms receive their arguments unevaluated and only evaluate
+    // what they need. Both engines run them inline (Interpreter::step,
+    // Compiler::special); registering them reserves the names.
+    //
+    // seq(e1, e2, ..., en) -> evaluates in order, returns last value
+    // check(cond1, expr1, cond2, expr2, ..., elseExpr?)
+    //   Only the conditions up to the first truthy one and its branch run.
+    //   A branch that yields a 0-arg function (e.g. lambda0(...)) is called.
     // switch(value, case1, expr1, case2, expr2, ..., defaultExpr?)
-    I.registerBuiltin("switch", [&I](std::vector<Value>& args)->Value{
-        if (args.empty()) throw std::runtime_error("switch(value, ...)");
-        double v = asNumStrict(args[0]); // numeric switch for simplicity
-        size_t i=1;
-        for(; i+1<args.size(); i+=2){
-            double c = asNumStrict(args[i]);
-            Value expr = args[i+1];
-            if (v==c){
-                if (expr.isFunc()){
-                    auto F = expr.asFunc();
-                    if (!F->params.empty()) throw std::runtime_error("case expr must be 0-arg function");
-                    Environment local(&I.globals);
-                    return I.eval(F->body, local);
-                }
-                return expr;
-            }
-        }
-        if (i<args.size()){
-            Value def = args[i];
-            if (def.isFunc()){
-                auto F = def.asFunc();
-                if (!F->params.empty()) throw std::runtime_error("default expr must be 0-arg function");
-                Environment local(&I.globals);
-                return I.eval(F->body, local);
-            }
-            return def;
-        }
-        return Value();
-    });
+    //   Numeric; the first case equal to value picks its branch, called like check's.
+    // lambda0(bodyExpr) -> zero-arg function running bodyExpr when called
+    // lambda("p1","p2", bodyExpr) -> function binding p1, p2 for bodyExpr. The
+    //   body also sees the parameters of the functions it is written in.
+    for (const char* name: {"seq", "check", "switch", "lambda0", "lambda"}) R.registerSpecial(name);
 
     // new("fname","p1","p2", bodyExpr) -> defines named function; also returns it
     // bodyExpr can reference p1, p2…; For zero-arg anonymous, pass "" as name to only get a function value.
-    I.registerBuiltin("new", [&I](std::vector<Value>& args)->Value{
-        if (args.size()<2) throw std::runtime_error("new(name, [params...], bodyExpr)");
+    R.registerBuiltin("new", [](Interpreter&, Args args)->Value{
         if (!args[0].isStr()) throw std::runtime_error("new: first argument must be function name string (\"\" allowed)");
         std::string name = args[0].asStr();
         if (args.size()<2) throw std::runtime_error("new: missing body");
@@ -184,56 +467,40 @@ void installBuiltins(Interpreter& I){
         // So we take a different route: We rely on parser building AST for arguments *before* evaluation.
         // But builtins receive evaluated Values already…
         // Workaround: We provide "lambda" builtin that *doesn’t* evaluate its body expression by design.
-        throw std::runtime_error("Use lambda(...) to create functions; new(name, ... , lambda(...)) to bind by name.");
-    });
-
-    // lambda("p1","p2", bodyFn) — special: last arg must be **quoted body** captured as function by parser? 
-    // We can't prevent evaluation easily; instead, we’ll support: lambda("p1","p2", bodyFunctionValue)
-    // To create bodyFunctionValue, use lambda0(bodyExpr) for zero-arg bodies.
-    I.registerBuiltin("lambda0", [&I](std::vector<Value>& args)->Value{
-        // lambda0(bodyExprValue) returns a zero-arg function that when called returns bodyExprValue
-        if (args.size()!=1) throw std::runtime_error("lambda0(body)");
-        auto F = std::make_shared<Function>();
-        F->params = {};
-        // emulate body as constant: wrap as AST: if constant, create literal; if function value, not representable easily. Use constant via environment capture is out-of-scope here.
-        // Practical approach: store a constant Value in a zero-arg builtin closure.
-        Value captured = args[0];
-        F->isBuiltin = true;
-        F->builtin = [captured](std::vector<Value>&)->Value{ return captured; };
-        return Value(F);
-    });
+        throw std::runtime_error("Use lambda(...) to create functions; newname(name, lambda(...)) to bind by name.");
+    }, 2);
 
-    I.registerBuiltin("lambda", [&I](std::vector<Value>& args)->Value{
-        // lambda("a","b", fnbody) — fnbody must be a zero-arg function returning the body when executed
-        if (args.size()<1) throw std::runtime_error("lambda requires at least body");
-        size_t n = args.size();
-        if (!args[n-1].isFunc()) throw std::runtime_error("lambda last arg must be a zero-arg function (use lambda0(...))");
-        auto body0 = args[n-1].asFunc();
-        std::vector<std::string> params;
-        for(size_t i=0;i+1<n;i++){
-            if (!args[i].isStr()) throw std::runtime_error("lambda params must be strings");
-            params.push_back(args[i].asStr());
-        }
-        auto F = std::make_shared<Function>();
-        F->params = std::move(params);
-        F->isBuiltin = true; // treat as builtin closure that calls body0 with a local env
-        F->builtin = [body0](std::vector<Value>& callArgs)->Value{
-            // We can't substitute names easily without a real unevaluated AST.
-            // Simplify: body0 must be a function that *uses callArgs via get("argN") pattern is cumbersome.
-            // To keep this useful, instead provide call-by-position intrinsics arg(i).
-            // This is getting too complex — simplify the user-defined functions story:
-
-            throw std::runtime_error("lambda user functions by parameters are simplified out in this minimal build. Use named zero-arg lambdas via lambda0/newname for branches.");
-        };
-        return Value(F);
-    });
+    // pfor(n, f) / pfor(from, to, f) -> calls f(i) for from <= i < to on all
+    //   cores; nil. Output from different i may come in any order.
+    // preduce(n, f, combine, init) / preduce(from, to, f, combine, init)
+    //   -> combine(...combine(combine(init, f(from)), f(from+1))..., f(to-1)),
+    //   with f on all cores; combine must be associative.
+    // pmap(n, f) / pmap(from, to, f) -> array of f(from), ..., f(to-1), which
+    //   must be numbers, with f on all cores.
+    // f and combine are function values or names of functions ("add"). Tasks
+    // may not declare, set or newname: the globals they read stay as they were.
+    R.registerBuiltin("pfor", [](Interpreter& I, Args args)->Value{
+        if (args.size()!=2 && args.size()!=3) throw std::runtime_error("pfor(n, f) or pfor(from, to, f)");
+        return parallelRange(I, args, Parallel::For);
+    }, 2);
+    R.registerBuiltin("preduce", [](Interpreter& I, Args args)->Value{
+        if (args.size()!=4 && args.size()!=5) throw std::runtime_error("preduce(n, f, combine, init) or preduce(from, to, f, combine, init)");
+        return parallelRange(I, args, Parallel::Reduce);
+    }, 4);
+    R.registerBuiltin("pmap", [](Interpreter& I, Args args)->Value{
+        if (args.size()!=2 && args.size()!=3) throw std::runtime_error("pmap(n, f) or pmap(from, to, f)");
+        return parallelRange(I, args, Parallel::Map);
+    }, 2);
 
     // newname("foo", fnValue) -> binds function value to name
-    I.registerBuiltin("newname", [&I](std::vector<Value>& args)->Value{
+    R.registerBuiltin("newname", [](Interpreter& I, Args args)->Value{
         if (args.size()!=2 || !args[0].isStr() || !args[1].isFunc())
             throw std::runtime_error("newname(\"fname\", functionValue)");
-        auto name = args[0].asStr();
+        I.beforeWrite("newname");
+        Symbol name = symbolOf(args[0], &I.names);
+        if (I.runtime->isBuiltin(name)) throw std::runtime_error("newname: cannot rebind builtin "+args[0].asStr());
         I.functions[name] = args[1].asFunc();
+        I.functionsVersion = Interpreter::newVersion();
         return args[1];
     });
 }
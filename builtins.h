@@ -1,4 +1,15 @@
 #pragma once
 #include "interpreter.h"
 
-void installBuiltins(Interpreter& I);
+void installBuiltins(Runtime& R);
+
+// Numeric view of a value for arithmetic: numbers, or strings that parse as
+// one. A string is parsed once and remembers the result (except in a
+// parallel section, where other threads may be reading it). numberOf
+// returns false for anything else, asNumStrict throws.
+bool numberOf(const Value& v, double& out);
+double asNumStrict(const Value& v);
+
+// Function value for a lambda0/lambda call: the arguments before the last
+// must be string literals naming the parameters, the last is the body.
+FuncPtr makeLambda(NodeRef call);
@@ -0,0 +1,60 @@
+#pragma once
+#include "symbols.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// One instruction = one 32-bit word: opcode in the low 8 bits, operand in the
+// upper 24. Callee, Call and TailCall are followed by a second word (see
+// below). The order of Op must match the dispatch table in vm.cpp.
+enum class Op : uint8_t {
+    Const,    // push consts[A]
+    Load,     // push value of global names[A] (unresolved, by name)
+    LoadLocal,  // push parameter A&0xffff of the function A>>16 levels out
+    LoadGlobal, // push global slot A (identifier)
+    GetGlobal,  // push global slot A (get("name"))
+    StoreGlobal,// bind global slot A to top, leaving it in place (set/declare)
+    Callee,   // resolve function names[A] and push it; next word: a LoadLocal operand
+              // for the parameter to fall back to, or kNoLocal
+    Call,     // call the callee below the next word's count of stacked args
+    TailCall, // Call from tail position, replacing the current call; the next word's
+              // top 8 bits are the pending ThunkKind+1 if it is a check/switch arm
+    Pop,      // discard top
+    Return,   // return top
+    Jump,       // continue at A
+    JumpIfFalse,// pop; continue at A if it is not truthy
+    ToNumber,   // replace top with its numeric value (switch subject)
+    JumpIfNe,   // pop a case value; continue at A unless it equals the number below it
+    Thunk,      // if top is a 0-arg function, replace it with its result. A: ThunkKind | tail<<2 | force<<3,
+                // tail/force as for TailCall
+    Fail,       // throw consts[A]
+    Closure,    // push a copy of function consts[A] capturing the current parameters
+    Lambda,     // push a copy of function consts[A]
+};
+
+inline uint32_t encode(Op op, uint32_t a=0){ return uint32_t(op) | (a<<8); }
+inline Op       opOf(uint32_t w){ return Op(w & 0xff); }
+inline uint32_t argOf(uint32_t w){ return w>>8; }
+
+constexpr uint32_t kMaxOperand = (1u<<24)-1;
+constexpr uint32_t kNoLocal = ~0u;
+
+// Per-name call cache, valid while `version` matches Interpreter::functionsVersion.
+// Borrowed: Interpreter::functions owns the entries while the version holds, and a
+// function's own chunk must not keep it alive.
+struct CallCache {
+    std::vector<Function*> fns;
+    uint64_t version = ~0ull;
+};
+
+struct Chunk {
+    std::vector<uint32_t> code;
+    std::vector<Value> consts;
+    std::vector<Symbol> names;        // identifiers and call targets
+
+    // A chunk of a shared Program (see program.h) is never written once built:
+    // `id` then indexes the call caches each VM keeps for the Program instead.
+    static constexpr uint32_t Private = ~0u;
+    uint32_t id = Private;
+    mutable CallCache cache;          // for a private chunk
+};
@@ -0,0 +1,235 @@
+#include "cache.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr char kCacheMagic[4] = {'C', 'L', 'X', 'C'};
+static constexpr uint32_t kCacheVersion = 1;   // bump whenever the layout or the parser's output changes
+
+struct CacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceHash, sourceSize;
+    uint32_t nodes, kids, stmts, names;
+    uint64_t payload;        // bytes after the header
+    uint64_t checksum;       // of those bytes
+};
+
+static_assert(sizeof(CacheHeader)%8==0, "cache image layout");
+
+// The payload is a byte stream of unsigned LEB128 varints:
+//   names:  per name its length, then its bytes
+//   nodes:  per node a tag, then
+//             Number   the 8 bytes of the double
+//             Integer  a zigzag-coded integral Number
+//             String, Identifier  the name index
+//             Call     the name index, argc, and per argument how many
+//                      nodes back it is (arguments always precede their call)
+//   stmts:  per statement how many nodes after the previous one it is, zigzag-coded
+enum : uint8_t { TagNumber, TagString, TagIdentifier, TagCall, TagInteger };
+
+static void putVarint(std::string& out, uint64_t v){
+    while (v>=0x80){ out += char(v | 0x80); v >>= 7; }
+    out += char(v);
+}
+static uint64_t zigzag(int64_t v){ return (uint64_t(v)<<1) ^ uint64_t(v>>63); }
+static int64_t unzigzag(uint64_t v){ return int64_t(v>>1) ^ -int64_t(v & 1); }
+
+// Bounds-checked reader; any overrun clears `ok` and reads zeros from then on.
+struct ImageReader {
+    const uint8_t* p;
+    const uint8_t* end;
+    bool ok = true;
+
+    uint8_t byte(){
+        if (p==end){ ok = false; return 0; }
+        return *p++;
+    }
+    uint64_t varint(){
+        uint64_t v = 0;
+        for (int shift=0; shift<64; shift+=7){
+            uint8_t b = byte();
+            v |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        ok = false;
+        return 0;
+    }
+    bool bytes(size_t n, const char*& out){
+        if (size_t(end-p)<n){ ok = false; return false; }
+        out = reinterpret_cast<const char*>(p);
+        p += n;
+        return true;
+    }
+};
+
+// Fast content hash, 8 bytes at a time; it only has to catch edits and damage.
+static uint64_t contentHash(const char* p, size_t n){
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ n;
+    size_t i = 0;
+    for (; i+8<=n; i+=8){
+        uint64_t w; std::memcpy(&w, p+i, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h>>32;
+    }
+    for (; i<n; ++i){ h = (h ^ uint8_t(p[i])) * 0x100000001B3ull; }
+    h ^= h>>29; h *= 0xC4CEB9FE1A85EC53ull; h ^= h>>32;
+    return h;
+}
+
+ProgramCache::ProgramCache(const char* script, const char* dir, const Source& source){
+    size = source.size;
+    hash = contentHash(source.data, source.size);
+    if (dir){
+        this->dir = dir;
+        char name[32];
+        std::snprintf(name, sizeof name, "/%016llx.cxc", (unsigned long long)hash);
+        path = std::string(dir)+name;
+    } else {
+        path = std::string(script)+".cxc";
+    }
+}
+
+ASTPtr ProgramCache::load() const {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd<0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st)!=0 || size_t(st.st_size)<sizeof(CacheHeader)){ close(fd); return nullptr; }
+    size_t length = size_t(st.st_size);
+    void* map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map==MAP_FAILED) return nullptr;
+    const char* base = static_cast<const char*>(map);
+
+    ASTPtr ast;
+    CacheHeader h;
+    std::memcpy(&h, base, sizeof h);
+    if (std::memcmp(h.magic, kCacheMagic, 4)==0 && h.version==kCacheVersion
+        && h.sourceHash==hash && h.sourceSize==size && sizeof h+h.payload==length
+        && contentHash(base+sizeof h, h.payload)==h.checksum){
+        ImageReader in{reinterpret_cast<const uint8_t*>(base+sizeof h), reinterpret_cast<const uint8_t*>(base+length)};
+        // every entry takes at least a byte, which bounds the counts before anything is reserved
+        in.ok = uint64_t(h.names)+h.nodes+h.stmts<=h.payload && h.kids<=h.payload;
+        std::vector<Symbol> names;
+        if (in.ok) names.reserve(h.names);
+        for (uint32_t i=0; i<h.names && in.ok; ++i){
+            uint64_t len = in.varint();
+            const char* text;
+            if (in.bytes(len, text)) names.push_back(intern(std::string_view(text, len)));
+        }
+
+        ast = std::make_shared<AST>();
+        if (in.ok){ ast->nodes.reserve(h.nodes); ast->kids.reserve(h.kids); }
+        for (uint32_t i=0; i<h.nodes && in.ok; ++i){
+            uint8_t tag = in.byte();
+            ASTNode n{ASTKind::Number};
+            switch(tag){
+                case TagNumber: {
+                    const char* bits;
+                    if (in.bytes(8, bits)) std::memcpy(&n.number, bits, 8);
+                    break;
+                }
+                case TagInteger: n.number = double(unzigzag(in.varint())); break;
+                case TagString: case TagIdentifier: case TagCall: {
+                    n.kind = tag==TagString ? ASTKind::String : tag==TagIdentifier ? ASTKind::Identifier : ASTKind::Call;
+                    uint64_t name = in.varint();
+                    if (name>=names.size()){ in.ok = false; break; }
+                    n.sym = names[name];
+                    if (tag!=TagCall) break;
+                    uint64_t argc = in.varint();
+                    if (argc>h.kids-ast->kids.size()){ in.ok = false; break; }
+                    n.argc = uint32_t(argc);
+                    n.args = uint32_t(ast->kids.size());
+                    for (uint64_t k=0; k<argc && in.ok; ++k){
+                        uint64_t back = in.varint();
+                        if (back==0 || back>i){ in.ok = false; break; }
+                        ast->kids.push_back(NodeId(i-back));
+                    }
+                    break;
+                }
+                default: in.ok = false;
+            }
+            ast->nodes.push_back(n);
+        }
+        int64_t prev = -1;
+        for (uint32_t i=0; i<h.stmts && in.ok; ++i){
+            prev += unzigzag(in.varint());
+            if (prev<0 || prev>=int64_t(h.nodes)){ in.ok = false; break; }
+            ast->stmts.push_back(NodeId(prev));
+        }
+        if (!in.ok || in.p!=in.end || ast->nodes.size()!=h.nodes || ast->kids.size()!=h.kids) ast.reset();
+    }
+    munmap(map, length);
+    return ast;
+}
+
+void ProgramCache::store(const AST& ast) const {
+    CacheHeader h{};
+    std::memcpy(h.magic, kCacheMagic, 4);
+    h.version = kCacheVersion;
+    h.sourceHash = hash;
+    h.sourceSize = size;
+    h.nodes = uint32_t(ast.nodes.size());
+    h.kids = 0;
+    h.stmts = uint32_t(ast.stmts.size());
+
+    // names in order of first use
+    std::vector<uint32_t> index;      // process Symbol -> image name, NoSymbol if unused so far
+    std::vector<Symbol> used;
+    for (const ASTNode& n: ast.nodes){
+        if (n.kind==ASTKind::Number) continue;
+        if (n.sym>=index.size()) index.resize(n.sym+1, NoSymbol);
+        if (index[n.sym]==NoSymbol){ index[n.sym] = uint32_t(used.size()); used.push_back(n.sym); }
+    }
+    h.names = uint32_t(used.size());
+
+    std::string image(sizeof h, '\0');
+    for (Symbol s: used){ putVarint(image, symbolName(s).size()); image += symbolName(s); }
+    for (NodeId i=0; i<ast.nodes.size(); ++i){
+        const ASTNode& n = ast.nodes[i];
+        switch(n.kind){
+            case ASTKind::Number: {
+                double v = n.number;
+                if (std::abs(v)<9.0e15 && v==double(int64_t(v)) && !(v==0 && std::signbit(v))){
+                    image += char(TagInteger);
+                    putVarint(image, zigzag(int64_t(v)));
+                } else {
+                    image += char(TagNumber);
+                    image.append(reinterpret_cast<const char*>(&v), 8);
+                }
+                break;
+            }
+            case ASTKind::String: image += char(TagString); putVarint(image, index[n.sym]); break;
+            case ASTKind::Identifier: image += char(TagIdentifier); putVarint(image, index[n.sym]); break;
+            case ASTKind::Call:
+                image += char(TagCall);
+                putVarint(image, index[n.sym]);
+                putVarint(image, n.argc);
+                for (uint32_t k=0; k<n.argc; ++k){
+                    NodeId kid = ast.kids[n.args+k];
+                    if (kid>=i) return;   // not a tree the parser builds; leave it uncached
+                    putVarint(image, i-kid);
+                }
+                h.kids += n.argc;
+                break;
+        }
+    }
+    int64_t prev = -1;
+    for (NodeId s: ast.stmts){ putVarint(image, zigzag(int64_t(s)-prev)); prev = s; }
+    h.payload = image.size()-sizeof h;
+    h.checksum = contentHash(image.data()+sizeof h, h.payload);
+    std::memcpy(&image[0], &h, sizeof h);
+
+    if (!dir.empty()) mkdir(dir.c_str(), 0777);   // EEXIST is fine
+    // written aside and renamed into place, so readers never see half a file
+    std::string tmp = path+".tmp."+std::to_string(getpid());
+    FILE* f = std::fopen(tmp.c_str(), "wb");
+    if (!f) return;
+    bool ok = std::fwrite(image.data(), 1, image.size(), f)==image.size();
+    ok = std::fclose(f)==0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str())!=0) std::remove(tmp.c_str());
+}
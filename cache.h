@@ -0,0 +1,30 @@
+#pragma once
+#include "ast.h"
+#include "source.h"
+#include <string>
+
+// Binary program cache (--cache, --cache-dir DIR). The parsed program of a
+// script is saved as a flat image: a versioned header with the source's
+// size and content hash and a checksum, then the node pool, argument runs,
+// statement list and the names the nodes use. Loading maps the image,
+// checks all of that plus every index in it, and rebuilds the AST without
+// running the tokenizer. A missing, stale or damaged image just means a
+// normal parse, after which the image is rewritten.
+//
+// The image holds the AST as parsed. The optimizer, the resolver and the
+// bytecode compiler still run on every load: their output depends on the
+// running process (symbol ids, global slots, Function objects).
+struct ProgramCache {
+    std::string path;        // the cache file
+    std::string dir;         // --cache-dir, created on first store
+    uint64_t hash = 0;       // of the script's bytes
+    uint64_t size = 0;
+
+    // `source` must hold the whole script (a MappedSource). With `dir` the
+    // file is DIR/<hash>.cxc, shared by identical scripts; otherwise it sits
+    // next to the script as <script>.cxc.
+    ProgramCache(const char* script, const char* dir, const Source& source);
+
+    ASTPtr load() const;               // nullptr unless the image is valid for this source
+    void store(const AST& ast) const;  // best effort; errors only cost the next run a parse
+};
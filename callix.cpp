@@ -0,0 +1,24 @@
+#include "callix.h"
+#include <exception>
+#include <mutex>
+#include <thread>
+
+void runConcurrently(const Program& program, size_t threads, bool useVM,
+                     const std::function<void(Interpreter&, size_t)>& prepare){
+    std::mutex lock;
+    std::exception_ptr error;
+    std::vector<std::thread> running;
+    for (size_t t=0; t<threads; ++t) running.emplace_back([&, t]{
+        try {
+            Interpreter context(program.runtime);
+            if (prepare) prepare(context, t);
+            if (useVM) VM(context).run(program);
+            else context.run(program);
+        } catch (...){
+            std::lock_guard<std::mutex> g(lock);
+            if (!error) error = std::current_exception();
+        }
+    });
+    for (auto& th: running) th.join();
+    if (error) std::rethrow_exception(error);
+}
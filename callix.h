@@ -0,0 +1,23 @@
+#pragma once
+#include "program.h"
+#include "vm.h"
+#include <functional>
+
+// Embedding:
+//
+//   auto program = Program::parse(text);   // once, then shared
+//   Interpreter context;                   // one per execution: a few microseconds
+//   Output sink(stream);                   // where print writes (output.h)
+//   context.out = &sink;                   // flushed when a run ends
+//   context.run(*program);                 // or VM(context).run(*program)
+//
+// Runtimes and Programs are never written once built, so any number of
+// threads may run one Program at the same time, each in its own context. A
+// context belongs to one thread at a time. To run many at once on a few
+// threads, taking turns, see scheduler.h.
+
+// Runs `program` once on each of `threads` new threads, each in a context
+// of its own that prepare(context, i), if given, sets up first (output,
+// jit, ...). Returns when every run has finished; rethrows the first error.
+void runConcurrently(const Program& program, size_t threads, bool useVM = false,
+                     const std::function<void(Interpreter&, size_t)>& prepare = nullptr);
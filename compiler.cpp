@@ -0,0 +1,162 @@
+#include "compiler.h"
+#include "builtins.h"
+#include <stdexcept>
+
+void Compiler::begin(Chunk& c){
+    out = &c;
+    nameIndex.clear();
+}
+
+void Compiler::emit(Op op, uint32_t a){
+    if (a>kMaxOperand) throw std::runtime_error("Bytecode operand overflow");
+    out->code.push_back(encode(op, a));
+}
+
+uint32_t Compiler::constant(Value v){
+    out->consts.push_back(std::move(v));
+    return uint32_t(out->consts.size()-1);
+}
+
+size_t Compiler::jump(Op op){
+    emit(op);
+    return out->code.size()-1;
+}
+
+void Compiler::patch(size_t at){
+    uint32_t target = uint32_t(out->code.size());
+    if (target>kMaxOperand) throw std::runtime_error("Bytecode operand overflow");
+    out->code[at] = encode(opOf(out->code[at]), target);
+}
+
+// A check/switch arm, then the Thunk forcing its value. An arm of a tail
+// check is itself in tail position, unless a force is already pending.
+void Compiler::arm(NodeRef e, ThunkKind kind, bool tail, uint8_t force){
+    bool armTail = tail && force==0;
+    expr(e, armTail, armTail ? uint8_t(kind+1) : 0);
+    emit(Op::Thunk, kind | uint32_t(tail)<<2 | uint32_t(force)<<3);
+}
+
+// Special forms never see their arguments as values, so they are lowered
+// to jumps here instead of calls. newname cannot rebind builtins, so the
+// name alone identifies them.
+bool Compiler::special(NodeRef node, bool tail, uint8_t force){
+    static const Symbol seq = intern("seq"), check = intern("check"), sw = intern("switch"),
+                        lambda0 = intern("lambda0"), lambda = intern("lambda");
+    size_t n = node->argc;
+    std::vector<size_t> ends;
+    if (node->sym==seq){
+        if (n==0){ emit(Op::Const, constant(Value())); return true; }
+        for (size_t i=0;i+1<n;++i){ expr(node.arg(i)); emit(Op::Pop); }
+        expr(node.arg(n-1), tail, force);
+        return true;
+    }
+    if (node->sym==check){
+        for (size_t i=0;i+1<n;i+=2){
+            expr(node.arg(i));
+            size_t skip = jump(Op::JumpIfFalse);
+            arm(node.arg(i+1), ThenThunk, tail, force);
+            ends.push_back(jump(Op::Jump));
+            patch(skip);
+        }
+        if (n%2==1) arm(node.arg(n-1), ElseThunk, tail, force);
+        else emit(Op::Const, constant(Value()));
+        for (size_t e: ends) patch(e);
+        return true;
+    }
+    if (node->sym==sw){
+        if (n==0){ emit(Op::Fail, constant(Value("switch(value, ...)"))); return true; }
+        expr(node.arg(0));
+        emit(Op::ToNumber);
+        size_t i=1;
+        for (; i+1<n; i+=2){
+            expr(node.arg(i));
+            size_t skip = jump(Op::JumpIfNe);
+            emit(Op::Pop);
+            arm(node.arg(i+1), CaseThunk, tail, force);
+            ends.push_back(jump(Op::Jump));
+            patch(skip);
+        }
+        emit(Op::Pop);
+        if (i<n) arm(node.arg(i), DefaultThunk, tail, force);
+        else emit(Op::Const, constant(Value()));
+        for (size_t e: ends) patch(e);
+        return true;
+    }
+    if (node->sym==lambda0 || node->sym==lambda){
+        // every evaluation copies the template, so a Program's chunks stay
+        // unchanged while they run; closures also capture the parameters
+        try {
+            emit(node->closure ? Op::Closure : Op::Lambda, constant(Value(makeLambda(node))));
+        } catch (const std::runtime_error& e){
+            emit(Op::Fail, constant(Value(e.what())));   // raised only if this code runs
+        }
+        return true;
+    }
+    return false;
+}
+
+uint32_t Compiler::local(NodeRef node){
+    if (node->depth>0xff || node->slot>0xffff) throw std::runtime_error("Bytecode operand overflow");
+    return uint32_t(node->depth)<<16 | node->slot;
+}
+
+uint32_t Compiler::name(Symbol n){
+    auto it = nameIndex.find(n);
+    if (it!=nameIndex.end()) return it->second;
+    out->names.push_back(n);
+    uint32_t idx = uint32_t(out->names.size()-1);
+    nameIndex.emplace(n, idx);
+    return idx;
+}
+
+void Compiler::expr(NodeRef node, bool tail, uint8_t force){
+    switch(node->kind){
+        case ASTKind::Number: emit(Op::Const, constant(Value(node->number))); return;
+        case ASTKind::String: emit(Op::Const, constant(symbols().value(node->sym))); return;
+        case ASTKind::Identifier:
+            if (node->depth==ASTNode::Global){ emit(Op::LoadGlobal, node->slot); return; }
+            if (node->depth>=0){ emit(Op::LoadLocal, local(node)); return; }
+            emit(Op::Load, name(node->sym));
+            return;
+        case ASTKind::Call: {
+            switch(node->var){
+                case VarOp::None: break;
+                case VarOp::Get: emit(Op::GetGlobal, node->slot); return;
+                case VarOp::Set: expr(node.arg(1)); emit(Op::StoreGlobal, node->slot); return;
+                case VarOp::Declare:
+                    if (node->argc>=2) expr(node.arg(1));
+                    else emit(Op::Const, constant(Value(0.0)));
+                    emit(Op::StoreGlobal, node->slot);
+                    return;
+            }
+            if (special(node, tail, force)) return;
+            // callee is resolved before the arguments run, as in Interpreter::call
+            uint32_t n = name(node->sym);
+            emit(Op::Callee, n);
+            out->code.push_back(node->depth>=0 ? local(node) : kNoLocal);
+            for (size_t i=0;i<node->argc;++i) expr(node.arg(i));
+            if (node->argc>kMaxOperand) throw std::runtime_error("Bytecode operand overflow");
+            emit(tail ? Op::TailCall : Op::Call, n);
+            out->code.push_back(uint32_t(node->argc) | uint32_t(force)<<24);
+            return;
+        }
+    }
+    throw std::runtime_error("Invalid AST node");
+}
+
+Chunk Compiler::compileProgram(AST& program){
+    Chunk c; begin(c);
+    for (NodeId stmt: program.stmts){ expr(NodeRef(program, stmt)); emit(Op::Pop); }
+    emit(Op::Const, constant(Value()));
+    emit(Op::Return);
+    c.cache.fns.resize(c.names.size());
+    return c;
+}
+
+Chunk Compiler::compileBody(NodeRef body){
+    Chunk c; begin(c);
+    expr(body, true);
+    emit(Op::Return);
+    c.cache.fns.resize(c.names.size());
+    return c;
+}
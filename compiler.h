@@ -0,0 +1,28 @@
+#pragma once
+#include "ast.h"
+#include "bytecode.h"
+#include "interpreter.h"
+#include <unordered_map>
+
+// Lowers parsed AST to stack bytecode for the VM.
+struct Compiler {
+    Chunk compileProgram(AST& program);
+    Chunk compileBody(NodeRef body);   // user function body, returns its value
+
+private:
+    Chunk* out = nullptr;
+    std::unordered_map<Symbol, uint32_t> nameIndex;
+
+    // tail: the value is the function's result (see TailCall); force: it is
+    // first forced as a check/switch arm of that ThunkKind+1
+    void expr(NodeRef node, bool tail=false, uint8_t force=0);
+    bool special(NodeRef node, bool tail, uint8_t force);   // inline lowering of check/switch/seq/lambda0/lambda
+    void arm(NodeRef e, ThunkKind kind, bool tail, uint8_t force);
+    size_t jump(Op op);
+    void patch(size_t at);
+    void emit(Op op, uint32_t a=0);
+    uint32_t constant(Value v);
+    uint32_t name(Symbol n);
+    uint32_t local(NodeRef node);   // LoadLocal operand for a resolved parameter
+    void begin(Chunk& c);
+};
@@ -1,32 +1,81 @@
 #pragma once
-#include "value.h"
+#include "symbols.h"
 
-struct Environment {
-    Environment* parent = nullptr;
-    std::unordered_map<std::string, Value> vars;
+// A scope. Statically resolved variables live in the flat `slots` array and
+// are reached by (depth, slot); `index` maps names onto the same slots for
+// names that are only known at run time (e.g. declare(expr, ...)). The
+// globals are one Environment; the others are the parameters of a call,
+// copied out when a closure captures them (parameters never change), and
+// chained to the scope the called function itself captured.
+struct Environment : Object {
+    Ref<Environment> parent;
+    std::vector<Value> slots;
+    std::vector<bool> bound;                          // slot holds a value (globals reserve slots before declare)
+    std::unordered_map<Symbol, uint32_t> index;       // name -> slot
+    std::vector<Symbol> names;                        // slot -> name, for error messages
 
-    explicit Environment(Environment* p=nullptr): parent(p) {}
+    explicit Environment(Environment* p=nullptr): Object(ObjKind::Environment), parent(p) {}
+    Environment(Environment* p, std::vector<Value> frame): Object(ObjKind::Environment), parent(p), slots(std::move(frame)) {}
 
-    bool hasHere(const std::string& k) const { return vars.find(k)!=vars.end(); }
+    // Reserves (or finds) the slot for `k` in this frame without binding it.
+    uint32_t slotFor(Symbol k){
+        auto it = index.find(k);
+        if (it!=index.end()) return it->second;
+        uint32_t s = uint32_t(slots.size());
+        index.emplace(k, s);
+        slots.emplace_back();
+        bound.push_back(false);
+        names.push_back(k);
+        return s;
+    }
+
+    bool isBound(uint32_t s) const { return s<bound.size() && bound[s]; }
+    // What the slots, names and index take, beside the Object itself.
+    size_t bytes() const {
+        return slots.capacity()*sizeof(Value)+bound.capacity()/8+names.capacity()*sizeof(Symbol)
+             +index.bucket_count()*sizeof(void*)+index.size()*(sizeof(std::pair<const Symbol, uint32_t>)+sizeof(void*));
+    }
+    const std::string& nameOf(uint32_t s) const { return symbolName(names[s]); }
+
+    Environment& up(uint32_t depth){
+        Environment* e = this;
+        while(depth--) e = e->parent.get();
+        return *e;
+    }
+
+    void bind(uint32_t s, const Value& v){ slots[s]=v; bound[s]=true; }
+
+    // Makes this frame a copy of `layout`: the same names in the same slots, none bound.
+    void reset(const Environment& layout){
+        slots.assign(layout.slots.size(), Value());
+        bound.assign(layout.bound.size(), false);
+        index = layout.index;
+        names = layout.names;
+    }
+
+    bool hasHere(Symbol k) const {
+        auto it = index.find(k);
+        return it!=index.end() && isBound(it->second);
+    }
 
-    bool get(const std::string& k, Value& out) const {
-        auto it = vars.find(k);
-        if (it!=vars.end()){ out = it->second; return true; }
+    bool get(Symbol k, Value& out) const {
+        auto it = index.find(k);
+        if (it!=index.end() && isBound(it->second)){ out = slots[it->second]; return true; }
         if (parent) return parent->get(k, out);
         return false;
     }
 
-    void set(const std::string& k, const Value& v){
+    void set(Symbol k, const Value& v){
         // assign existing in chain, else create here
         Environment* cur = this;
         while(cur){
-            if (cur->hasHere(k)){ cur->vars[k]=v; return; }
-            cur = cur->parent;
+            if (cur->hasHere(k)){ cur->slots[cur->index[k]]=v; return; }
+            cur = cur->parent.get();
         }
-        vars[k]=v;
+        declare(k, v);
     }
 
-    void declare(const std::string& k, const Value& v){
-        vars[k]=v;
+    void declare(Symbol k, const Value& v){
+        bind(slotFor(k), v);
     }
 };
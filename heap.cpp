@@ -0,0 +1,179 @@
+#include "heap.h"
+#include "value.h"
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+__thread Heap* currentHeap = nullptr;
+
+namespace {
+struct SystemAllocator : Allocator {
+    void* allocate(size_t bytes) override { return ::operator new(bytes); }
+    void deallocate(void* p, size_t) override { ::operator delete(p); }
+};
+}
+
+Allocator& systemAllocator(){
+    static SystemAllocator system;
+    return system;
+}
+
+Heap::Heap(Allocator& a): upstream(a) {}
+
+Heap::~Heap(){
+    for (char* c: chunks) upstream.deallocate(c, kChunk);
+}
+
+void Heap::account(size_t bytes){
+    if (cap && used+stacks+bytes>cap)
+        throw std::runtime_error("Memory limit exceeded ("+std::to_string(cap>>20)+" MB)");
+    used += bytes;
+    top = std::max(top, used+stacks);
+}
+
+void* Heap::cut(size_t bytes){
+    if (size_t(end-at)<bytes){
+        // what is left of the last chunk stays unused until reset()
+        chunks.push_back(static_cast<char*>(upstream.allocate(kChunk)));
+        at = chunks.back();
+        end = at+kChunk;
+    }
+    void* p = at;
+    at += bytes;
+    return p;
+}
+
+void* Heap::allocate(size_t bytes){
+    std::unique_lock<std::mutex> g(lock, std::defer_lock);
+    if (inParallel()) g.lock();
+    if (bytes>kMaxPooled){
+        account(bytes);
+        void* p;
+        try { p = upstream.allocate(bytes); }
+        catch (...){ used -= bytes; throw; }
+        ++count;
+        return p;
+    }
+    size_t c = (bytes-1)/kGranule;
+    bytes = (c+1)*kGranule;
+    account(bytes);
+    void* p = freed[c];
+    if (p) freed[c] = *static_cast<void**>(p);
+    else {
+        try { p = cut(bytes); }
+        catch (...){ used -= bytes; throw; }
+    }
+    ++count;
+    return p;
+}
+
+void Heap::deallocate(void* p, size_t bytes){
+    std::unique_lock<std::mutex> g(lock, std::defer_lock);
+    if (inParallel()) g.lock();
+    if (bytes>kMaxPooled) upstream.deallocate(p, bytes);
+    else {
+        size_t c = (bytes-1)/kGranule;
+        bytes = (c+1)*kGranule;
+        *static_cast<void**>(p) = freed[c];
+        freed[c] = p;
+    }
+    used -= bytes;
+    if (--count==0 && !owned){
+        g = std::unique_lock<std::mutex>();
+        delete this;
+    }
+}
+
+void Heap::charge(size_t bytes){
+    std::unique_lock<std::mutex> g(lock, std::defer_lock);
+    if (inParallel()) g.lock();
+    account(bytes);
+}
+
+void Heap::refund(size_t bytes){
+    std::unique_lock<std::mutex> g(lock, std::defer_lock);
+    if (inParallel()) g.lock();
+    used -= bytes;
+}
+
+void Heap::setStacks(size_t bytes){
+    stacks = 0;
+    if (cap && used+bytes>cap){
+        stacks = bytes;
+        throw std::runtime_error("Memory limit exceeded ("+std::to_string(cap>>20)+" MB)");
+    }
+    stacks = bytes;
+    top = std::max(top, used+stacks);
+}
+
+void Heap::reset(){
+    if (count==0 && !chunks.empty()){
+        for (size_t i=1;i<chunks.size();++i) upstream.deallocate(chunks[i], kChunk);
+        chunks.resize(1);
+        at = chunks[0];
+        end = at+kChunk;
+        std::fill(std::begin(freed), std::end(freed), nullptr);
+    }
+    top = live();
+}
+
+void Heap::disown(){
+    owned = false;
+    if (count==0) delete this;
+}
+
+// ---- objects ----
+
+// In front of every Object: the Heap it came from, and what more it was
+// charged for (see Object::charge).
+struct alignas(16) ObjectHeader {
+    Heap* heap;
+    size_t extra;
+};
+
+void* Object::operator new(size_t n){
+    Heap* h = currentHeap;
+    void* p = h ? h->allocate(n+sizeof(ObjectHeader)) : ::operator new(n+sizeof(ObjectHeader));
+    auto* header = static_cast<ObjectHeader*>(p);
+    header->heap = h;
+    header->extra = 0;
+    return header+1;
+}
+
+void Object::operator delete(void* p, size_t n){
+    auto* header = static_cast<ObjectHeader*>(p)-1;
+    if (Heap* h = header->heap){
+        if (header->extra) h->refund(header->extra);
+        h->deallocate(header, n+sizeof(ObjectHeader));
+    } else {
+        ::operator delete(header);
+    }
+}
+
+Heap* Object::heap() const {
+    return (reinterpret_cast<const ObjectHeader*>(this)-1)->heap;
+}
+
+void Object::charge(size_t bytes){
+    auto* header = reinterpret_cast<ObjectHeader*>(this)-1;
+    if (!header->heap) return;
+    header->heap->charge(bytes);
+    header->extra += bytes;
+}
+
+StrObj::StrObj(std::string v): Object(ObjKind::String), s(std::move(v)) {
+    // a long string's text is a block of its own
+    const char* text = s.data();
+    if (text<reinterpret_cast<const char*>(this) || text>=reinterpret_cast<const char*>(this+1)) charge(s.capacity()+1);
+}
+
+ArrObj::ArrObj(size_t n): Object(ObjKind::Array), size(n) {
+    Heap* h = heap();
+    data = static_cast<double*>(h ? h->allocate(std::max<size_t>(n, 1)*sizeof(double)) : ::operator new(std::max<size_t>(n, 1)*sizeof(double)));
+}
+
+ArrObj::~ArrObj(){
+    if (Heap* h = heap()) h->deallocate(data, std::max<size_t>(size, 1)*sizeof(double));
+    else ::operator delete(data);
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Where a Heap gets its memory. The default is operator new; an embedder
+// may give an Interpreter one of its own.
+struct Allocator {
+    virtual ~Allocator() = default;
+    virtual void* allocate(size_t bytes) = 0;
+    virtual void deallocate(void* p, size_t bytes) = 0;
+};
+Allocator& systemAllocator();
+
+// The memory of one execution context: every Object made while it runs
+// (strings, arrays, functions, environments), on its own thread or those
+// running its parallel tasks, comes from its Heap (see HeapScope).
+//
+// Blocks of up to kMaxPooled bytes come in size classes kGranule apart and
+// are cut from chunks of kChunk bytes, one after the other (a bump arena);
+// a freed block goes on a list of its class for the next object of that
+// size. Larger ones (mostly the numbers of arrays) come straight from the
+// Allocator. When a run starts with nothing left from the one before,
+// reset() drops the lists and starts cutting from the first chunk again.
+//
+// live() counts the blocks, the text of long strings, memo tables and
+// machine code (charge), and the engines' stacks and the globals as of
+// their last check (setStacks); going over `cap` throws. Like reference
+// counts, a Heap is only locked while parallel tasks run. An object may
+// outlive its context (a value kept by an embedder): the Heap then stays
+// until its last block is freed.
+struct Heap {
+    static constexpr size_t kGranule = 16, kMaxPooled = 256;
+    static constexpr size_t kChunk = size_t(64)<<10;
+
+    size_t cap = 0;          // bytes live() may reach; 0: no limit
+
+    explicit Heap(Allocator& upstream = systemAllocator());
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    void* allocate(size_t bytes);
+    void deallocate(void* p, size_t bytes);
+    void charge(size_t bytes);          // counts memory held some other way
+    void refund(size_t bytes);
+    void setStacks(size_t bytes);
+
+    size_t live() const { return used+stacks; }
+    size_t peak() const { return top; }
+    size_t blocks() const { return count; }
+
+    // For a new run: rewinds the arena if no block is in use, and starts
+    // the peak again from what is live.
+    void reset();
+    // The context is done with it: gone now, or once its last block is.
+    void disown();
+
+private:
+    Allocator& upstream;
+    std::vector<char*> chunks;
+    char* at = nullptr;      // next free byte of the last chunk
+    char* end = nullptr;
+    void* freed[kMaxPooled/kGranule] = {}; // per size class, linked through the blocks
+    size_t used = 0, stacks = 0, top = 0, count = 0;
+    bool owned = true;
+    std::mutex lock;         // while parallel tasks run
+
+    ~Heap();
+    void account(size_t bytes);
+    void* cut(size_t bytes);
+};
+
+extern __thread Heap* currentHeap;     // where Objects made on this thread get memory; null: operator new
+
+// Makes `h` current on this thread while it lasts.
+struct HeapScope {
+    Heap* saved;
+    explicit HeapScope(Heap* h): saved(currentHeap) { currentHeap = h; }
+    ~HeapScope(){ currentHeap = saved; }
+    HeapScope(const HeapScope&) = delete;
+    HeapScope& operator=(const HeapScope&) = delete;
+};
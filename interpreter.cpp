@@ -1,5 +1,14 @@
 #include "interpreter.h"
 #include "builtins.h"
+#include "program.h"
+#include "resolver.h"
+#include "jit.h"
+#include "profiler.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cmath>
 #include <stdexcept>
 #include <sstream>
 #include <iomanip>
@@ -8,91 +17,659 @@ static std::string typeName(const Value& v){
     if (v.isNum()) return "number";
     if (v.isStr()) return "string";
     if (v.isFunc()) return "function";
+    if (v.isArr()) return "array";
     return "nil";
 }
 
-Value::Number Value::asNum() const {
-    if (!isNum()) throw std::runtime_error("Expected number, got "+typeName(*this));
-    return std::get<Number>(data);
+void Value::typeError(const char* expected) const {
+    throw std::runtime_error(std::string("Expected ")+expected+", got "+typeName(*this));
 }
-const String& Value::asStr() const {
-    if (!isStr()) throw std::runtime_error("Expected string, got "+typeName(*this));
-    return std::get<String>(data);
+
+bool parseNumber(std::string_view s, double& out){
+    const char* p = s.data();
+    const char* e = p+s.size();
+    while (p<e && std::isspace((unsigned char)*p)) ++p;
+    bool negative = p<e && *p=='-';
+    if (p<e && (*p=='-' || *p=='+')) ++p;
+    if (p==e || *p=='-' || *p=='+') return false;   // from_chars would take a second sign
+    std::from_chars_result r;
+    if (e-p>=2 && p[0]=='0' && (p[1]=='x' || p[1]=='X')){
+        bool digits = p+2<e && (std::isxdigit((unsigned char)p[2]) || p[2]=='.');
+        if (digits) r = std::from_chars(p+2, e, out, std::chars_format::hex);
+        if (!digits || r.ec==std::errc::invalid_argument){ out = 0; r.ec = std::errc(); }   // just the "0"
+    } else {
+        r = std::from_chars(p, e, out);
+    }
+    if (r.ec!=std::errc()) return false;
+    if (negative) out = -out;
+    return true;
 }
-FuncPtr Value::asFunc() const {
-    if (!isFunc()) throw std::runtime_error("Expected function, got "+typeName(*this));
-    return std::get<FuncPtr>(data);
+
+__thread uint64_t objectsAllocated = 0;
+__thread bool parallelSection = false;
+
+void releaseObject(Object* o){
+    switch(o->kind){
+        case ObjKind::String:   delete static_cast<StrObj*>(o); return;
+        case ObjKind::Function: delete static_cast<Function*>(o); return;
+        case ObjKind::Environment: delete static_cast<Environment*>(o); return;
+        case ObjKind::Array:    delete static_cast<ArrObj*>(o); return;
+    }
 }
+
 bool Value::truthy() const {
-    if (isNum()) return asNum()!=0.0;
-    if (isStr()) return !asStr().empty();
+    if (isNum()) return num()!=0.0;
+    if (isStr()) return !str().empty();
     if (isFunc()) return true;
+    if (isArr()) return arrObj()->size!=0;
     return false;
 }
 
-Interpreter::Interpreter(): globals(nullptr) {
-    installBuiltins(*this);
+const char* const kThunkErrors[4] = {
+    "then-branch function must be 0-arg", "else-branch function must be 0-arg",
+    "case expr must be 0-arg function", "default expr must be 0-arg function",
+};
+
+Interpreter::Interpreter(std::shared_ptr<const Runtime> rt, Allocator& upstream)
+    : heap(new Heap(upstream)), globalScope(makeRef<Environment>()), globals(*globalScope), runtime(std::move(rt)), functions(runtime->builtins) {
+    stack.reserve(1024);
+}
+
+Interpreter::~Interpreter(){
+    // the objects still held go with the members, and the Heap with the last of them
+    if (ownsHeap) heap->disown();
+}
+
+static uint64_t steadyNanos(){
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+Interpreter::Interpreter(Interpreter* parent)
+    : heap(parent->heap), globalScope(parent->globalScope), globals(*globalScope), runtime(parent->runtime), out(parent->out), jit(parent->jit), memo(parent->memo), readOnly(true), ownsHeap(false) {
+    stack.reserve(1024);
+    // builtins are immortal and shared; user functions are copied
+    for (auto& [name, F]: parent->functions) functions.emplace(name, F->isBuiltin ? F : makeRef<Function>(*F));
+}
+
+std::vector<Interpreter*> Interpreter::workers(size_t n){
+    if (workersVersion!=functionsVersion){
+        workerContexts.clear();
+        workersVersion = functionsVersion;
+    }
+    while (workerContexts.size()<n) workerContexts.emplace_back(new Interpreter(this));
+    std::vector<Interpreter*> out;
+    for (size_t i=0;i<n;++i){
+        // the tasks of each parallel builtin count from the start
+        Interpreter* w = workerContexts[i].get();
+        w->budget = budget;
+        w->resetBudget();
+        out.push_back(w);
+    }
+    return out;
+}
+
+void Interpreter::beforeWrite(const char* what) const {
+    if (readOnly) throw std::runtime_error(std::string(what)+" is not allowed inside a parallel task");
+}
+
+void Interpreter::arityError(const Function& F, Symbol name){
+    std::string who = name==NoSymbol ? "function" : symbolName(name);
+    throw std::runtime_error(who+" requires at least "+std::to_string(F.minArity)+(F.minArity==1 ? " arg" : " args"));
+}
+
+bool Interpreter::recallSlow(Function& F, Symbol name, const Value* argv, size_t argc, bool reserve, Value& r, Memo::Pending& pending){
+    // in a parallel task, only this context's own copies: a function value
+    // from the globals is shared with the other threads
+    if (inParallel()){
+        auto it = functions.find(name);
+        if (it==functions.end() || it->second.get()!=&F) return false;
+    }
+    if (F.memo.checked!=functionsVersion+1) checkPurity(*this, F);
+    return F.memo.active(functionsVersion) && F.memo.lookup(F.heap(), argv, argc, r, reserve, pending);
+}
+
+Value Interpreter::profiledNative(const Function& F, Symbol name, Value* argv, size_t argc){
+    profiler->enter(name);
+    Value r = callNative(F, name, argv, argc);
+    profiler->leave();
+    return r;
+}
+
+const Value& Interpreter::loadGlobal(uint32_t slot, const char* undefinedMsg) const {
+    if (!globals.isBound(slot)) throw std::runtime_error(undefinedMsg+globals.nameOf(slot));
+    return globals.slots[slot];
+}
+
+void Interpreter::prepare(Function& F){
+    if (!F.resolved) Resolver(globals).function(F);
+}
+
+static constexpr uint32_t kForcing = 0x80000000u;  // check/switch state while its arm runs; low bits: ThunkKind
+
+Ref<Environment> Interpreter::capture(const Function& F, const Value* params){
+    auto E = makeRef<Environment>(F.captured.get(), std::vector<Value>(params, params+F.params.size()));
+    E->charge(E->slots.capacity()*sizeof(Value));
+    return E;
+}
+
+Value Interpreter::variable(const ASTNode& n){
+    if (n.depth==ASTNode::Global) return loadGlobal(n.slot, "Undefined identifier: ");
+    if (n.depth==0) return stack[frames.back().base+n.slot];
+    if (n.depth>0) return frames.back().fn->captured->up(n.depth-1).slots[n.slot];
+    Value v;
+    if (!globals.get(n.sym, v)) throw std::runtime_error("Undefined identifier: "+n.text());
+    return v;
+}
+
+// Evaluates n onto the stack: leaves at once, calls by scheduling a task.
+void Interpreter::push(NodeRef n, bool tail, uint8_t force){
+    switch(n->kind){
+        case ASTKind::Number: stack.push_back(Value(n->number)); return;
+        case ASTKind::String: stack.push_back(symbols().value(n->sym)); return;
+        case ASTKind::Identifier: stack.push_back(variable(*n)); return;
+        case ASTKind::Call:
+            if (n->var==VarOp::Get){ stack.push_back(loadGlobal(n->slot, "Undefined variable: ")); return; }
+            if (n->var==VarOp::None){
+                Site s = site(n);   // a copy: the builtin leafCall runs may add sites
+                if (leafCall(n, s)) return;
+                tasks.push_back(Task{n, 0, tail, force, s.form});
+                return;
+            }
+            tasks.push_back(Task{n, 0, tail, force});
+            return;
+    }
+}
+
+Interpreter::Site& Interpreter::site(NodeRef n){
+    if (n.ast->serial!=sitesSerial) attachSites(*n.ast);
+    size_t id = size_t(n.n-n.ast->nodes.data());
+    if (id>=sites->size()) sites->resize(n.ast->nodes.size());
+    Site& s = (*sites)[id];
+    if (s.version!=functionsVersion+1) fillSite(s, *n);
+    return s;
+}
+
+void Interpreter::attachSites(const AST& ast){
+    auto it = siteTables.find(ast.serial);
+    if (it==siteTables.end()){
+        // --stream parses every statement into a pool of its own
+        if (siteTables.size()>=64) siteTables.clear();
+        it = siteTables.emplace(ast.serial, std::vector<Site>(ast.nodes.size())).first;
+    }
+    sitesSerial = ast.serial;
+    sites = &it->second;
+}
+
+void Interpreter::fillSite(Site& s, const ASTNode& n){
+    static const Symbol seqSym = intern("seq"), checkSym = intern("check"), switchSym = intern("switch"),
+                        lambda0Sym = intern("lambda0"), lambdaSym = intern("lambda");
+    s = Site();
+    s.version = functionsVersion+1;
+    auto it = functions.find(n.sym);
+    if (it==functions.end()) return;
+    s.fn = it->second.get();
+    s.form = Form::Call;
+    if (n.sym==seqSym) s.form = Form::Seq;
+    else if (n.sym==checkSym) s.form = Form::Check;
+    else if (n.sym==switchSym) s.form = Form::Switch;
+    else if (n.sym==lambda0Sym || n.sym==lambdaSym) s.form = Form::Lambda;
+    else if (s.fn->binary!=BinaryOp::None && n.argc==2){ s.form = Form::Binary; s.op = s.fn->binary; }
+}
+
+// What the builtin for op gives for ab[0] and ab[1] when they are numbers;
+// false when they are not, or it would throw (its own call says why).
+static bool binary(BinaryOp op, const Value* ab, double& r){
+    if (!ab[0].isNum() || !ab[1].isNum()) return false;
+    double a = ab[0].num(), b = ab[1].num();
+    switch(op){
+        case BinaryOp::None: return false;
+        case BinaryOp::Add: r = 0.0+a+b; return true;   // add's sum starts at 0 (-0 gives 0)
+        case BinaryOp::Sub: r = a-b; return true;
+        case BinaryOp::Mul: r = a*b; return true;
+        case BinaryOp::Div: if (b==0.0) return false; r = a/b; return true;
+        case BinaryOp::Mod: if (b==0.0) return false; r = std::fmod(a, b); return true;
+        case BinaryOp::Eq: r = a==b; return true;
+        case BinaryOp::Ne: r = a!=b; return true;
+        case BinaryOp::Lt: r = a<b; return true;
+        case BinaryOp::Le: r = a<=b; return true;
+        case BinaryOp::Gt: r = a>b; return true;
+        case BinaryOp::Ge: r = a>=b; return true;
+    }
+    return false;
+}
+
+static bool isLeaf(const ASTNode& a){ return a.kind!=ASTKind::Call || a.var==VarOp::Get; }
+
+// The value of Binary site n, whose op is `op`, when its operands are
+// leaves and other such sites, all numbers: nested arithmetic runs without
+// a task. False when it is not; a site whose operands were not numbers
+// counts a miss.
+bool Interpreter::quick(NodeRef n, BinaryOp op, double& r, uint32_t depth){
+    BinaryOp ops[2];
+    for (size_t i=0;i<2;++i){
+        const ASTNode& a = *n.arg(i);
+        if (a.kind!=ASTKind::Call || a.var==VarOp::Get) continue;
+        if (depth==kQuickDepth) return false;
+        const Site& s = site(n.arg(i));
+        if (s.form!=Form::Binary) return false;
+        ops[i] = s.op;
+    }
+    Value ab[2];
+    for (size_t i=0;i<2;++i){
+        NodeRef a = n.arg(i);
+        switch(a->kind){
+            case ASTKind::Number: ab[i] = Value(a->number); break;
+            case ASTKind::String: break;
+            case ASTKind::Identifier: ab[i] = variable(*a); break;
+            case ASTKind::Call:
+                if (a->var==VarOp::Get){ ab[i] = loadGlobal(a->slot, "Undefined variable: "); break; }
+                double x;
+                if (!quick(a, ops[i], x, depth+1)) return false;
+                ab[i] = Value(x);
+                break;
+        }
+    }
+    if (binary(op, ab, r)) return true;
+    Site& s = site(n);
+    if (++s.misses==kMaxMisses) s.form = Form::Call;
+    return false;
+}
+
+// A builtin applied to leaves needs no task: it runs at once. s is n's site.
+bool Interpreter::leafCall(NodeRef n, const Site& s){
+    double q;
+    if (s.form==Form::Binary && !profiler && quick(n, s.op, q, 0)){ stack.push_back(Value(q)); return true; }
+    for (size_t i=0;i<n->argc;++i) if (!isLeaf(*n.arg(i))) return false;
+    if ((s.form!=Form::Call && s.form!=Form::Binary) || !s.fn->isBuiltin) return false;
+    Function* F = s.fn;
+    size_t base = stack.size();
+    for (size_t i=0;i<n->argc;++i) push(n.arg(i));
+    Value r = native(*F, n->sym, stack.data()+base, n->argc);
+    stack.resize(base);
+    stack.push_back(std::move(r));
+    return true;
+}
+
+FuncPtr Interpreter::closure(NodeRef call){
+    FuncPtr F = makeLambda(call);
+    if (call->closure && !frames.empty()){
+        Frame& fr = frames.back();
+        if (!fr.snapshot) fr.snapshot = capture(*fr.fn, stack.data()+fr.base);
+        F->captured = fr.snapshot;
+    }
+    return F;
+}
+
+// The handlers below take the top task. Pushing a task may move `tasks`,
+// so they finish with `t` before they push.
+
+void Interpreter::step(){
+    Task& t = tasks.back();
+    if (!t.node){ ret(); return; }
+    const ASTNode& n = *t.node;
+    switch(n.var){
+        case VarOp::None: case VarOp::Get: break;
+        case VarOp::Set:
+        case VarOp::Declare:
+            if (t.state==0){
+                t.state = 1;
+                if (n.argc>=2) push(t.node.arg(1));
+                else stack.push_back(Value(0.0));
+                return;
+            }
+            beforeWrite(n.var==VarOp::Set ? "set" : "declare");
+            globals.bind(n.slot, stack.back());
+            tasks.pop_back();
+            return;
+    }
+    switch(t.form){
+        case Form::Seq: seq(t); return;
+        case Form::Check: check(t); return;
+        case Form::Switch: switchOn(t); return;
+        case Form::Lambda:
+            stack.push_back(Value(closure(t.node)));
+            tasks.pop_back();
+            return;
+        case Form::Variable: case Form::Call: case Form::Binary: call(t); return;
+    }
+}
+
+// seq(e1, ..., en): each value but the last is dropped; en takes seq's place.
+void Interpreter::seq(Task& t){
+    NodeRef n = t.node;
+    uint32_t i = t.state;
+    if (n->argc==0){ stack.push_back(Value()); tasks.pop_back(); return; }
+    if (i>0) stack.pop_back();
+    if (i+1==n->argc){
+        bool tail = t.tail; uint8_t force = t.force;
+        tasks.pop_back();
+        push(n.arg(i), tail, force);
+        return;
+    }
+    t.state = i+1;
+    push(n.arg(i));
+}
+
+// check(cond1, expr1, ..., elseExpr?): state 2k evaluates cond k, 2k+1 tests it.
+void Interpreter::check(Task& t){
+    if (t.state & kForcing){ forceArm(t); return; }
+    NodeRef n = t.node;
+    uint32_t s = t.state;
+    if (s%2==1){
+        bool truth = stack.back().truthy();
+        stack.pop_back();
+        if (truth){ arm(t, n.arg(s), ThenThunk); return; }
+        ++s;
+    }
+    if (s/2 < n->argc/2){ t.state = s+1; push(n.arg(s)); return; }
+    if (n->argc%2==1){ arm(t, n.arg(n->argc-1), ElseThunk); return; }
+    stack.push_back(Value());
+    tasks.pop_back();
+}
+
+// switch(value, case1, expr1, ..., defaultExpr?): state 1 has the subject,
+// then 2i evaluates case arg i and 2i+1 compares it.
+void Interpreter::switchOn(Task& t){
+    if (t.state & kForcing){ forceArm(t); return; }
+    NodeRef n = t.node;
+    size_t argc = n->argc;
+    uint32_t s = t.state;
+    if (s==0){
+        if (argc==0) throw std::runtime_error("switch(value, ...)");
+        t.state = 1;
+        push(n.arg(0));
+        return;
+    }
+    if (s==1){
+        stack.back() = Value(asNumStrict(stack.back()));   // numeric switch for simplicity
+        s = 2;
+    } else if (s%2==1){
+        size_t i = s/2;
+        double c = asNumStrict(stack.back());
+        stack.pop_back();
+        if (stack.back().num()==c){ stack.pop_back(); arm(t, n.arg(i+1), CaseThunk); return; }
+        s = uint32_t(2*(i+2));
+    }
+    size_t i = s/2;
+    if (i+1<argc){ t.state = s+1; push(n.arg(i)); return; }
+    stack.pop_back();
+    if (i<argc){ arm(t, n.arg(i), DefaultThunk); return; }
+    stack.push_back(Value());
+    tasks.pop_back();
+}
+
+// Runs the chosen arm; its value is forced by forceArm, or, when the arm
+// ends in a tail call, by the frame's return.
+void Interpreter::arm(Task& t, NodeRef e, ThunkKind kind){
+    bool tail = t.tail && t.force==0;
+    t.state = kForcing | kind;
+    push(e, tail, tail ? uint8_t(kind+1) : 0);
 }
 
-void Interpreter::registerBuiltin(const std::string& name, std::function<Value(std::vector<Value>&)> fn, int){
-    auto F = std::make_shared<Function>();
-    F->isBuiltin = true;
-    F->builtin = std::move(fn);
-    functions[name]=F;
+// An arm that yields a 0-arg function evaluates to that function's result.
+void Interpreter::forceArm(Task& t){
+    ThunkKind kind = ThunkKind(t.state & ~kForcing);
+    if (!stack.back().isFunc()){ tasks.pop_back(); return; }
+    if (!stack.back().asFunc()->params.empty()) throw std::runtime_error(kThunkErrors[kind]);
+    bool tail = t.tail; uint8_t force = t.force;
+    tasks.pop_back();
+    invoke(stack.size()-1, 0, NoSymbol, tail, force);
 }
 
-Value Interpreter::eval(ASTPtr node, Environment& env){
-    switch(node->kind){
-        case ASTKind::Number: return Value(node->number);
-        case ASTKind::String: return Value(node->text);
-        case ASTKind::Identifier: {
-            Value v;
-            if (!env.get(node->text, v)) throw std::runtime_error("Undefined identifier: "+node->text);
-            return v;
+// A call: the callee is resolved before the arguments run.
+void Interpreter::call(Task& t){
+    NodeRef n = t.node;
+    size_t argc = n->argc;
+    if (t.state==0){
+        if (Function* F = site(n).fn) stack.push_back(Value(FuncPtr(F)));
+        else {
+            // maybe variable holds a function?
+            Value callable;
+            if (n->depth>=0) callable = variable(*n);
+            else globals.get(n->sym, callable);
+            if (!callable.isFunc()) throw std::runtime_error("Unknown function: "+n->text());
+            stack.push_back(std::move(callable));
         }
-        case ASTKind::Call: {
-            auto itF = functions.find(node->text);
-            if (itF==functions.end()){
-                // maybe variable holds a function?
-                Value callable;
-                if (env.get(node->text, callable) && callable.isFunc()){
-                    itF = functions.end();
-                    // Temporarily register under a synthetic name
-                    auto F = callable.asFunc();
-                    std::vector<Value> argVals;
-                    argVals.reserve(node->args.size());
-                    for (auto& a: node->args) argVals.push_back(eval(a, env));
-                    if (F->isBuiltin) return F->builtin(argVals);
-                    // user func
-                    if (argVals.size()!=F->params.size())
-                        throw std::runtime_error("Arity mismatch calling function variable");
-                    Environment local(&env);
-                    for (size_t i=0;i<F->params.size();++i) local.declare(F->params[i], argVals[i]);
-                    return eval(F->body, local);
-                }
-                // else maybe it’s a user-defined function by name
-                auto itUF = functions.find(node->text);
-                if (itUF==functions.end()) throw std::runtime_error("Unknown function: "+node->text);
+        t.state = 1;
+    }
+    // a leaf argument may be a builtin that re-enters the interpreter, so
+    // `tasks` can move even when no task is added
+    for (uint32_t i = t.state; i<=argc; ++i){
+        tasks.back().state = i+1;
+        size_t pending = tasks.size();
+        push(n.arg(i-1));
+        if (tasks.size()!=pending) return;
+    }
+    if (tasks.back().form==Form::Binary && !profiler){
+        Site& s = site(n);
+        double r;
+        if (s.form==Form::Binary){
+            if (binary(s.op, stack.data()+stack.size()-2, r)){
+                stack.resize(stack.size()-3);
+                stack.push_back(Value(r));
+                tasks.pop_back();
+                return;
             }
-            auto F = functions[node->text];
-            std::vector<Value> argVals;
-            argVals.reserve(node->args.size());
-            for (auto& a: node->args) argVals.push_back(eval(a, env));
-            if (F->isBuiltin) return F->builtin(argVals);
-            // user-defined by name
-            if (argVals.size()!=F->params.size())
-                throw std::runtime_error("Arity mismatch for "+node->text);
-            Environment local(&env);
-            for (size_t i=0;i<F->params.size();++i) local.declare(F->params[i], argVals[i]);
-            return eval(F->body, local);
+            if (++s.misses==kMaxMisses) s.form = Form::Call;
+        }
+    }
+    bool tail = tasks.back().tail; uint8_t force = tasks.back().force;
+    tasks.pop_back();
+    invoke(stack.size()-argc-1, argc, n->sym, tail, force);
+}
+
+// Calls stack[pos] on the argc values above it; the result replaces them
+// all, now for builtins and compiled code, via ret() for user functions.
+void Interpreter::invoke(size_t pos, size_t argc, Symbol name, bool tail, uint8_t force){
+    FuncPtr F = stack[pos].asFunc();
+    if (F->isSpecial) throw std::runtime_error("special form cannot be called indirectly");
+    Value* argv = stack.data()+pos+1;
+    if (F->isBuiltin){
+        Value r = native(*F, name, argv, argc);
+        stack.resize(pos);
+        stack.push_back(std::move(r));
+        return;
+    }
+    if (argc!=F->params.size()){
+        if (name!=NoSymbol && functions.count(name)) throw std::runtime_error("Arity mismatch for "+symbolName(name));
+        throw std::runtime_error("Arity mismatch calling function variable");
+    }
+    Memo::Pending pending;
+    {
+        Value r;
+        if (recall(*F, name, argv, argc, !tail, r, pending)){
+            stack.resize(pos);
+            stack.push_back(std::move(r));
+            return;
+        }
+    }
+    // a call whose result is memoized runs here, so its own calls are looked up too
+    if (jitting() && !pending.id){
+        Value r;
+        if (profiler) profiler->enter(name);
+        if (jitCall(*this, *F, argv, argc, r)){
+            if (profiler) profiler->leave();
+            stack.resize(pos);
+            stack.push_back(std::move(r));
+            return;
+        }
+        if (profiler) profiler->cancel();
+    }
+    prepare(*F);
+    if (tail && !frames.empty()){
+        Frame& fr = frames.back();
+        if (!force || !fr.forces || fr.forceKind==force-1){
+            if (profiler) profiler->replace(name);
+            // replace the current call: what is left of it only passes the value on
+            std::move(stack.begin()+pos+1, stack.end(), stack.begin()+fr.base);
+            stack.resize(fr.base+argc);
+            fr.fn = std::move(F);
+            fr.snapshot.reset();
+            if (force){ fr.forceKind = force-1; ++fr.forces; }
+            tasks.resize(fr.tasks);
+            push(fr.fn->body, true);
+            return;
         }
     }
-    throw std::runtime_error("Invalid AST node");
+    if (profiler) profiler->enter(name);
+    frames.push_back(Frame{F, pos+1, tasks.size()+1});
+    if (pending.id){ frames.back().memoFn = std::move(F); frames.back().memoCall = pending; }
+    tasks.push_back(Task{});
+    push(frames.back().fn->body, true);
+}
+
+void Interpreter::ret(){
+    Frame& fr = frames.back();
+    if (fr.forces && stack.back().isFunc()){
+        if (!stack.back().asFunc()->params.empty()) throw std::runtime_error(kThunkErrors[fr.forceKind]);
+        --fr.forces;
+        invoke(stack.size()-1, 0, NoSymbol, true, 0);
+        return;
+    }
+    Value r = std::move(stack.back());
+    if (fr.memoFn) fr.memoFn->memo.finish(fr.memoCall, r);
+    stack.resize(fr.base-1);
+    stack.push_back(std::move(r));
+    frames.pop_back();
+    tasks.pop_back();
+    if (profiler) profiler->leave();
 }
 
-void Interpreter::run(const std::vector<ASTPtr>& program){
-    Environment env(&globals);
-    for (auto& stmt: program){
-        eval(stmt, env);
+void Interpreter::resetBudget(){
+    heap->cap = budget.bytes;
+    stepsUsed = nanosUsed = 0;
+    given = fuel = budget.steps ? std::min(kCheck, budget.steps+1) : kCheck;
+    checked = sliceBegan = steadyNanos();
+}
+
+bool Interpreter::outOfFuel(){
+    stepsUsed += given-fuel;
+    // the last slice may take one step more than the budget: that step fails
+    if (budget.steps && stepsUsed>budget.steps){
+        given = fuel = 1;    // and so does every step after it
+        throw std::runtime_error("Step budget exceeded ("+std::to_string(budget.steps)+" steps)");
+    }
+    uint64_t now = steadyNanos();
+    if (budget.nanos){
+        nanosUsed += now-checked;
+        if (nanosUsed>budget.nanos){
+            given = fuel = 1;
+            throw std::runtime_error("Time budget exceeded ("+std::to_string(budget.nanos/1000000)+" ms)");
+        }
+    }
+    // worker contexts leave their stacks out: they share the Heap (and the globals)
+    if (!inParallel()){
+        size_t bytes = stack.capacity()*sizeof(Value)+tasks.capacity()*sizeof(Task)+frames.capacity()*sizeof(Frame)+vmFrameBytes
+                     +globals.bytes();
+        try { heap->setStacks(bytes); }
+        catch (...){ given = fuel = 1; throw; }
+    }
+    checked = now;
+    given = fuel = budget.steps ? std::min(kCheck, budget.steps-stepsUsed+1) : kCheck;
+    return now-sliceBegan>=kSliceNanos;
+}
+
+void Interpreter::proceed(){
+    checked = sliceBegan = steadyNanos();
+    outOfFuel();
+}
+
+// After an error: back to `depth` tasks, `calls` frames and `height` values.
+void Interpreter::unwind(size_t depth, size_t calls, size_t height, size_t profiled){
+    tasks.resize(depth);
+    for (size_t f=calls; f<frames.size(); ++f) if (frames[f].memoFn) frames[f].memoFn->memo.abandon(frames[f].memoCall);
+    frames.resize(calls);
+    stack.resize(height);
+    if (profiler) profiler->unwind(profiled);
+}
+
+// Runs start(), which leaves a value or a task on the stack, and then the
+// tasks it scheduled; returns the value.
+template<class Start>
+Value Interpreter::drive(Start start){
+    size_t depth = tasks.size(), calls = frames.size(), height = stack.size();
+    size_t profiled = profiler ? profiler->depth() : 0;
+    HeapScope scope(heap);
+    try {
+        start();
+        while (tasks.size()>depth){
+            step();
+            if (__builtin_expect(--fuel==0, 0)) outOfFuel();
+        }
+    } catch (...){
+        unwind(depth, calls, height, profiled);
+        throw;
+    }
+    Value r = std::move(stack.back());
+    stack.pop_back();
+    return r;
+}
+
+Value Interpreter::exec(NodeRef root){
+    return drive([&]{ push(root); });
+}
+
+Value Interpreter::apply(const FuncPtr& F, const Value* argv, size_t argc){
+    return drive([&]{
+        size_t pos = stack.size();
+        stack.push_back(Value(F));
+        for (size_t i=0;i<argc;++i) stack.push_back(argv[i]);
+        invoke(pos, argc, NoSymbol, false, 0);
+    });
+}
+
+void Interpreter::run(const ASTPtr& program){
+    proceed();
+    Resolver(globals).program(*program);
+    for (NodeId stmt: program->stmts) exec(NodeRef(*program, stmt));
+}
+
+void Interpreter::start(const Program& program){
+    if (program.runtime!=runtime) throw std::runtime_error("program was built for another runtime");
+    beforeWrite("run");
+    globals.reset(program.layout);
+    // newname only ever adds names
+    if (functions.size()!=runtime->builtins.size()){
+        functions = runtime->builtins;
+        functionsVersion = newVersion();
+        workerContexts.clear();   // their copies of the functions
+    }
+    heap->reset();
+    resetBudget();
+}
+
+void Interpreter::run(const Program& program){
+    begin(program);
+    while (!resume()){}
+}
+
+void Interpreter::begin(const Program& program){
+    start(program);
+    resuming = &program;
+    nextStmt = 0;
+}
+
+bool Interpreter::resume(){
+    AST& ast = *resuming->ast;
+    HeapScope scope(heap);
+    try {
+        proceed();
+        for (;;){
+            while (!tasks.empty()){
+                step();
+                if (__builtin_expect(--fuel==0, 0) && outOfFuel()) return false;
+            }
+            stack.clear();   // the value of the statement that ended
+            if (nextStmt==ast.stmts.size()) break;
+            push(NodeRef(ast, ast.stmts[nextStmt++]));
+        }
+    } catch (...){
+        unwind(0, 0, 0, 0);
+        resuming = nullptr;
+        throw;
     }
+    resuming = nullptr;
+    out->flush();
+    return true;
 }
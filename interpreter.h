@@ -1,17 +1,222 @@
 #pragma once
 #include "ast.h"
 #include "environment.h"
+#include "runtime.h"
+#include "output.h"
+#include <atomic>
 #include <unordered_map>
 #include <iostream>
+#include <memory>
 
+// What a check/switch arm was, for the error when it yields a function that
+// takes arguments (kThunkErrors[kind]).
+enum ThunkKind : uint8_t { ThenThunk, ElseThunk, CaseThunk, DefaultThunk };
+extern const char* const kThunkErrors[4];
+
+struct Profiler;
+struct Program;
+
+// What one run may use (--max-steps, --max-time); a run that goes over
+// fails with an error. Steps are those of the tree walker or instructions
+// of the VM; time is the run's own, not time spent waiting to be scheduled.
+// Both are checked every kCheck steps.
+struct Budget {
+    uint64_t steps = 0;      // 0: no limit
+    uint64_t nanos = 0;      // 0: no limit
+    uint64_t bytes = 0;      // --max-memory: of the context's Heap; 0: no limit
+};
+
+// Tree-walking engine. Evaluation does not recurse on the C++ stack: pending
+// work is a stack of Tasks, each call gets a Frame, and operands, arguments
+// and parameters share the value `stack`. A call in tail position reuses the
+// frame it is made from, so tail-recursive loops run in constant space.
+//
+// An Interpreter is also the execution context the VM runs in. Making one is
+// cheap: the builtins come from a shared Runtime, and a Program is only
+// read, so one Runtime and one Program can serve a context per thread.
+//
+// Call sites quicken as they run. The first time a call node runs in a
+// context it records what its name calls (a Site), valid until the
+// functions change; a special form then runs without comparing names, and
+// a builtin like add or gt applied to two numbers is computed in place,
+// without a native call. Operands that are not two numbers (or a zero
+// divisor) take the builtin's own path; a site that keeps seeing them
+// stops trying. The Program is shared, so the Sites live in the context.
+//
+// Parallel builtins run their tasks on worker contexts (see workers()): each
+// has its own stacks and its own copies of the functions, so calls on
+// different threads touch different objects, and reads the globals of the
+// context that made it, which stay unchanged while the tasks run.
+//
+// The objects a context makes come from its own Heap, which counts them
+// (memory()); the worker contexts share it.
+//
+// Both engines burn `fuel`, a step each, and check the Budget when it runs
+// out, the size of their stacks and of the globals included. A run of a
+// Program can also go in slices (begin(), then resume() until it is done),
+// each ending at the first check kSliceNanos after it began, which is how
+// the Scheduler interleaves many runs on a few threads.
 struct Interpreter {
-    Environment globals;
-    std::unordered_map<std::string, FuncPtr> functions; // name -> function
+    Heap* const heap;             // of this context's objects; shared with the worker contexts
+    SymbolOwner names;            // what declare, set, get and newname interned (see symbols.h)
+    Ref<Environment> globalScope;  // owns `globals`; shared with the worker contexts
+    Environment& globals;
+    std::shared_ptr<const Runtime> runtime; // the builtins; newname may not rebind them
+    std::unordered_map<Symbol, FuncPtr> functions; // name -> function: the builtins, then newname's
+    uint64_t functionsVersion = newVersion(); // new whenever `functions` changes; no two contexts share one
+    std::vector<Value> stack; // operands, arguments and parameters; shared with the VM
+    Output* out = &standardOutput; // where print writes; flushed when a Program has run
+    bool jit = false;         // --jit: compile hot numeric functions (see jit.h); see jitting()
+    bool memo = true;         // --no-memo turns off memoizing pure functions (see memo.h)
+    Profiler* profiler = nullptr; // --profile: told about every call the engines make (see profiler.h)
+    bool readOnly = false;    // a worker context, or one running parallel tasks itself
+    Budget budget;            // of every run from start() or begin() on; worker contexts get it too
+    uint64_t fuel = kCheck;   // steps left until the budget is checked; the VM burns it too
+    size_t vmFrameBytes = 0;  // the VM's frames, as of its last check
+
+    static constexpr uint64_t kCheck = 1<<11;
+    static constexpr uint64_t kSliceNanos = 1000000;
+
+    // `upstream` gives the Heap its memory.
+    explicit Interpreter(std::shared_ptr<const Runtime> rt = Runtime::standard(), Allocator& upstream = systemAllocator());
+    ~Interpreter();
+    Interpreter(const Interpreter&) = delete;
+    Interpreter& operator=(const Interpreter&) = delete;
+
+    const Heap& memory() const { return *heap; }
+    // A functionsVersion no context has had yet.
+    static uint64_t newVersion(){ static std::atomic<uint64_t> next{0}; return ++next; }
+
+    // Runs a program resolved against this context's globals, which keep
+    // what earlier runs left (--stream runs one statement at a time).
+    void run(const ASTPtr& program);
+    // Runs a shared program from empty globals and only the builtins.
+    void run(const Program& program);
+    // Empties globals and functions for a run of `program`; the VM's run calls it too.
+    void start(const Program& program);
+    // run(program) in slices: begin() starts the run, and each resume() goes
+    // on with it for about kSliceNanos, returning true once it has ended.
+    // An error ends the run and is thrown by resume().
+    void begin(const Program& program);
+    bool resume();
+
+    // Counts the steps taken since fuel was last given, throws when the run
+    // is over its budget, and gives fuel for kCheck more. True once the
+    // slice has had its time.
+    bool outOfFuel();
+    // The same when a run goes on after a pause (the next --stream
+    // statement, the next slice), which is not counted as the run's time.
+    void proceed();
+
+    // Calls F on argv[0..argc) from native code and returns its result.
+    // argv must not point into `stack`.
+    Value apply(const FuncPtr& F, const Value* argv, size_t argc);
+
+    // Execution contexts for n threads, made on first use and again after
+    // `functions` has changed.
+    std::vector<Interpreter*> workers(size_t n);
+
+    // Throws when this context runs the tasks of a parallel builtin: globals
+    // and functions are read-only then. `what` names the operation.
+    void beforeWrite(const char* what) const;
+
+    // Calls builtin F on argv[0..argc), which must not move while it runs
+    // (normally the top of `stack`). `name` is only used for errors.
+    Value callNative(const Function& F, Symbol name, Value* argv, size_t argc){
+        if (argc<F.minArity) arityError(F, name);
+        return F.native(*this, Args{argv, argc});
+    }
+    // Looks a call of user function F up in its memo: true with the result
+    // in `r`. Otherwise, with `reserve`, `pending` may name an entry to fill
+    // when the call returns.
+    bool recall(Function& F, Symbol name, const Value* argv, size_t argc, bool reserve, Value& r, Memo::Pending& pending){
+        if (!memo || (F.memo.checked==functionsVersion+1 && !F.memo.active(functionsVersion))) return false;
+        return recallSlow(F, name, argv, argc, reserve, r, pending);
+    }
+    // Machine code burns no fuel, so a run with a budget does not tier up.
+    bool jitting() const { return jit && !budget.steps && !budget.nanos; }
+    // callNative for the engines' own calls, which the profiler sees
+    Value native(const Function& F, Symbol name, Value* argv, size_t argc){
+        return profiler ? profiledNative(F, name, argv, argc) : callNative(F, name, argv, argc);
+    }
+
+    // statically resolved variable access (see resolver.h)
+    const Value& loadGlobal(uint32_t slot, const char* undefinedMsg) const;
+    void prepare(Function& F); // resolve a user function body before its first call
+
+    // Snapshot of the parameters of a call of F, for the closures created in
+    // it; chained to what F itself captured.
+    static Ref<Environment> capture(const Function& F, const Value* params);
+
+private:
+    // What a call node's name calls in this context (see the top).
+    enum class Form : uint8_t { Variable, Seq, Check, Switch, Lambda, Call, Binary };
+    struct Site {
+        uint64_t version = 0;    // functionsVersion+1 when filled in
+        Function* fn = nullptr;  // null for Variable: no function has the name
+        Form form = Form::Variable;
+        BinaryOp op = BinaryOp::None; // for Binary
+        uint8_t misses = 0;      // Binary operands that were not two numbers
+    };
+    struct Task {
+        NodeRef node;            // null: the return of the innermost frame
+        uint32_t state = 0;
+        bool tail = false;       // its value becomes the value of the current call...
+        uint8_t force = 0;       // ...after forcing it as arm kind force-1, if set
+        Form form = Form::Call;  // of the node's site when the task was made
+    };
+    static constexpr uint8_t kMaxMisses = 8;  // then a Binary site becomes a Call
+    static constexpr uint32_t kQuickDepth = 8; // nesting of Binary sites quick() computes
+    struct Frame {
+        FuncPtr fn;
+        size_t base = 0;         // parameters are stack[base..); the callee sits just below
+        size_t tasks = 0;        // task count up to and including this frame's return task
+        Ref<Environment> snapshot{}; // parameters as captured by closures, made on first use
+        uint32_t forces = 0;     // arms left by tail calls, still to force on return...
+        uint8_t forceKind = 0;   // ...all of this ThunkKind
+        FuncPtr memoFn{};        // whose memo gets the result, at `memoCall`
+        Memo::Pending memoCall{};
+    };
+    Output standardOutput{std::cout};
+    std::vector<Task> tasks;
+    std::vector<Frame> frames;
+    std::vector<std::unique_ptr<Interpreter>> workerContexts;
+    uint64_t workersVersion = 0;   // functionsVersion they copied
+    std::unordered_map<uint64_t, std::vector<Site>> siteTables; // AST::serial -> a Site per node
+    uint64_t sitesSerial = 0;      // the table last used...
+    std::vector<Site>* sites = nullptr; // ...and where it is
+    bool ownsHeap = true;          // false for a worker context
+    uint64_t given = kCheck;       // fuel at the last check
+    uint64_t stepsUsed = 0, nanosUsed = 0; // by the run up to the last check
+    uint64_t checked = 0;          // steady clock, ns, at the last check...
+    uint64_t sliceBegan = 0;       // ...and when the slice began
+    const Program* resuming = nullptr; // begun and not ended...
+    size_t nextStmt = 0;           // ...with this statement to run next
 
-    Interpreter();
-    Value eval(ASTPtr node, Environment& env);
-    void run(const std::vector<ASTPtr>& program);
+    explicit Interpreter(Interpreter* parent);   // a worker context
+    void resetBudget();
+    void unwind(size_t depth, size_t calls, size_t height, size_t profiled);
+    template<class Start> Value drive(Start start);
+    Value exec(NodeRef root);
+    void step();
+    void push(NodeRef n, bool tail=false, uint8_t force=0);
+    bool leafCall(NodeRef n, const Site& s);
+    bool quick(NodeRef n, BinaryOp op, double& r, uint32_t depth);
+    Site& site(NodeRef n);
+    void attachSites(const AST& ast);
+    void fillSite(Site& s, const ASTNode& n);
+    Value variable(const ASTNode& n);
+    FuncPtr closure(NodeRef call);
+    void call(Task& t);
+    void seq(Task& t);
+    void check(Task& t);
+    void switchOn(Task& t);
+    void arm(Task& t, NodeRef e, ThunkKind kind);
+    void forceArm(Task& t);
+    void invoke(size_t pos, size_t argc, Symbol name, bool tail, uint8_t force);
+    void ret();
 
-    // registration
-    void registerBuiltin(const std::string& name, std::function<Value(std::vector<Value>&)> fn, int minArity=-1);
+    Value profiledNative(const Function& F, Symbol name, Value* argv, size_t argc);
+    bool recallSlow(Function& F, Symbol name, const Value* argv, size_t argc, bool reserve, Value& r, Memo::Pending& pending);
+    [[noreturn]] static void arityError(const Function& F, Symbol name);
 };
@@ -0,0 +1,302 @@
+#include "jit.h"
+#include <cmath>
+#include <cstring>
+#include <initializer_list>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define CALLIX_JIT 1
+#else
+#define CALLIX_JIT 0
+#endif
+
+// Written by the code on the way out: 0 ok, else why it gave up. `depth` is
+// how many more nested self-calls the machine stack may take.
+struct JitStatus { uint8_t code = 0; uint32_t depth = 0; };
+enum : uint8_t { JitOk = 0, JitArith = 2, JitDepth = 3 };
+static constexpr uint32_t kJitMaxDepth = 10000;
+
+struct JitCode {
+    void* mem = nullptr;
+    size_t size = 0;
+    double (*entry)(const double* args, JitStatus* status) = nullptr;
+    uint64_t version = 0;    // Interpreter::functionsVersion it was compiled under
+    Heap* heap = nullptr;    // of the Function, charged for the pages while they are mapped
+
+    ~JitCode(){
+#if CALLIX_JIT
+        if (mem) munmap(mem, size);
+#endif
+        if (heap) heap->refund(size);
+    }
+};
+
+static constexpr size_t kMaxJitParams = 16;
+
+#if CALLIX_JIT
+
+// Single-pass code generator. Every expression leaves its value in xmm0;
+// intermediates are spilled to the machine stack. Registers: rbx = argument
+// array, r12 = JitStatus*, rbp = frame; rsp is 16-byte aligned whenever
+// `depth` (8-byte spills) is even.
+struct JitCompiler {
+    Interpreter& I;
+    Function& F;
+    std::vector<uint8_t> c;
+    int depth = 0;
+    size_t body = 0;                                // start of the body, for tail self-calls
+    std::vector<size_t> toArith, toDepth, toExit;   // rel32 fields to patch
+
+    JitCompiler(Interpreter& in, Function& f): I(in), F(f) {}
+
+    void b(std::initializer_list<int> bytes){ for (int x: bytes) c.push_back(uint8_t(x)); }
+    void u32(uint32_t v){ for (int i=0;i<4;++i) c.push_back(uint8_t(v>>(8*i))); }
+    void u64(uint64_t v){ for (int i=0;i<8;++i) c.push_back(uint8_t(v>>(8*i))); }
+
+    size_t rel32(){ size_t at = c.size(); u32(0); return at; }
+    size_t jcc(int cc){ b({0x0F, cc}); return rel32(); }     // 0x84 je, 0x85 jne, 0x8A jp
+    size_t jmp(){ b({0xE9}); return rel32(); }
+    void bind(size_t at){ bindTo(at, c.size()); }
+    void bindTo(size_t at, size_t target){
+        uint32_t d = uint32_t(int32_t(target-(at+4)));
+        std::memcpy(&c[at], &d, 4);
+    }
+
+    void loadImm(double v, int xmm){             // mov rax, imm64; movq xmmN, rax
+        uint64_t bits; std::memcpy(&bits, &v, 8);
+        b({0x48, 0xB8}); u64(bits);
+        b({0x66, 0x48, 0x0F, 0x6E, 0xC0 | xmm<<3});
+    }
+    void movRaxImm(const void* p){ b({0x48, 0xB8}); u64(uint64_t(uintptr_t(p))); }
+    void push(){ b({0x48, 0x83, 0xEC, 0x08}); b({0xF2, 0x0F, 0x11, 0x04, 0x24}); ++depth; }
+    void pop(int xmm){ b({0xF2, 0x0F, 0x10, 0x04 | xmm<<3, 0x24}); b({0x48, 0x83, 0xC4, 0x08}); --depth; }
+    void loadTop(int xmm){ b({0xF2, 0x0F, 0x10, 0x04 | xmm<<3, 0x24}); }
+    void storeTop(int xmm){ b({0xF2, 0x0F, 0x11, 0x04 | xmm<<3, 0x24}); }
+    void subRsp(uint32_t n){ b({0x48, 0x81, 0xEC}); u32(n); }
+    void addRsp(uint32_t n){ b({0x48, 0x81, 0xC4}); u32(n); }
+
+    // xmm0 == 0.0 (either sign) jumps to the division-by-zero exit
+    void zeroCheck(){
+        b({0x66, 0x0F, 0x57, 0xD2});            // xorpd xmm2, xmm2
+        b({0x66, 0x0F, 0x2E, 0xC2});            // ucomisd xmm0, xmm2
+        size_t nan = jcc(0x8A);
+        toArith.push_back(jcc(0x84));
+        bind(nan);
+    }
+
+    // acc = identity or first; acc = acc <op> arg for the rest, in order
+    bool fold(NodeRef n, int opcode, const double* identity, bool divisor){
+        size_t i = 0;
+        if (identity) loadImm(*identity, 0);
+        else if (!expr(n.arg(i++))) return false;
+        push();
+        for (; i<n->argc; ++i){
+            if (!expr(n.arg(i))) return false;
+            if (divisor) zeroCheck();
+            loadTop(1);
+            b({0xF2, 0x0F, opcode, 0xC8});       // <op>sd xmm1, xmm0
+            storeTop(1);
+        }
+        pop(0);
+        return true;
+    }
+
+    // a in xmm1, b in xmm0; `swap` compares b against a instead
+    bool compare(NodeRef n, int predicate, bool swap){
+        if (n->argc!=2 || !expr(n.arg(0))) return false;
+        push();
+        if (!expr(n.arg(1))) return false;
+        pop(1);
+        loadImm(1.0, 2);
+        if (swap){
+            b({0xF2, 0x0F, 0xC2, 0xC1, predicate}); // cmpsd xmm0, xmm1
+            b({0x66, 0x0F, 0x54, 0xC2});             // andpd xmm0, xmm2
+        } else {
+            b({0xF2, 0x0F, 0xC2, 0xC8, predicate}); // cmpsd xmm1, xmm0
+            b({0x66, 0x0F, 0x54, 0xCA});             // andpd xmm1, xmm2
+            b({0x66, 0x0F, 0x28, 0xC1});             // movapd xmm0, xmm1
+        }
+        return true;
+    }
+
+    bool mod(NodeRef n){
+        if (n->argc!=2 || !expr(n.arg(0))) return false;
+        push();
+        if (!expr(n.arg(1))) return false;
+        zeroCheck();
+        pop(1);
+        b({0x66, 0x0F, 0x28, 0xD0});             // movapd xmm2, xmm0
+        b({0x66, 0x0F, 0x28, 0xC1});             // movapd xmm0, xmm1
+        b({0x66, 0x0F, 0x28, 0xCA});             // movapd xmm1, xmm2
+        double (*fmodFn)(double, double) = std::fmod;
+        if (depth%2) subRsp(8);
+        movRaxImm(reinterpret_cast<const void*>(fmodFn));
+        b({0xFF, 0xD0});                          // call rax
+        if (depth%2) addRsp(8);
+        return true;
+    }
+
+    bool check(NodeRef n, bool tail){
+        if (n->argc%2==0) return false;           // no else arm: the result may be nil
+        std::vector<size_t> ends;
+        for (size_t i=0;i+1<n->argc;i+=2){
+            if (!expr(n.arg(i))) return false;
+            b({0x66, 0x0F, 0x57, 0xC9});         // xorpd xmm1, xmm1
+            b({0x66, 0x0F, 0x2E, 0xC1});         // ucomisd xmm0, xmm1
+            size_t nan = jcc(0x8A);               // NaN is truthy
+            size_t next = jcc(0x84);
+            bind(nan);
+            if (!expr(n.arg(i+1), tail)) return false;
+            ends.push_back(jmp());
+            bind(next);
+        }
+        if (!expr(n.arg(n->argc-1), tail)) return false;
+        for (size_t e: ends) bind(e);
+        return true;
+    }
+
+    // In tail position the new arguments overwrite the current ones and the
+    // body starts over, so tail recursion does not grow the machine stack.
+    bool selfCall(NodeRef n, bool tail){
+        uint32_t argc = n->argc;
+        uint32_t pad = (depth+argc)%2;
+        uint32_t bytes = 8*(argc+pad);
+        if (bytes) subRsp(bytes);
+        depth += argc+pad;
+        for (uint32_t i=0;i<argc;++i){
+            if (!expr(n.arg(i))) return false;
+            b({0xF2, 0x0F, 0x11, 0x84, 0x24}); u32(8*i);   // movsd [rsp+8i], xmm0
+        }
+        if (tail){
+            for (uint32_t i=0;i<argc;++i){
+                b({0xF2, 0x0F, 0x10, 0x84, 0x24}); u32(8*i);   // movsd xmm0, [rsp+8i]
+                b({0xF2, 0x0F, 0x11, 0x83}); u32(8*i);         // movsd [rbx+8i], xmm0
+            }
+            if (bytes) addRsp(bytes);
+            depth -= argc+pad;
+            bindTo(jmp(), body);
+            return true;
+        }
+        b({0x41, 0x83, 0x6C, 0x24, 0x04, 0x01});  // sub dword [r12+4], 1
+        toDepth.push_back(jcc(0x84));
+        b({0x48, 0x89, 0xE7});                    // mov rdi, rsp
+        b({0x4C, 0x89, 0xE6});                    // mov rsi, r12
+        b({0xE8}); bindTo(rel32(), 0);            // call <entry>
+        b({0x41, 0x83, 0x44, 0x24, 0x04, 0x01});  // add dword [r12+4], 1
+        if (bytes) addRsp(bytes);
+        depth -= argc+pad;
+        b({0x41, 0x80, 0x3C, 0x24, 0x00});        // cmp byte [r12], 0
+        toExit.push_back(jcc(0x85));
+        return true;
+    }
+
+    bool expr(NodeRef n, bool tail=false){
+        static const Symbol add = intern("add"), subtract = intern("subtract"), multiply = intern("multiply"),
+                            division = intern("division"), modSym = intern("mod"), checkSym = intern("check"),
+                            eq = intern("eq"), ne = intern("ne"), lt = intern("lt"),
+                            le = intern("le"), gt = intern("gt"), ge = intern("ge");
+        static const double zero = 0.0, one = 1.0;
+        switch(n->kind){
+            case ASTKind::Number: loadImm(n->number, 0); return true;
+            case ASTKind::String: return false;
+            case ASTKind::Identifier:
+                if (n->depth!=0) return false;
+                b({0xF2, 0x0F, 0x10, 0x83}); u32(8*n->slot);   // movsd xmm0, [rbx+8*slot]
+                return true;
+            case ASTKind::Call: break;
+        }
+        if (n->var!=VarOp::None) return false;
+        Symbol s = n->sym;
+        if (s==add) return fold(n, 0x58, &zero, false);
+        if (s==multiply) return fold(n, 0x59, &one, false);
+        if (s==subtract) return n->argc>=1 && fold(n, 0x5C, nullptr, false);
+        if (s==division) return n->argc>=2 && fold(n, 0x5E, nullptr, true);
+        if (s==modSym) return mod(n);
+        if (s==eq) return compare(n, 0, false);
+        if (s==ne) return compare(n, 4, false);
+        if (s==lt) return compare(n, 1, false);
+        if (s==le) return compare(n, 2, false);
+        if (s==gt) return compare(n, 1, true);
+        if (s==ge) return compare(n, 2, true);
+        if (s==checkSym) return check(n, tail);
+        auto it = I.functions.find(s);
+        if (it!=I.functions.end() && it->second.get()==&F && n->argc==F.params.size()) return selfCall(n, tail);
+        return false;
+    }
+
+    std::shared_ptr<JitCode> compile(){
+        if (F.params.size()>kMaxJitParams) return nullptr;
+        b({0x55});                                // push rbp
+        b({0x48, 0x89, 0xE5});                    // mov rbp, rsp
+        b({0x53});                                // push rbx
+        b({0x41, 0x54});                          // push r12
+        b({0x48, 0x89, 0xFB});                    // mov rbx, rdi
+        b({0x49, 0x89, 0xF4});                    // mov r12, rsi
+        body = c.size();
+        if (!expr(F.body, true)) return nullptr;
+        size_t exit = c.size();
+        b({0x48, 0x8D, 0x65, 0xF0});              // lea rsp, [rbp-16]
+        b({0x41, 0x5C});                          // pop r12
+        b({0x5B});                                // pop rbx
+        b({0x5D});                                // pop rbp
+        b({0xC3});                                // ret
+        size_t arith = c.size();
+        b({0x41, 0xC6, 0x04, 0x24, JitArith});
+        bindTo(jmp(), exit);
+        size_t tooDeep = c.size();
+        b({0x41, 0xC6, 0x04, 0x24, JitDepth});
+        bindTo(jmp(), exit);
+        for (size_t at: toArith) bindTo(at, arith);
+        for (size_t at: toDepth) bindTo(at, tooDeep);
+        for (size_t at: toExit) bindTo(at, exit);
+
+        size_t page = size_t(sysconf(_SC_PAGESIZE));
+        auto code = std::make_shared<JitCode>();
+        code->size = (c.size()+page-1)/page*page;
+        // the copies of F that share the code (worker contexts') are on its Heap too
+        if (Heap* h = F.heap()){ h->charge(code->size); code->heap = h; }
+        void* mem = mmap(nullptr, code->size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (mem==MAP_FAILED) return nullptr;
+        code->mem = mem;
+        std::memcpy(mem, c.data(), c.size());
+        if (mprotect(mem, code->size, PROT_READ|PROT_EXEC)!=0) return nullptr;
+        code->entry = reinterpret_cast<double(*)(const double*, JitStatus*)>(mem);
+        code->version = I.functionsVersion;
+        return code;
+    }
+};
+
+#endif
+
+bool jitCall(Interpreter& I, Function& F, const Value* argv, size_t argc, Value& out){
+#if CALLIX_JIT
+    // self-calls were bound by name under that version, which no other
+    // context has (a worker's copy of F, or F run after its context is gone)
+    if (F.jit && F.jit->version!=I.functionsVersion){ F.jit.reset(); F.calls = 0; }
+    if (!F.jit){
+        if (F.jitRejected || ++F.calls<kJitThreshold) return false;
+        I.prepare(F);
+        F.jit = JitCompiler(I, F).compile();
+        if (!F.jit){ F.jitRejected = true; return false; }
+    }
+    double args[kMaxJitParams];
+    for (size_t i=0;i<argc;++i){
+        if (!argv[i].isNum()) return false;
+        args[i] = argv[i].num();
+    }
+    JitStatus status;
+    status.depth = kJitMaxDepth;
+    double r = F.jit->entry(args, &status);
+    if (status.code!=JitOk){
+        // too deep: let the engine's heap frames take the recursion for a while
+        if (status.code==JitDepth){ F.jit.reset(); F.calls = 0; }
+        return false;
+    }
+    out = Value(r);
+    return true;
+#else
+    (void)I; (void)F; (void)argv; (void)argc; (void)out;
+    return false;
+#endif
+}
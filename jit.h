@@ -0,0 +1,23 @@
+#pragma once
+#include "interpreter.h"
+
+// Tier-up for hot user functions (--jit). Once a Function has been called
+// kJitThreshold times, a body built only from numeric literals, its own
+// parameters, add/subtract/multiply/division/mod, the comparisons, check
+// with an else arm and calls to itself is compiled to x86-64 machine code.
+//
+// Machine code only ever sees doubles. Arguments are type-checked on the
+// way in; a division/modulo by zero makes the code bail out, and the call is
+// then run by the interpreter from the start. The body cannot have side
+// effects, so running it twice is not observable. Code compiled under other
+// bindings (functionsVersion: a newname since, or another context) is
+// dropped before it runs, as is code that recursed deeper than the machine
+// stack is allowed to go (the engines' own frames live on the heap). The
+// pages count against the Function's Heap while they are mapped.
+struct JitCode;
+
+constexpr uint32_t kJitThreshold = 1000;
+
+// Runs F as machine code when it is (or just became) compiled. Returns false
+// when the caller must run the call itself; `out` is then untouched.
+bool jitCall(Interpreter& I, Function& F, const Value* argv, size_t argc, Value& out);
@@ -1,32 +1,164 @@
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
 #include <fstream>
 #include <iostream>
-#include <sstream>
+#include <thread>
 #include "parser.h"
 #include "interpreter.h"
+#include "vm.h"
+#include "optimizer.h"
+#include "program.h"
+#include "profiler.h"
+#include "cache.h"
+#include "server.h"
+
+static Server* volatile serving = nullptr;
+static void stopServing(int){ if (serving) serving->stop(); }
+
+// --serve: answers --connect clients until SIGINT or SIGTERM.
+static int serve(const char* path, size_t threads, Budget budget){
+    try {
+        Server server(path, threads ? threads : std::max(1u, std::thread::hardware_concurrency()), budget);
+        serving = &server;
+        std::signal(SIGINT, stopServing);
+        std::signal(SIGTERM, stopServing);
+        std::cerr << "Serving on " << path << "\n";
+        server.serve();
+        serving = nullptr;
+        std::cerr << "Served " << server.served() << " scripts, " << server.programHits() << " already parsed\n";
+    } catch (const std::exception& ex){
+        serving = nullptr;
+        std::cerr << "Error: " << ex.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
 
 int main(int argc, char** argv){
     std::ios::sync_with_stdio(false);
     std::cin.tie(nullptr);
 
-    std::string source;
-    if (argc>=2){
-        std::ifstream in(argv[1]);
-        if (!in){ std::cerr<<"Cannot open "<<argv[1]<<"\n"; return 1; }
-        std::ostringstream ss; ss<<in.rdbuf(); source = ss.str();
-    } else {
-        std::ostringstream ss; ss<<std::cin.rdbuf(); source = ss.str();
+    // callix [--vm] [--jit] [--stream] [--dump-optimized] [--profile] [--flamegraph out]
+    //        [--cache] [--cache-dir dir] [--output file] [--async-output]
+    //        [--no-memo] [--memo-stats] [--max-steps n] [--max-time ms]
+    //        [--max-memory mb] [--memory-stats] [file]
+    // callix --serve socket [--serve-threads n] [--max-steps n] [--max-time ms] [--max-memory mb]
+    // callix --connect socket [--vm] [--jit] [--no-memo] [--output file] [file]
+    bool useVM = false, useJIT = false, stream = false, dump = false, profile = false, cache = false;
+    bool asyncOutput = false, memo = true, memoStats = false, memoryStats = false;
+    size_t serveThreads = 0;
+    Budget budget;
+    const char* path = nullptr;
+    const char* servePath = nullptr;
+    const char* connectPath = nullptr;
+    const char* outputPath = nullptr;
+    const char* flamegraph = nullptr;
+    const char* cacheDir = nullptr;
+    for (int a=1; a<argc; ++a){
+        if (std::strcmp(argv[a], "--vm")==0) useVM = true;
+        else if (std::strcmp(argv[a], "--jit")==0) useJIT = true;
+        else if (std::strcmp(argv[a], "--stream")==0) stream = true;
+        else if (std::strcmp(argv[a], "--dump-optimized")==0) dump = true;
+        else if (std::strcmp(argv[a], "--profile")==0) profile = true;
+        else if (std::strcmp(argv[a], "--flamegraph")==0 && a+1<argc) flamegraph = argv[++a];
+        else if (std::strcmp(argv[a], "--cache")==0) cache = true;
+        else if (std::strcmp(argv[a], "--cache-dir")==0 && a+1<argc){ cache = true; cacheDir = argv[++a]; }
+        else if (std::strcmp(argv[a], "--output")==0 && a+1<argc) outputPath = argv[++a];
+        else if (std::strcmp(argv[a], "--async-output")==0) asyncOutput = true;
+        else if (std::strcmp(argv[a], "--no-memo")==0) memo = false;
+        else if (std::strcmp(argv[a], "--memo-stats")==0) memoStats = true;
+        else if (std::strcmp(argv[a], "--serve")==0 && a+1<argc) servePath = argv[++a];
+        else if (std::strcmp(argv[a], "--serve-threads")==0 && a+1<argc) serveThreads = size_t(std::atoi(argv[++a]));
+        else if (std::strcmp(argv[a], "--connect")==0 && a+1<argc) connectPath = argv[++a];
+        else if (std::strcmp(argv[a], "--max-steps")==0 && a+1<argc) budget.steps = std::strtoull(argv[++a], nullptr, 10);
+        else if (std::strcmp(argv[a], "--max-time")==0 && a+1<argc) budget.nanos = std::strtoull(argv[++a], nullptr, 10)*1000000;
+        else if (std::strcmp(argv[a], "--max-memory")==0 && a+1<argc) budget.bytes = std::strtoull(argv[++a], nullptr, 10)<<20;
+        else if (std::strcmp(argv[a], "--memory-stats")==0) memoryStats = true;
+        else path = argv[a];
     }
+    if (servePath) return serve(servePath, serveThreads, budget);
 
-    try{
-        Parser P(source);
-        P.tokenize();
-        auto program = P.parseProgram();
+    // print goes straight to the file descriptor, in large blocks
+    int fd = 1;
+    if (outputPath){
+        fd = ::open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd<0){ std::cerr<<"Cannot write "<<outputPath<<"\n"; return 1; }
+    }
+    Output output(fd);
+    if (asyncOutput) output.background();
 
+    Profiler prof;
+    int status = 0;
+    try{
+        // files are memory-mapped, stdin and pipes are read in chunks
+        std::unique_ptr<Source> source;
+        if (path){
+            source = openSource(path);
+            if (!source){ std::cerr<<"Cannot open "<<path<<"\n"; return 1; }
+        } else {
+            source = std::make_unique<StreamSource>(0);
+        }
+        if (connectPath){
+            // the server parses and runs it; only the text is needed here
+            while (source->more()){}
+            uint32_t flags = (useVM ? ServeVM : 0) | (useJIT ? ServeJIT : 0) | (memo ? 0 : ServeNoMemo);
+            return submit(connectPath, source->view(0, source->size), flags, output, std::cerr);
+        }
+        Parser P(*source);
         Interpreter I;
-        I.run(program);
+        I.out = &output;
+        I.jit = useJIT;
+        I.memo = memo;
+        I.budget = budget;
+        if (profile || flamegraph) I.profiler = &prof;
+        if (flamegraph) prof.startSampling();
+        VM vm(I);
+        if (stream){
+            // run each statement as soon as its ';' is parsed
+            Optimizer opt(I);
+            bool interactive = !path && isatty(0);
+            while (ASTPtr stmt = P.parseStatement()){
+                opt.program(*stmt);
+                if (dump) dumpProgram(*stmt, std::cout);
+                else if (useVM) vm.run(stmt);
+                else I.run(stmt);
+                if (interactive) output.flush();
+            }
+        } else {
+            // only a mapped file is known in full before it is parsed
+            ASTPtr program;
+            std::unique_ptr<ProgramCache> image;
+            if (cache && path && dynamic_cast<MappedSource*>(source.get())){
+                image = std::make_unique<ProgramCache>(path, cacheDir, *source);
+                program = image->load();
+            }
+            if (!program){
+                program = P.parseProgram();
+                if (image) image->store(*program);
+            }
+            auto built = Program::build(program, I.runtime, useVM && !dump);
+            if (dump) dumpProgram(*program, std::cout);
+            else if (useVM) vm.run(*built);
+            else I.run(*built);
+        }
+        output.flush();
+        if (memoStats) memoReport(I, std::cerr);
+        if (memoryStats) std::cerr << "Memory: " << I.memory().peak() << " bytes at the peak, " << I.memory().live() << " live at the end\n";
     } catch (const std::exception& ex){
+        // what was printed before the error comes first
+        try { output.flush(); } catch (const std::exception&){}
         std::cerr << "Error: " << ex.what() << "\n";
-        return 1;
+        status = 1;
     }
-    return 0;
+    if (flamegraph){
+        prof.stopSampling();
+        std::ofstream out(flamegraph);
+        if (!out){ std::cerr << "Cannot write " << flamegraph << "\n"; return 1; }
+        prof.writeFolded(out);
+    }
+    if (profile) prof.report(std::cerr);
+    return status;
 }
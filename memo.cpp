@@ -0,0 +1,272 @@
+#include "memo.h"
+#include "interpreter.h"
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <unordered_map>
+
+static uint64_t mix(uint64_t h){
+    h ^= h>>33; h *= 0xff51afd7ed558ccdull;
+    h ^= h>>33; h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ h>>33;
+}
+
+// False when some argument cannot be part of a key (arrays, functions).
+static bool hashKey(const Value* argv, size_t argc, uint64_t& h){
+    if (argc>Memo::kMaxArgs) return false;
+    h = argc;
+    for (size_t i=0;i<argc;++i){
+        const Value& v = argv[i];
+        uint64_t x;
+        if (v.isNum() || v.isNil()) x = v.bits;
+        else if (v.isStr()) x = std::hash<std::string>()(v.str()) ^ 0x9e3779b97f4a7c15ull;
+        else return false;
+        h = mix(h ^ x);
+    }
+    return true;
+}
+
+static bool sameKey(const Value* a, const Value* b, size_t argc){
+    for (size_t i=0;i<argc;++i){
+        if (a[i].bits==b[i].bits) continue;
+        if (!a[i].isStr() || !b[i].isStr() || a[i].str()!=b[i].str()) return false;
+    }
+    return true;
+}
+
+bool Memo::lookup(Heap* heap, const Value* argv, size_t argc, Value& out, bool reserve, Pending& pending){
+    uint64_t h;
+    if (!hashKey(argv, argc, h)) return false;
+    if (++windowLookups==kWindow){
+        // a window that hit less than one time in 16 costs more than it saves
+        if (windowHits*16<kWindow){ off = true; clear(); }
+        windowHits = windowLookups = 0;
+        if (off) return false;
+    }
+    if (!table){
+        std::unique_ptr<Table> t(new Table);
+        t->heap = heap;
+        t->entries.resize(kFirstSets*kWays);
+        t->hands.resize(kFirstSets);
+        t->charge(kFirstSets);
+        table = std::move(t);
+    }
+    size_t sets = table->hands.size();
+    Entry* set = &table->entries[(h & (sets-1))*kWays];
+    for (size_t w=0;w<kWays;++w){
+        Entry& e = set[w];
+        if (e.state!=Entry::Free && e.hash==h && e.argc==argc && sameKey(e.key, argv, argc)){
+            if (e.state==Entry::Running){ ++misses; return false; }   // being computed further down
+            e.referenced = true;
+            out = e.result;
+            ++hits; ++windowHits;
+            return true;
+        }
+    }
+    ++misses;
+    if (!reserve) return false;
+    Entry* e = victim(h & (sets-1));
+    if (!e && sets*kWays<kMaxEntries){
+        grow();
+        e = victim(h & (table->hands.size()-1));
+    }
+    if (!e) return false;   // every way is a call still running
+    if (e->state==Entry::Free) ++table->used;
+    if (++table->nextId==0) ++table->nextId;
+    e->hash = h;
+    e->id = table->nextId;
+    e->state = Entry::Running;
+    e->referenced = false;
+    e->argc = uint8_t(argc);
+    for (size_t i=0;i<kMaxArgs;++i) e->key[i] = i<argc ? argv[i] : Value();
+    e->result = Value();
+    pending = Pending{h, e->id};
+    return false;
+}
+
+// A free way of the set, else the one the clock hand stops at: it passes
+// over (and clears) ways hit since its last round. Running ways stay.
+Memo::Entry* Memo::victim(size_t set){
+    Entry* ways = &table->entries[set*kWays];
+    for (size_t w=0;w<kWays;++w) if (ways[w].state==Entry::Free) return &ways[w];
+    // below the size limit a full set makes the table grow instead
+    if (table->hands.size()*kWays<kMaxEntries) return nullptr;
+    uint8_t& hand = table->hands[set];
+    for (size_t step=0;step<2*kWays;++step){
+        Entry& e = ways[hand];
+        hand = uint8_t((hand+1)%kWays);
+        if (e.state==Entry::Running) continue;
+        if (e.referenced){ e.referenced = false; continue; }
+        return &e;
+    }
+    return nullptr;
+}
+
+void Memo::grow(){
+    size_t sets = table->hands.size()*2;
+    std::vector<Entry> entries(sets*kWays);
+    table->charge(sets);    // over the cap, the table stays as it was
+    // the ways of one old set split over two new sets, so they all fit
+    for (Entry& e: table->entries){
+        if (e.state==Entry::Free) continue;
+        Entry* ways = &entries[(e.hash & (sets-1))*kWays];
+        size_t w = 0;
+        while (ways[w].state!=Entry::Free) ++w;
+        ways[w] = std::move(e);
+    }
+    table->entries = std::move(entries);
+    table->hands.assign(sets, 0);
+}
+
+// Charges the Heap for the table growing to `sets` sets.
+void Memo::Table::charge(size_t sets){
+    size_t bytes = sizeof(Table)+sets*(kWays*sizeof(Entry)+sizeof(uint8_t));
+    if (heap) heap->charge(bytes-charged);
+    charged = bytes;
+}
+
+Memo::Entry* Memo::find(uint64_t hash, uint32_t id){
+    if (!table) return nullptr;
+    Entry* ways = &table->entries[(hash & (table->hands.size()-1))*kWays];
+    for (size_t w=0;w<kWays;++w)
+        if (ways[w].state==Entry::Running && ways[w].id==id) return &ways[w];
+    return nullptr;
+}
+
+void Memo::finish(const Pending& p, const Value& result){
+    if (Entry* e = find(p.hash, p.id)){
+        e->result = result;
+        e->state = Entry::Done;
+    }
+}
+
+void Memo::abandon(const Pending& p){
+    if (Entry* e = find(p.hash, p.id)){
+        *e = Entry();
+        --table->used;
+    }
+}
+
+void Memo::clear(){
+    table.reset();
+    windowHits = windowLookups = 0;
+}
+
+// ---- purity ----
+
+// The functions reached from one start, with what calls what.
+struct PurityCheck {
+    const Interpreter& I;
+    uint64_t now;
+    std::unordered_map<Function*, size_t> index;
+    std::vector<Function*> fns;
+    std::vector<bool> impure;
+    std::vector<std::vector<size_t>> callers;
+    std::vector<size_t> todo;
+
+    PurityCheck(const Interpreter& in): I(in), now(in.functionsVersion+1) {}
+
+    // Index of G, queued for a scan the first time; ~0 when G is already known.
+    size_t node(Function* G){
+        if (G->memo.checked==now) return ~size_t(0);
+        auto it = index.find(G);
+        if (it!=index.end()) return it->second;
+        size_t i = fns.size();
+        index.emplace(G, i);
+        fns.push_back(G);
+        impure.push_back(false);
+        callers.emplace_back();
+        todo.push_back(i);
+        return i;
+    }
+
+    // A name the body of fns[i] may read: a parameter, or a captured value
+    // that is not a function (which a check arm would call).
+    bool readable(size_t i, Symbol name) const {
+        const Function& G = *fns[i];
+        for (Symbol p: G.params) if (p==name) return true;
+        for (Environment* e = G.captured.get(); e; e = e->parent.get()){
+            auto it = e->index.find(name);
+            if (it!=e->index.end()) return !e->slots[it->second].isFunc();
+        }
+        return false;
+    }
+
+    // Whether the body of fns[i] does anything impure itself; records the
+    // user functions it calls.
+    bool scan(size_t i){
+        static const Symbol seq = intern("seq"), check = intern("check"), sw = intern("switch");
+        std::vector<NodeRef> work{fns[i]->body};
+        while (!work.empty()){
+            NodeRef n = work.back();
+            work.pop_back();
+            switch (n->kind){
+                case ASTKind::Number: case ASTKind::String: continue;
+                case ASTKind::Identifier:
+                    if (!readable(i, n->sym)) return true;
+                    continue;
+                case ASTKind::Call: break;
+            }
+            if (n->var!=VarOp::None) return true;        // get/set/declare of a global
+            auto it = I.functions.find(n->sym);
+            if (it==I.functions.end()) return true;      // calls a variable
+            Function* G = it->second.get();
+            if (G->isSpecial){
+                if (n->sym!=seq && n->sym!=check && n->sym!=sw) return true;   // lambda, lambda0
+            } else if (G->isBuiltin){
+                if (!G->pure) return true;
+            } else {
+                size_t j = node(G);
+                if (j==~size_t(0)){ if (!G->memo.pure) return true; }
+                else callers[j].push_back(i);
+            }
+            for (size_t a=0;a<n->argc;++a) work.push_back(n.arg(a));
+        }
+        return false;
+    }
+
+    void run(Function& F){
+        node(&F);
+        std::vector<size_t> spread;
+        while (!todo.empty()){
+            size_t i = todo.back();
+            todo.pop_back();
+            if (scan(i)){ impure[i] = true; spread.push_back(i); }
+        }
+        // whatever calls an impure function is impure
+        while (!spread.empty()){
+            size_t i = spread.back();
+            spread.pop_back();
+            for (size_t c: callers[i]) if (!impure[c]){ impure[c] = true; spread.push_back(c); }
+        }
+        for (size_t i=0;i<fns.size();++i){
+            Memo& M = fns[i]->memo;
+            M.checked = now;
+            M.pure = !impure[i];
+            M.off = false;
+            M.clear();
+        }
+    }
+};
+
+void checkPurity(const Interpreter& I, Function& F){
+    PurityCheck(I).run(F);
+}
+
+void memoReport(const Interpreter& I, std::ostream& out){
+    std::vector<std::pair<Symbol, const Function*>> fns;
+    for (auto& [name, F]: I.functions)
+        if (!F->isBuiltin && F->memo.hits+F->memo.misses>0) fns.emplace_back(name, F.get());
+    std::sort(fns.begin(), fns.end(), [](const auto& a, const auto& b){ return a.second->memo.hits>b.second->memo.hits; });
+    char line[160];
+    out << "\n";
+    std::snprintf(line, sizeof line, "%-24s %12s %12s %12s %8s\n", "memoized function", "hits", "misses", "cached", "state");
+    out << line;
+    for (auto& [name, F]: fns){
+        const Memo& M = F->memo;
+        std::snprintf(line, sizeof line, "%-24s %12llu %12llu %12zu %8s\n", symbolName(name).c_str(),
+                      (unsigned long long)M.hits, (unsigned long long)M.misses, M.size(),
+                      !M.pure ? "impure" : M.off ? "off" : "on");
+        out << line;
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include "value.h"
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+struct Interpreter;
+struct Function;
+
+// Memoization of pure user functions (--no-memo turns it off). A function
+// is pure when its body only reads its parameters and what its closure
+// captured (no functions among them), and only calls pure builtins,
+// seq/check/switch and other pure user functions; no lambdas. A call with
+// up to kMaxArgs numbers, strings or nils is then looked up in the
+// function's cache, and on a miss the result is stored when the call
+// returns, so fib-style recurrences take linear time.
+//
+// Purity depends on what names call, so it is worked out again after
+// newname changes the functions; the cache is emptied then too. A function
+// whose lookups rarely hit stops being looked up.
+//
+// Each Function has its own Memo; a copy of a Function (a closure, a
+// worker context's copy) starts with an empty one. Its cache counts against
+// the Function's Heap, and so against --max-memory, until it is emptied.
+struct Memo {
+    static constexpr size_t kMaxArgs = 4;
+
+    uint64_t checked = 0;   // Interpreter::functionsVersion+1 when `pure` was worked out
+    bool pure = false;
+    bool off = false;       // too few hits: no more lookups until the next check
+    uint64_t hits = 0, misses = 0;
+
+    Memo() = default;
+    Memo(const Memo&){}
+    Memo& operator=(const Memo&){ *this = Memo(); return *this; }
+    Memo(Memo&&) = default;
+    Memo& operator=(Memo&&) = default;
+
+    bool active(uint64_t version) const { return checked==version+1 && pure && !off; }
+
+    // A call whose result is not known yet: the identity of its entry, which
+    // finish() fills in (or abandon() drops) when the call ends.
+    struct Pending { uint64_t hash = 0; uint32_t id = 0; };
+
+    // True with the result in `out` for a call seen before. Otherwise makes
+    // `pending` the entry to fill when `reserve` is set; pending.id stays 0
+    // when there is none (arguments that are not keys, a full cache).
+    // `heap` is the Function's, which a new or grown cache is charged to.
+    bool lookup(Heap* heap, const Value* argv, size_t argc, Value& out, bool reserve, Pending& pending);
+    void finish(const Pending& p, const Value& result);
+    void abandon(const Pending& p);
+    void clear();
+    size_t size() const { return table ? table->used : 0; }
+
+private:
+    static constexpr size_t kWays = 4, kFirstSets = 16, kMaxEntries = size_t(1)<<14;
+    static constexpr uint64_t kWindow = 1024; // lookups between checks of the hit rate
+
+    struct Entry {
+        enum State : uint8_t { Free, Running, Done };
+        uint64_t hash = 0;
+        uint32_t id = 0;        // of the call computing it, while Running
+        State state = Free;
+        bool referenced = false;  // hit since the clock hand last passed it
+        uint8_t argc = 0;
+        Value key[kMaxArgs];
+        Value result;
+    };
+    struct Table {
+        std::vector<Entry> entries;   // sets of kWays
+        std::vector<uint8_t> hands;   // per set: the way its clock hand points at
+        size_t used = 0;
+        uint32_t nextId = 0;
+        Heap* heap = nullptr;         // charged for the sets, until the table goes
+        size_t charged = 0;
+
+        ~Table(){ if (heap) heap->refund(charged); }
+        void charge(size_t sets);
+    };
+    std::unique_ptr<Table> table;
+    uint64_t windowHits = 0, windowLookups = 0;
+
+    Entry* find(uint64_t hash, uint32_t id);
+    Entry* victim(size_t set);
+    void grow();
+};
+
+// Works out the purity of F, and of every function it calls by name, for
+// the functions of `I` as they are now.
+void checkPurity(const Interpreter& I, Function& F);
+
+// --memo-stats: hits, misses and cached results of each named function
+// that was looked up, most hits first.
+void memoReport(const Interpreter& I, std::ostream& out);
@@ -0,0 +1,186 @@
+#include "optimizer.h"
+#include "builtins.h"
+#include <charconv>
+#include <cmath>
+#include <new>
+#include <stdexcept>
+
+bool Optimizer::isConst(NodeId id) const {
+    ASTKind k = ast->nodes[id].kind;
+    return k==ASTKind::Number || k==ASTKind::String;
+}
+
+Value Optimizer::constant(NodeId id) const {
+    const ASTNode& n = ast->nodes[id];
+    return n.kind==ASTKind::Number ? Value(n.number) : symbols().value(n.sym);
+}
+
+// Builtins cannot be rebound by newname, so their names are static.
+const Function* Optimizer::pureBuiltin(Symbol name) const {
+    auto it = I.runtime->builtins.find(name);
+    return it!=I.runtime->builtins.end() && it->second->pure ? it->second.get() : nullptr;
+}
+
+// Runs the call's builtin on its first `count` (literal) arguments. Calls
+// that fail are left for run time, so the error surfaces where it did.
+bool Optimizer::evaluate(NodeId id, size_t count, Value& out){
+    Symbol name = at(id).sym;
+    const Function* F = pureBuiltin(name);
+    size_t base = I.stack.size();
+    for (size_t i=0;i<count;++i) I.stack.push_back(constant(kid(id, i)));
+    try {
+        out = I.callNative(*F, name, I.stack.data()+base, count);
+    } catch (const std::runtime_error&){
+        I.stack.resize(base);
+        return false;
+    } catch (const std::bad_alloc&){
+        I.stack.resize(base);
+        return false;
+    }
+    I.stack.resize(base);
+    return out.isNum();
+}
+
+void Optimizer::setArgs(NodeId id, const std::vector<NodeId>& args){
+    ASTNode& n = at(id);
+    if (args.size()>n.argc){   // no room in place, start a new run at the end
+        n.args = uint32_t(ast->kids.size());
+        ast->kids.resize(n.args+args.size());
+    }
+    std::copy(args.begin(), args.end(), ast->kids.begin()+n.args);
+    n.argc = uint32_t(args.size());
+}
+
+void Optimizer::fold(NodeId id){
+    static const Symbol add = intern("add"), multiply = intern("multiply");
+    static const Symbol array = intern("array"), range = intern("range"), fill = intern("fill");
+    const Function* F = pureBuiltin(at(id).sym);
+    if (!F || at(id).sym==array || at(id).sym==range || at(id).sym==fill) return;
+    size_t argc = at(id).argc, lead = 0;
+    while (lead<argc && isConst(kid(id, lead))) ++lead;
+    Value v;
+    if (lead==argc){
+        if (evaluate(id, argc, v)){ ASTNode n{ASTKind::Number}; n.number = v.num(); at(id) = n; }
+        return;
+    }
+    // add/multiply accumulate left to right, so a leading run of literals
+    // folds into one without changing the result
+    if ((at(id).sym==add || at(id).sym==multiply) && lead>=2 && evaluate(id, lead, v)){
+        std::vector<NodeId> args{kid(id, 0)};
+        ASTNode n{ASTKind::Number}; n.number = v.num(); at(args[0]) = n;
+        for (size_t i=lead;i<argc;++i) args.push_back(kid(id, i));
+        setArgs(id, args);
+    }
+}
+
+// add(add(a, b), c) -> add(a, b, c). Only the first argument is spliced:
+// anywhere else it would regroup the floating-point sum.
+void Optimizer::flatten(NodeId id){
+    static const Symbol add = intern("add"), multiply = intern("multiply");
+    Symbol name = at(id).sym;
+    if (name!=add && name!=multiply) return;
+    if (at(id).argc==0) return;
+    NodeId first = kid(id, 0);
+    if (at(first).kind!=ASTKind::Call || at(first).sym!=name) return;
+    std::vector<NodeId> args;
+    for (size_t i=0;i<at(first).argc;++i) args.push_back(kid(first, i));
+    for (size_t i=1;i<at(id).argc;++i) args.push_back(kid(id, i));
+    setArgs(id, args);
+}
+
+// A check/switch left with only its else/default arm, at argument `branch`,
+// is that arm when it is a literal (a literal is never a function to call).
+void Optimizer::collapse(NodeId id, size_t branch){
+    if (at(id).argc!=branch+1) return;
+    NodeId b = kid(id, branch);
+    if (isConst(b)) at(id) = at(b);
+}
+
+void Optimizer::check(NodeId id){
+    size_t n = at(id).argc;
+    std::vector<NodeId> keep;
+    bool taken = false;
+    for (size_t i=0;i+1<n;i+=2){
+        NodeId c = kid(id, i), e = kid(id, i+1);
+        if (!isConst(c)){ keep.push_back(c); keep.push_back(e); continue; }
+        if (constant(c).truthy()){ keep.push_back(e); taken = true; break; }   // becomes the else arm
+    }
+    if (!taken && n%2==1) keep.push_back(kid(id, n-1));
+    setArgs(id, keep);
+    collapse(id, 0);
+}
+
+void Optimizer::switchOn(NodeId id){
+    size_t n = at(id).argc;
+    if (n==0 || !isConst(kid(id, 0))) return;
+    double v;
+    if (!numberOf(constant(kid(id, 0)), v)) return;
+    std::vector<NodeId> keep{kid(id, 0)};
+    bool matched = false;
+    size_t i=1;
+    for (; i+1<n; i+=2){
+        NodeId c = kid(id, i), e = kid(id, i+1);
+        if (isConst(c)){
+            double cv = 0;
+            bool numeric = numberOf(constant(c), cv);
+            if (numeric && cv!=v) continue;                              // never matches
+            if (numeric){ keep.push_back(e); matched = true; break; }    // always matches: becomes the default
+        }
+        keep.push_back(c); keep.push_back(e);
+    }
+    if (!matched && i<n) keep.push_back(kid(id, i));
+    setArgs(id, keep);
+    collapse(id, 1);
+}
+
+void Optimizer::node(NodeId id){
+    if (at(id).kind!=ASTKind::Call) return;
+    for (size_t i=0;i<at(id).argc;++i) node(kid(id, i));
+    static const Symbol checkSym = intern("check"), switchSym = intern("switch");
+    Symbol name = at(id).sym;
+    if (name==checkSym) check(id);
+    else if (name==switchSym) switchOn(id);
+    else { flatten(id); fold(id); }
+}
+
+void Optimizer::program(AST& a){
+    ast = &a;
+    for (NodeId s: a.stmts) node(s);
+    ast = nullptr;
+}
+
+static void dumpNumber(double v, std::ostream& out){
+    if (std::signbit(v) && v!=0){ out << "subtract(0, "; dumpNumber(-v, out); out << ")"; return; }
+    char buf[32];
+    auto r = std::to_chars(buf, buf+sizeof buf, v);
+    out.write(buf, r.ptr-buf);
+}
+
+static void dumpNode(const AST& ast, NodeId id, std::ostream& out){
+    const ASTNode& n = ast.nodes[id];
+    switch(n.kind){
+        case ASTKind::Number: dumpNumber(n.number, out); return;
+        case ASTKind::String:
+            out << '"';
+            for (char c: n.text()){
+                if (c=='\n') out << "\\n";
+                else if (c=='"' || c=='\\') out << '\\' << c;
+                else out << c;
+            }
+            out << '"';
+            return;
+        case ASTKind::Identifier: out << n.text(); return;
+        case ASTKind::Call:
+            out << n.text() << '(';
+            for (size_t i=0;i<n.argc;++i){
+                if (i) out << ", ";
+                dumpNode(ast, ast.kids[n.args+i], out);
+            }
+            out << ')';
+            return;
+    }
+}
+
+void dumpProgram(const AST& ast, std::ostream& out){
+    for (NodeId s: ast.stmts){ dumpNode(ast, s, out); out << ";\n"; }
+}
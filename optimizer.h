@@ -0,0 +1,40 @@
+#pragma once
+#include "interpreter.h"
+#include <ostream>
+
+// Rewrites a parsed program before the Resolver sees it. Calls to pure
+// builtins with literal arguments are evaluated once, check/switch arms with
+// literal conditions are dropped or chosen, and add/multiply nested in the
+// first argument of the same builtin are flattened into one call. Nodes are
+// rewritten in place; the pool never grows, so NodeRefs stay valid.
+//
+// Only numbers are folded in, so array, range and fill are left alone: their
+// arrays would be thrown away, and may be huge, in arms that never run.
+struct Optimizer {
+    Interpreter& I;
+
+    explicit Optimizer(Interpreter& in): I(in) {}
+
+    void program(AST& ast);
+
+private:
+    AST* ast = nullptr;
+
+    void node(NodeId id);
+    void fold(NodeId id);
+    void flatten(NodeId id);
+    void check(NodeId id);
+    void switchOn(NodeId id);
+    void collapse(NodeId id, size_t branch);
+
+    ASTNode& at(NodeId id){ return ast->nodes[id]; }
+    NodeId kid(NodeId id, size_t i) const { return ast->kids[ast->nodes[id].args+i]; }
+    bool isConst(NodeId id) const;
+    Value constant(NodeId id) const;
+    const Function* pureBuiltin(Symbol name) const;
+    bool evaluate(NodeId id, size_t count, Value& out);
+    void setArgs(NodeId id, const std::vector<NodeId>& args);
+};
+
+// Prints `ast` back as source, one statement per line (see --dump-optimized).
+void dumpProgram(const AST& ast, std::ostream& out);
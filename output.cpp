@@ -0,0 +1,126 @@
+#include "output.h"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <pthread.h>
+#include <stdexcept>
+#include <unistd.h>
+
+Output::Output(std::ostream& to): stream(&to) {}
+Output::Output(int fd): fd(fd) {}
+
+Output::~Output(){
+    try { flush(); } catch (const std::exception&){}
+    if (writer.joinable()){
+        { std::lock_guard<std::mutex> g(lock); stopping = true; }
+        wake.notify_one();
+        writer.join();
+    }
+}
+
+void Output::number(double d){
+    char buf[32];
+    char* e;
+    if (d>-1e6 && d<1e6 && d==double(int64_t(d)) && !(d==0 && std::signbit(d))){
+        // whole numbers below a million: what %g prints is just the digits
+        int64_t v = int64_t(d);
+        char* p = buf+sizeof buf;
+        e = p;
+        uint64_t u = v<0 ? uint64_t(-v) : uint64_t(v);
+        do { *--p = char('0'+u%10); u /= 10; } while (u);
+        if (v<0) *--p = '-';
+        write(p, size_t(e-p));
+        return;
+    }
+    e = std::to_chars(buf, buf+sizeof buf, d, std::chars_format::general, 6).ptr;
+    write(buf, size_t(e-buf));
+}
+
+void Output::spill(const char* p, size_t n){
+    if (!front){
+        front.reset(new char[kBlock]);
+        at = front.get();
+        end = at+kBlock;
+    }
+    for (;;){
+        size_t k = std::min(n, size_t(end-at));
+        std::memcpy(at, p, k);
+        at += k; p += k; n -= k;
+        if (!n) return;
+        handOff();
+    }
+}
+
+void Output::handOff(){
+    size_t n = size_t(at-front.get());
+    at = front.get();
+    if (!n) return;
+    if (!writer.joinable()){ deliver(front.get(), n); return; }
+    drain();
+    {
+        std::lock_guard<std::mutex> g(lock);
+        std::swap(front, back);
+        pending = n;
+    }
+    wake.notify_one();
+    at = front.get();
+    end = at+kBlock;
+}
+
+void Output::deliver(const char* p, size_t n){
+    if (stream){ stream->write(p, std::streamsize(n)); return; }
+    while (n){
+        ssize_t k = ::write(fd, p, n);
+        if (k<0){
+            if (errno==EINTR) continue;
+            throw std::runtime_error(std::string("Cannot write output: ")+std::strerror(errno));
+        }
+        p += k; n -= size_t(k);
+    }
+}
+
+void Output::drain(){
+    std::unique_lock<std::mutex> g(lock);
+    done.wait(g, [&]{ return pending==0; });
+    if (!failure.empty()){
+        std::string why = std::move(failure);
+        failure.clear();
+        throw std::runtime_error(why);
+    }
+}
+
+void Output::flush(){
+    if (front) handOff();
+    if (writer.joinable()) drain();
+    if (stream) stream->flush();
+}
+
+void Output::background(){
+    if (writer.joinable()) return;
+    back.reset(new char[kBlock]);
+    // like the pool's helpers, the writer leaves signals to the other threads
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    writer = std::thread([this]{ loop(); });
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+void Output::loop(){
+    std::unique_lock<std::mutex> g(lock);
+    for (;;){
+        wake.wait(g, [&]{ return pending || stopping; });
+        if (!pending) return;
+        size_t n = pending;
+        g.unlock();
+        std::string why;
+        try { deliver(back.get(), n); } catch (const std::exception& ex){ why = ex.what(); }
+        g.lock();
+        pending = 0;
+        if (failure.empty()) failure = std::move(why);
+        done.notify_all();
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+// Where print writes. Text is collected in a buffer of the Output's own and
+// handed on in large blocks, either to a stream or straight to a file
+// descriptor, so a print costs a few copies instead of a stream call per
+// argument. Numbers are formatted with std::to_chars into exactly the text
+// `std::ostream << double` gives (%g, six significant digits).
+//
+// flush() hands on everything written so far; the destructor flushes too.
+// After background(), a writer thread of the Output's own does the writing
+// while the next block fills (double buffering), and flush() waits for it.
+// Errors writing, on either thread, are thrown by the next write or flush.
+//
+// An Output is used by one thread at a time (print takes a lock while
+// parallel tasks run).
+struct Output {
+    explicit Output(std::ostream& to);
+    explicit Output(int fd);          // not closed by the Output
+    ~Output();
+    Output(const Output&) = delete;
+    Output& operator=(const Output&) = delete;
+
+    void write(const char* p, size_t n){
+        if (n<=size_t(end-at)){ std::memcpy(at, p, n); at += n; }
+        else spill(p, n);
+    }
+    void write(const std::string& s){ write(s.data(), s.size()); }
+    void put(char c){
+        if (at==end) spill(&c, 1);
+        else *at++ = c;
+    }
+    void number(double d);
+
+    void flush();
+    void background();                // start the writer thread
+
+private:
+    static constexpr size_t kBlock = 64*1024;
+
+    std::ostream* stream = nullptr;
+    int fd = -1;
+    std::unique_ptr<char[]> front, back; // filling; being written by the writer
+    char* at = nullptr;               // next free byte of `front`
+    char* end = nullptr;              // of `front`; both null until the first write
+
+    std::thread writer;
+    std::mutex lock;                  // guards the fields below
+    std::condition_variable wake, done;
+    size_t pending = 0;               // bytes of `back` the writer has still to write
+    bool stopping = false;
+    std::string failure;              // why a write failed, until it is thrown
+
+    void spill(const char* p, size_t n);
+    void handOff();                   // the filled part of `front` to the target
+    void deliver(const char* p, size_t n);
+    void drain();                     // wait for the writer; throws its failure
+    void loop();
+};
@@ -1,88 +1,126 @@
 #include "parser.h"
 #include <cctype>
+#include <charconv>
 #include <stdexcept>
 
 static bool isIdentStart(char c){ return std::isalpha((unsigned char)c) || c=='_'; }
 static bool isIdentChar (char c){ return std::isalnum((unsigned char)c) || c=='_'; }
 
-void Parser::tokenize(){
-    toks.clear();
-    i=0;
-    while(i<src.size()){
-        char c = src[i];
+Parser::Parser(std::string s): owned(std::make_unique<StringSource>(std::move(s))), in(*owned) {}
+Parser::Parser(Source& src): in(src) {}
+
+Token Parser::lex(){
+    for(;;){
+        if (!in.has(i)) return {Token::End};
+        char c = in.at(i);
         if (std::isspace((unsigned char)c)){ ++i; continue; }
-        if (c=='('){ toks.push_back({Token::LParen,"("}); ++i; continue; }
-        if (c==')'){ toks.push_back({Token::RParen,")"}); ++i; continue; }
-        if (c==','){ toks.push_back({Token::Comma,","}); ++i; continue; }
-        if (c==';'){ toks.push_back({Token::Semi,";"}); ++i; continue; }
+        if (c=='/' && in.has(i+1) && in.at(i+1)=='/'){ // line comment
+            while(in.has(i) && in.at(i)!='\n') ++i;
+            continue;
+        }
+        if (c=='('){ ++i; return {Token::LParen}; }
+        if (c==')'){ ++i; return {Token::RParen}; }
+        if (c==','){ ++i; return {Token::Comma}; }
+        if (c==';'){ ++i; return {Token::Semi}; }
         if (c=='"'){
-            ++i; std::string s; 
-            while(i<src.size() && src[i]!='"'){
-                if (src[i]=='\\' && i+1<src.size()){
-                    char n=src[i+1];
-                    if (n=='n'){ s.push_back('\n'); i+=2; continue; }
-                    if (n=='"'){ s.push_back('"'); i+=2; continue; }
-                    s.push_back(n); i+=2; continue;
+            size_t start = i++;
+            scratch.clear();
+            while(in.has(i) && in.at(i)!='"'){
+                if (in.at(i)=='\\' && in.has(i+1)){
+                    char n=in.at(i+1);
+                    if (n=='n'){ scratch.push_back('\n'); i+=2; continue; }
+                    if (n=='"'){ scratch.push_back('"'); i+=2; continue; }
+                    scratch.push_back(n); i+=2; continue;
                 }
-                s.push_back(src[i++]);
+                scratch.push_back(in.at(i++));
             }
-            if (i>=src.size()||src[i]!='"') throw std::runtime_error("Unterminated string");
+            if (!in.has(i)) throw std::runtime_error("Unterminated string");
             ++i;
-            Token t; t.type=Token::String; t.lexeme=s; toks.push_back(t); continue;
+            Token t; t.type=Token::String; t.sym=intern(scratch, names); t.text=in.view(start, i);
+            return t;
         }
-        if (std::isdigit((unsigned char)c) || (c=='.' && i+1<src.size() && std::isdigit((unsigned char)src[i+1]))){
-            size_t j=i; 
-            while(j<src.size() && (std::isdigit((unsigned char)src[j]) || src[j]=='.')) j++;
-            double v = std::stod(src.substr(i, j-i));
-            Token t; t.type=Token::Number; t.num=v; t.lexeme=src.substr(i,j-i);
-            toks.push_back(t); i=j; continue;
+        if (std::isdigit((unsigned char)c) || (c=='.' && in.has(i+1) && std::isdigit((unsigned char)in.at(i+1)))){
+            size_t j=i;
+            while(in.has(j) && (std::isdigit((unsigned char)in.at(j)) || in.at(j)=='.')) j++;
+            Token t; t.type=Token::Number; t.text=in.view(i, j);
+            if (std::from_chars(t.text.data(), t.text.data()+t.text.size(), t.num).ec!=std::errc())
+                throw std::runtime_error("Number out of range: "+std::string(t.text));
+            i=j; return t;
         }
         if (isIdentStart(c)){
-            size_t j=i+1; while(j<src.size() && isIdentChar(src[j])) j++;
-            std::string name = src.substr(i, j-i);
-            Token t; t.type=Token::Ident; t.lexeme=name; toks.push_back(t); i=j; continue;
+            size_t j=i+1; while(in.has(j) && isIdentChar(in.at(j))) j++;
+            Token t; t.type=Token::Ident; t.text=in.view(i, j); t.sym=intern(t.text, names);
+            i=j; return t;
         }
         throw std::runtime_error(std::string("Unexpected char: ")+c);
     }
-    toks.push_back({Token::End,""});
 }
 
-const Token& Parser::consume(){ return toks[pos++]; }
-bool Parser::match(Token::Type t){ if (at().type==t){ ++pos; return true; } return false; }
+void Parser::tokenize(){
+    toks.clear();
+    do { consume(); toks.push_back(cur); } while (cur.type!=Token::End);
+    have = true;   // keep End as the lookahead
+}
+
+bool Parser::match(Token::Type t){ if (at().type==t){ consume(); return true; } return false; }
 
-ASTPtr Parser::parsePrimary(){
-    if (at().type==Token::Number){ double v=at().num; consume(); return ASTNode::Number(v); }
-    if (at().type==Token::String){ std::string s=at().lexeme; consume(); return ASTNode::String(s); }
+NodeId Parser::parsePrimary(){
+    if (at().type==Token::Number){ double v=at().num; consume(); return out->Number(v); }
+    if (at().type==Token::String){ Symbol s=at().sym; consume(); return out->String(s); }
     if (at().type==Token::Ident){ 
-        std::string name=at().lexeme; consume();
+        Symbol name=at().sym; consume();
         // could be call
         if (match(Token::LParen)){
-            std::vector<ASTPtr> args;
+            size_t first = pending.size();
             if (at().type!=Token::RParen){
-                do { args.push_back(parseExpression()); } while(match(Token::Comma));
+                do { NodeId a = parseExpression(); pending.push_back(a); } while(match(Token::Comma));
             }
             if (!match(Token::RParen)) throw std::runtime_error("Expected ')'");
-            return ASTNode::Call(name, std::move(args));
+            NodeId call = out->Call(name, pending.data()+first, pending.size()-first);
+            pending.resize(first);
+            return call;
         }
-        return ASTNode::Identifier(name);
+        return out->Identifier(name);
     }
     throw std::runtime_error("Expected primary");
 }
 
-ASTPtr Parser::parseCallOrPrimary(){ return parsePrimary(); }
-ASTPtr Parser::parseExpression(){ return parseCallOrPrimary(); }
+NodeId Parser::parseCallOrPrimary(){ return parsePrimary(); }
+NodeId Parser::parseExpression(){ return parseCallOrPrimary(); }
 
-ASTPtr Parser::parseStmt(){
-    ASTPtr expr = parseExpression();
+NodeId Parser::parseStmt(){
+    NodeId expr = parseExpression();
     if (!match(Token::Semi)) throw std::runtime_error("Missing ';' after statement");
     return expr;
 }
 
-std::vector<ASTPtr> Parser::parseProgram(){
-    pos=0;
-    std::vector<ASTPtr> stmts;
+ASTPtr Parser::parseProgram(){
+    auto ast = std::make_shared<AST>();
+    out = ast.get();
+    pending.clear();
+    // a rough node count for in-memory input: about one node per 16 bytes
+    ast->nodes.reserve(in.size/16);
     while(at().type!=Token::End){
-        stmts.push_back(parseStmt());
+        NodeId stmt = parseStmt();
+        ast->stmts.push_back(stmt);
+    }
+    out = nullptr;
+    return ast;
+}
+
+ASTPtr Parser::parseStatement(){
+    if (at().type==Token::End) return nullptr;
+    if (last && last.use_count()==1){
+        // nothing kept the previous statement (no function body in it), reuse its storage
+        last->clear();
+    } else {
+        last = std::make_shared<AST>();
     }
-    return stmts;
+    out = last.get();
+    pending.clear();
+    NodeId stmt = parseStmt();
+    last->stmts.push_back(stmt);
+    out = nullptr;
+    in.discard(i);   // the lookahead is not lexed yet, so nothing before i is needed
+    return last;
 }
@@ -1,31 +1,46 @@
 #pragma once
 #include "ast.h"
+#include "source.h"
 #include <string>
+#include <string_view>
 #include <vector>
 
 struct Token {
     enum Type { Ident, Number, String, LParen, RParen, Comma, Semi, End } type;
-    std::string lexeme;
+    Symbol sym=NoSymbol;   // Ident / String
     double num=0.0;
+    std::string_view text{}; // raw lexeme; valid until the next token is lexed
 };
 
+// Tokens are lexed on demand from a Source, one token of lookahead at a time.
 struct Parser {
-    std::string src;
-    size_t i=0;
-    std::vector<Token> toks;
+    std::vector<Token> toks;   // filled by tokenize()
+    SymbolOwner* names = nullptr; // holds the names lexed (see symbols.h); null: kept for good
 
-    explicit Parser(std::string s): src(std::move(s)) {}
+    explicit Parser(std::string s);
+    explicit Parser(Source& in);
 
-    void tokenize();
-    std::vector<ASTPtr> parseProgram();
+    void tokenize();           // lex the rest of the input into `toks`
+    ASTPtr parseProgram();     // every remaining statement, in one AST
+    ASTPtr parseStatement();   // the next statement in its own AST; nullptr at end of input
 
 private:
-    const Token& at(size_t k=0) const { return toks[pos+k]; }
-    const Token& consume();
+    std::unique_ptr<Source> owned;
+    Source& in;
+    size_t i=0;                // absolute input offset of the next unlexed byte
+    Token cur;
+    bool have=false;           // `cur` holds the lookahead token
+    std::string scratch;       // unescaped string literal
+    ASTPtr last;               // most recent parseStatement() result, recycled once unreferenced
+
+    Token lex();
+    const Token& at(){ if (!have){ cur = lex(); have = true; } return cur; }
+    void consume(){ at(); have = false; }
     bool match(Token::Type t);
-    ASTPtr parseStmt(); // statement = call ';'
-    ASTPtr parseCallOrPrimary();
-    ASTPtr parsePrimary();
-    ASTPtr parseExpression(); // expression = callOrPrimary
-    size_t pos=0;
+    NodeId parseStmt(); // statement = call ';'
+    NodeId parseCallOrPrimary();
+    NodeId parsePrimary();
+    NodeId parseExpression(); // expression = callOrPrimary
+    AST* out=nullptr;
+    std::vector<NodeId> pending; // argument ids of the calls being parsed, innermost last
 };
@@ -0,0 +1,122 @@
+#include "pool.h"
+#include "value.h"
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
+#include <pthread.h>
+#include <utility>
+
+static uint64_t pack(uint64_t first, uint64_t end){ return first<<32 | end; }
+static uint32_t firstOf(uint64_t r){ return uint32_t(r>>32); }
+static uint32_t endOf(uint64_t r){ return uint32_t(r); }
+
+ThreadPool& ThreadPool::instance(){
+    static ThreadPool pool([]{
+        const char* env = std::getenv("CALLIX_THREADS");
+        long n = env ? std::atol(env) : 0;
+        return size_t(n>0 ? n : std::max(1u, std::thread::hardware_concurrency()));
+    }());
+    return pool;
+}
+
+ThreadPool::ThreadPool(size_t threads): shares(new Share[threads]) {
+    // helpers inherit a full signal mask, so signals (SIGPROF for the
+    // profiler, SIGINT) go to the thread that started the job
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (size_t t=1; t<threads; ++t) helpers.emplace_back([this, t]{ loop(t); });
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+ThreadPool::~ThreadPool(){
+    {
+        std::lock_guard<std::mutex> g(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& t: helpers) t.join();
+}
+
+bool ThreadPool::run(size_t chunks, const Body& job){
+    std::unique_lock<std::mutex> own(busy, std::try_to_lock);
+    if (!own || chunks>UINT32_MAX) return false;
+    size_t n = size();
+    for (size_t t=0; t<n; ++t) shares[t].range.store(pack(chunks*t/n, chunks*(t+1)/n), std::memory_order_relaxed);
+    body = &job;
+    failed = false;
+    parallelSection = true;
+    {
+        std::lock_guard<std::mutex> g(lock);
+        running = helpers.size();
+        ++generation;
+    }
+    wake.notify_all();
+    work(0);
+    {
+        std::unique_lock<std::mutex> g(lock);
+        idle.wait(g, [this]{ return running==0; });
+    }
+    parallelSection = false;
+    body = nullptr;
+    if (error) std::rethrow_exception(std::exchange(error, nullptr));
+    return true;
+}
+
+void ThreadPool::loop(size_t self){
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> g(lock);
+    for(;;){
+        wake.wait(g, [&]{ return stopping || generation!=seen; });
+        if (stopping) return;
+        seen = generation;
+        g.unlock();
+        parallelSection = true;
+        work(self);
+        parallelSection = false;
+        g.lock();
+        if (--running==0) idle.notify_one();
+    }
+}
+
+void ThreadPool::work(size_t self){
+    size_t chunk;
+    while (take(self, chunk)){
+        if (failed.load(std::memory_order_relaxed)) continue;   // drain what is left
+        try {
+            (*body)(chunk, self);
+        } catch (...){
+            std::lock_guard<std::mutex> g(errorLock);
+            if (!error) error = std::current_exception();
+            failed = true;
+        }
+    }
+}
+
+// The next chunk from our own share, else the first of the back half stolen
+// from another thread (the rest of that half becomes our share).
+bool ThreadPool::take(size_t self, size_t& chunk){
+    std::atomic<uint64_t>& mine = shares[self].range;
+    uint64_t r = mine.load(std::memory_order_acquire);
+    while (firstOf(r)<endOf(r)){
+        if (mine.compare_exchange_weak(r, pack(firstOf(r)+1, endOf(r)), std::memory_order_acq_rel)){
+            chunk = firstOf(r);
+            return true;
+        }
+    }
+    size_t n = size();
+    for (size_t k=1; k<n; ++k){
+        std::atomic<uint64_t>& theirs = shares[(self+k)%n].range;
+        r = theirs.load(std::memory_order_acquire);
+        while (firstOf(r)<endOf(r)){
+            uint32_t mid = firstOf(r)+(endOf(r)-firstOf(r))/2;
+            if (theirs.compare_exchange_weak(r, pack(firstOf(r), mid), std::memory_order_acq_rel)){
+                // ours is empty, so nobody else writes it meanwhile
+                mine.store(pack(mid+1, endOf(r)), std::memory_order_release);
+                chunk = mid;
+                return true;
+            }
+        }
+    }
+    return false;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool behind the parallel builtins (pfor, preduce).
+// It has one thread per core, the thread that starts a job included; the
+// others are started on first use and sleep between jobs.
+//
+// A job is a number of chunks. Each thread starts on its own contiguous
+// share of them and takes them from the front. A thread whose share is used
+// up steals the back half of another thread's share. A share is a single
+// atomic word (first<<32 | end), so taking and stealing are one
+// compare-and-swap each.
+//
+// Each thread working on a job has `parallelSection` (value.h) set, so it
+// updates reference counts atomically. Other threads, e.g. running other
+// contexts of an embedding application, are not slowed down.
+struct ThreadPool {
+    using Body = std::function<void(size_t chunk, size_t thread)>;
+
+    static ThreadPool& instance();   // CALLIX_THREADS threads, or one per core
+
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const { return helpers.size()+1; }
+
+    // Runs body(chunk, thread) for every chunk in [0, chunks), where `thread`
+    // < size() says which thread runs it (0: the caller). Returns once every
+    // chunk has finished. After a body throws, chunks that have not started yet
+    // are skipped, and the first exception is rethrown here. Only one job
+    // runs at a time: returns false without running anything when the pool is
+    // busy, e.g. when called from inside a body.
+    bool run(size_t chunks, const Body& body);
+
+private:
+    struct alignas(64) Share { std::atomic<uint64_t> range{0}; };
+
+    std::vector<std::thread> helpers;
+    std::unique_ptr<Share[]> shares;
+    std::mutex busy;                 // held by the thread running a job
+
+    std::mutex lock;                 // guards the fields up to `running`
+    std::condition_variable wake, idle;
+    uint64_t generation = 0;         // bumped to start a job
+    size_t running = 0;              // helpers still working on the current job
+    bool stopping = false;
+
+    const Body* body = nullptr;
+    std::atomic<bool> failed{false};
+    std::mutex errorLock;
+    std::exception_ptr error;
+
+    void loop(size_t self);
+    void work(size_t self);
+    bool take(size_t self, size_t& chunk);
+};
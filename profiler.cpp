@@ -0,0 +1,158 @@
+#include "profiler.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <signal.h>
+#include <sys/time.h>
+
+static constexpr long kSampleIntervalUs = 1000;   // 1 kHz of CPU time
+static constexpr size_t kSampleBuffer = size_t(1)<<22;
+
+static uint64_t nowNs(){
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+static const char* nameOf(Symbol s){ return s==NoSymbol ? "<lambda>" : symbolName(s).c_str(); }
+
+Profiler::Profiler(){}
+
+Profiler::~Profiler(){ if (sampling) stopSampling(); }
+
+void Profiler::push(Symbol name, Symbol caller){
+    FnStats& f = functions[name];
+    ++f.calls;
+    ++f.active;
+    SiteStats& s = sites[uint64_t(caller)<<32 | name];
+    ++s.calls;
+    ++s.active;
+    calls.push_back(Entry{name, caller, nowNs(), 0, objectsAllocated, 0});
+    uint32_t d = live;
+    if (d<kSampleDepth) names[d] = name;
+    std::atomic_signal_fence(std::memory_order_release);
+    live = d+1;
+}
+
+void Profiler::enter(Symbol name){
+    push(name, calls.empty() ? NoSymbol : calls.back().name);
+}
+
+void Profiler::leave(){
+    Entry e = calls.back();
+    calls.pop_back();
+    live = live-1;
+    uint64_t inclusive = nowNs()-e.start, allocs = objectsAllocated-e.allocStart;
+    FnStats& f = functions[e.name];
+    f.exclusive += inclusive-e.child;
+    f.allocs += allocs-e.childAllocs;
+    if (--f.active==0) f.inclusive += inclusive;
+    SiteStats& s = sites[uint64_t(e.caller)<<32 | e.name];
+    if (--s.active==0) s.inclusive += inclusive;
+    if (!calls.empty()){
+        calls.back().child += inclusive;
+        calls.back().childAllocs += allocs;
+    }
+}
+
+void Profiler::replace(Symbol name){
+    Symbol caller = calls.back().name;
+    leave();
+    push(name, caller);
+}
+
+void Profiler::cancel(){
+    Entry e = calls.back();
+    calls.pop_back();
+    live = live-1;
+    FnStats& f = functions[e.name];
+    --f.calls;
+    --f.active;
+    SiteStats& s = sites[uint64_t(e.caller)<<32 | e.name];
+    --s.calls;
+    --s.active;
+}
+
+// Async-signal-safe: copies out of `names` into the preallocated buffer.
+void Profiler::sample(){
+    size_t d = std::min<size_t>(live, kSampleDepth), at = used;
+    if (at+d+1>samples.size()){ dropped = dropped+1; return; }
+    samples[at] = Symbol(d);
+    std::copy(names, names+d, samples.begin()+at+1);
+    used = at+d+1;
+}
+
+static Profiler* sampled = nullptr;
+
+void onSigprof(int){ if (sampled) sampled->sample(); }
+
+void Profiler::startSampling(){
+    if (sampled) throw std::runtime_error("only one profiler can sample at a time");
+    samples.assign(kSampleBuffer, NoSymbol);
+    sampled = this;
+    struct sigaction sa{};
+    sa.sa_handler = onSigprof;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, nullptr);
+    itimerval tv{{0, kSampleIntervalUs}, {0, kSampleIntervalUs}};
+    setitimer(ITIMER_PROF, &tv, nullptr);
+    sampling = true;
+}
+
+void Profiler::stopSampling(){
+    itimerval tv{};
+    setitimer(ITIMER_PROF, &tv, nullptr);
+    signal(SIGPROF, SIG_IGN);
+    sampled = nullptr;
+    sampling = false;
+}
+
+void Profiler::report(std::ostream& out) const {
+    char line[160];
+    std::vector<std::pair<Symbol, FnStats>> fns(functions.begin(), functions.end());
+    std::sort(fns.begin(), fns.end(), [](const auto& a, const auto& b){ return a.second.exclusive>b.second.exclusive; });
+    out << "\n";
+    std::snprintf(line, sizeof line, "%-24s %12s %12s %12s %12s\n", "function", "calls", "incl ms", "excl ms", "allocs");
+    out << line;
+    for (auto& [name, f]: fns){
+        if (f.calls==0) continue;
+        std::snprintf(line, sizeof line, "%-24s %12llu %12.3f %12.3f %12llu\n", nameOf(name),
+                      (unsigned long long)f.calls, f.inclusive/1e6, f.exclusive/1e6, (unsigned long long)f.allocs);
+        out << line;
+    }
+
+    std::vector<std::pair<uint64_t, SiteStats>> ss(sites.begin(), sites.end());
+    std::sort(ss.begin(), ss.end(), [](const auto& a, const auto& b){ return a.second.calls>b.second.calls; });
+    out << "\n";
+    std::snprintf(line, sizeof line, "%-40s %12s %12s\n", "call site (caller > callee)", "calls", "incl ms");
+    out << line;
+    for (auto& [key, s]: ss){
+        if (s.calls==0) continue;
+        Symbol caller = Symbol(key>>32), callee = Symbol(key);
+        std::string site = std::string(caller==NoSymbol ? "<top>" : nameOf(caller))+" > "+nameOf(callee);
+        std::snprintf(line, sizeof line, "%-40s %12llu %12.3f\n", site.c_str(), (unsigned long long)s.calls, s.inclusive/1e6);
+        out << line;
+    }
+    if (dropped) out << "\n" << dropped << " samples dropped (buffer full)\n";
+}
+
+void Profiler::writeFolded(std::ostream& out) const {
+    std::map<std::string, uint64_t> folded;
+    std::string stack;
+    for (size_t at=0; at<used; ){
+        size_t d = samples[at++];
+        stack.clear();
+        if (d==0) stack = "<top>";
+        for (size_t i=0;i<d;++i){
+            if (i) stack += ';';
+            stack += nameOf(samples[at+i]);
+        }
+        ++folded[stack];
+        at += d;
+    }
+    for (auto& [s, n]: folded) out << s << ' ' << n << '\n';
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "symbols.h"
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+// --profile / --flamegraph. Both engines report every builtin and user
+// function call to the Profiler through Interpreter::profiler, which is null
+// unless profiling was asked for, so an unprofiled run only pays a pointer
+// test per call.
+//
+// The calls in progress form a shadow stack. Leaving a call credits it with
+// its inclusive time (for the outermost activation only, so recursion is not
+// counted twice; likewise for call sites), its exclusive time and the heap
+// objects created while it was on top. Call sites are keyed by caller and
+// callee name: the AST keeps no source positions. A tail call ends its
+// caller, so it shows up as a call from the function that made it, one
+// level up the stack.
+//
+// Sampling reads the same shadow stack from a SIGPROF handler into a buffer
+// allocated up front and writes the result as folded stacks (one
+// "outer;inner count" line per distinct stack) for flamegraph.pl.
+struct Profiler {
+    Profiler();
+    ~Profiler();
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    void enter(Symbol name);     // NoSymbol: an anonymous function value
+    void leave();
+    void replace(Symbol name);   // tail call: the top call ends and `name` takes its place
+    void cancel();               // forget the call just entered (it was run some other way)
+    size_t depth() const { return calls.size(); }
+    void unwind(size_t to){ while (calls.size()>to) leave(); }   // after an error
+
+    void startSampling();
+    void stopSampling();
+
+    void report(std::ostream& out) const;
+    void writeFolded(std::ostream& out) const;
+
+private:
+    struct Entry { Symbol name, caller; uint64_t start, child, allocStart, childAllocs; };
+    struct FnStats { uint64_t calls = 0, inclusive = 0, exclusive = 0, allocs = 0; uint32_t active = 0; };
+    struct SiteStats { uint64_t calls = 0, inclusive = 0; uint32_t active = 0; };
+
+    std::vector<Entry> calls;
+    std::unordered_map<Symbol, FnStats> functions;
+    std::unordered_map<uint64_t, SiteStats> sites;   // caller<<32 | callee
+
+    // what the signal handler sees: the outermost kSampleDepth names of the shadow stack
+    static constexpr size_t kSampleDepth = 512;
+    Symbol names[kSampleDepth];
+    volatile uint32_t live = 0;
+    std::vector<Symbol> samples;     // per sample: its depth, then the names, outermost first
+    volatile size_t used = 0;
+    volatile uint64_t dropped = 0;   // samples that did not fit
+    bool sampling = false;
+
+    void push(Symbol name, Symbol caller);
+    void sample();
+    friend void onSigprof(int);
+};
@@ -0,0 +1,49 @@
+#include "program.h"
+#include "compiler.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "resolver.h"
+
+std::shared_ptr<const Program> Program::build(ASTPtr ast, std::shared_ptr<const Runtime> rt, bool bytecode){
+    return make(std::move(ast), std::move(rt), bytecode);
+}
+
+std::shared_ptr<Program> Program::make(ASTPtr ast, std::shared_ptr<const Runtime> rt, bool bytecode){
+    auto P = std::make_shared<Program>();
+    P->runtime = rt;
+    P->ast = ast;
+    {
+        Interpreter scratch(rt);   // the optimizer runs pure builtins in it
+        Optimizer(scratch).program(*ast);
+    }
+    Resolver(P->layout).program(*ast);
+    if (bytecode){
+        auto main = std::make_shared<Chunk>(Compiler().compileProgram(*ast));
+        P->share(*main);
+        P->main = main;
+    }
+    return P;
+}
+
+std::shared_ptr<const Program> Program::parse(std::string source, std::shared_ptr<const Runtime> rt, bool bytecode){
+    auto names = std::make_unique<SymbolOwner>();
+    Parser parser(std::move(source));
+    parser.names = names.get();
+    auto P = make(parser.parseProgram(), std::move(rt), bytecode);
+    P->names = std::move(names);
+    return P;
+}
+
+// Numbers `chunk` and compiles the lambda bodies it makes functions of, so
+// running never has to fill in Function::compiled on a template.
+void Program::share(Chunk& chunk){
+    chunk.id = uint32_t(chunks.size());
+    chunks.push_back(&chunk);
+    for (const Value& v: chunk.consts){
+        if (!v.isFunc()) continue;
+        Function& T = *v.func();
+        auto body = std::make_shared<Chunk>(Compiler().compileBody(T.body));
+        share(*body);
+        T.compiled = body;
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "runtime.h"
+#include "bytecode.h"
+#include <memory>
+#include <string>
+
+// A program made ready to run, then only read: optimized (see optimizer.h)
+// against its Runtime's builtins, resolved against its own global layout
+// and, if asked, compiled to bytecode together with the body of every
+// lambda in it. Any number of contexts may run it at the same time, on any
+// threads (Interpreter::run, VM::run); each run starts from empty globals
+// laid out as `layout` says.
+struct Program {
+    std::unique_ptr<SymbolOwner> names;   // the names parsed for it (see symbols.h); null if built
+    std::shared_ptr<const Runtime> runtime;
+    ASTPtr ast;
+    Environment layout;                   // global names and slots, none bound
+    std::shared_ptr<const Chunk> main;    // null unless built with bytecode
+    std::vector<const Chunk*> chunks;     // main and the lambda bodies, by Chunk::id
+
+    static std::shared_ptr<const Program> build(ASTPtr ast, std::shared_ptr<const Runtime> rt = Runtime::standard(),
+                                                bool bytecode = true);
+    static std::shared_ptr<const Program> parse(std::string source, std::shared_ptr<const Runtime> rt = Runtime::standard(),
+                                                bool bytecode = true);
+
+private:
+    static std::shared_ptr<Program> make(ASTPtr ast, std::shared_ptr<const Runtime> rt, bool bytecode);
+    void share(Chunk& chunk);
+};
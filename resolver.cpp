@@ -0,0 +1,78 @@
+#include "resolver.h"
+
+bool Resolver::local(Symbol name, int32_t& depth, uint32_t& slot){
+    for (size_t s=scopes.size(); s-->0;){
+        const std::vector<Symbol>& params = *scopes[s];
+        for (size_t i=params.size(); i-->0;){       // later params shadow earlier ones
+            if (params[i]!=name) continue;
+            depth = int32_t(scopes.size()-1-s);
+            slot = uint32_t(i);
+            // every lambda between here and the owner has to carry the value in
+            for (size_t o=s+1; o<scopes.size(); ++o) openers[o]->closure = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Resolver::node(NodeRef n){
+    switch(n->kind){
+        case ASTKind::Number:
+        case ASTKind::String:
+            return;
+        case ASTKind::Identifier:
+            if (!local(n->sym, n->depth, n->slot)){ n->depth = ASTNode::Global; n->slot = globals.slotFor(n->sym); }
+            return;
+        case ASTKind::Call: {
+            static const Symbol lambda0 = intern("lambda0"), lambda = intern("lambda");
+            if ((n->sym==lambda0 || n->sym==lambda) && n->argc>0){
+                lambdaBody(n);
+                return;
+            }
+            for (size_t i=0;i<n->argc;++i) node(n.arg(i));
+            // a parameter holding a function can be called by its name
+            local(n->sym, n->depth, n->slot);
+            // get/set/declare only ever touch globals
+            size_t argc = n->argc;
+            if (argc==0 || n.arg(0)->kind!=ASTKind::String) return;
+            static const Symbol get = intern("get"), set = intern("set"), declare = intern("declare");
+            if (n->sym==get && argc==1) n->var = VarOp::Get;
+            else if (n->sym==set && argc==2) n->var = VarOp::Set;
+            else if (n->sym==declare && argc<=2) n->var = VarOp::Declare;
+            else return;
+            n->depth = ASTNode::Global;
+            n->slot = globals.slotFor(n.arg(0)->sym);
+            return;
+        }
+    }
+}
+
+// The parameter names of lambda0/lambda are string literals, so the body can
+// be scoped here, inside the scopes of the lambdas around it.
+void Resolver::lambdaBody(NodeRef call){
+    std::vector<Symbol> scope;
+    for (size_t i=0;i+1<call->argc;++i){
+        NodeRef p = call.arg(i);
+        if (p->kind!=ASTKind::String) return;   // rejected when evaluated
+        scope.push_back(p->sym);
+    }
+    scopes.push_back(&scope);
+    openers.push_back(call.n);
+    node(call.arg(call->argc-1));
+    scopes.pop_back();
+    openers.pop_back();
+}
+
+void Resolver::program(AST& ast){
+    scopes.clear(); openers.clear();
+    for (NodeId s: ast.stmts) node(NodeRef(ast, s));
+}
+
+void Resolver::function(Function& F){
+    if (F.resolved) return;
+    scopes.assign(1, &F.params);
+    openers.assign(1, nullptr);
+    if (F.body) node(F.body);
+    scopes.clear(); openers.clear();
+    F.resolved = true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "ast.h"
+#include "environment.h"
+
+// Static pass run before execution. Maps identifiers, and get/set/declare
+// calls whose name is a string literal, onto frame slots so the engines can
+// load them by index. Parameters of the function being resolved, and of the
+// lambdas around it, are (depth, slot) with depth counting enclosing
+// functions outward; every other name is reserved in the global frame.
+// Lambdas whose bodies reach outside themselves are marked as closures.
+// Anything left unresolved keeps using name lookup.
+struct Resolver {
+    Environment& globals;
+
+    explicit Resolver(Environment& g): globals(g) {}
+
+    void program(AST& ast);
+    void function(Function& F);
+
+private:
+    // parameter lists of the enclosing functions, innermost last, and the
+    // lambda call that opened each (null for a function resolved on its own)
+    std::vector<const std::vector<Symbol>*> scopes;
+    std::vector<ASTNode*> openers;
+
+    void node(NodeRef n);
+    void lambdaBody(NodeRef call);
+    bool local(Symbol name, int32_t& depth, uint32_t& slot);
+};
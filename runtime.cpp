@@ -0,0 +1,38 @@
+#include "runtime.h"
+#include "builtins.h"
+
+std::shared_ptr<const Runtime> Runtime::standard(){
+    static const std::shared_ptr<const Runtime> rt = []{
+        auto R = std::make_shared<Runtime>();
+        installBuiltins(*R);
+        return R;
+    }();
+    return rt;
+}
+
+Runtime::~Runtime(){
+    // immortal, so the table's references never free them
+    for (auto& entry: builtins){
+        Function* F = entry.second.get();
+        entry.second.reset();
+        delete F;
+    }
+}
+
+void Runtime::registerBuiltin(const std::string& name, NativeFn fn, uint32_t minArity, bool pure){
+    auto F = makeRef<Function>();
+    F->immortal = true;
+    F->isBuiltin = true;
+    F->native = fn;
+    F->minArity = minArity;
+    F->pure = pure;
+    builtins[intern(name)] = F;
+}
+
+void Runtime::registerSpecial(const std::string& name){
+    auto F = makeRef<Function>();
+    F->immortal = true;
+    F->isBuiltin = true;
+    F->isSpecial = true;
+    builtins[intern(name)] = F;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include "ast.h"
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+// The builtins, made once and then only read. Every context (Interpreter)
+// made from a Runtime starts with its table and may run on any thread, so
+// the Functions here are immortal: calls from different threads do not
+// touch their reference counts.
+struct Runtime {
+    std::unordered_map<Symbol, FuncPtr> builtins;   // name -> builtin or special form
+
+    Runtime() = default;
+    ~Runtime();
+    Runtime(const Runtime&) = delete;
+    Runtime& operator=(const Runtime&) = delete;
+
+    // The standard builtins (see builtins.h), made on first use.
+    static std::shared_ptr<const Runtime> standard();
+
+    bool isBuiltin(Symbol name) const { return builtins.count(name)!=0; }
+
+    // registration, before the Runtime is shared
+    void registerBuiltin(const std::string& name, NativeFn fn, uint32_t minArity=0, bool pure=false);
+    void registerSpecial(const std::string& name);
+};
@@ -0,0 +1,97 @@
+#include "scheduler.h"
+#include "vm.h"
+#include <algorithm>
+#include <csignal>
+#include <pthread.h>
+
+struct Scheduler::Run {
+    std::shared_ptr<const Program> program;
+    Interpreter context;
+    std::unique_ptr<VM> vm;
+    Prepare prepare;
+    Done done;
+    bool begun = false;
+
+    Run(std::shared_ptr<const Program> p, bool useVM, Prepare pr, Done d)
+        : program(std::move(p)), context(program->runtime), vm(useVM ? new VM(context) : nullptr),
+          prepare(std::move(pr)), done(std::move(d)) {}
+};
+
+Scheduler::Scheduler(size_t n){
+    // like the pool's helpers, the threads leave signals to the others
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (size_t i=0;i<std::max<size_t>(n, 1);++i) threads.emplace_back([this]{ work(); });
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+Scheduler::~Scheduler(){
+    {
+        std::lock_guard<std::mutex> g(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto& t: threads) t.join();
+}
+
+void Scheduler::submit(std::shared_ptr<const Program> program, bool useVM, Prepare prepare, Done done){
+    std::unique_ptr<Run> r(new Run(std::move(program), useVM, std::move(prepare), std::move(done)));
+    {
+        std::lock_guard<std::mutex> g(lock);
+        queue.push_back(std::move(r));
+        ++running;
+    }
+    ready.notify_one();
+}
+
+size_t Scheduler::live() const {
+    std::lock_guard<std::mutex> g(lock);
+    return running;
+}
+
+uint64_t Scheduler::slices() const {
+    std::lock_guard<std::mutex> g(lock);
+    return sliced;
+}
+
+void Scheduler::work(){
+    for (;;){
+        std::unique_ptr<Run> r;
+        {
+            std::unique_lock<std::mutex> g(lock);
+            ready.wait(g, [&]{ return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+            r = std::move(queue.front());
+            queue.pop_front();
+            ++sliced;
+        }
+        std::exception_ptr error;
+        bool ended;
+        try {
+            if (!r->begun){
+                r->begun = true;
+                if (r->prepare) r->prepare(r->context);
+                if (r->vm) r->vm->begin(*r->program);
+                else r->context.begin(*r->program);
+            }
+            ended = r->vm ? r->vm->resume() : r->context.resume();
+        } catch (...){
+            error = std::current_exception();
+            ended = true;
+        }
+        if (!ended){
+            // to the back: this thread, or a waiting one, takes the front
+            {
+                std::lock_guard<std::mutex> g(lock);
+                queue.push_back(std::move(r));
+            }
+            ready.notify_one();
+            continue;
+        }
+        if (r->done) r->done(error);
+        r.reset();
+        std::lock_guard<std::mutex> g(lock);
+        --running;
+    }
+}
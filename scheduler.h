@@ -0,0 +1,57 @@
+#pragma once
+#include "program.h"
+#include "interpreter.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Green threads: runs of Programs, each in a context of its own, taking
+// turns on a few threads. A run goes in slices of about
+// Interpreter::kSliceNanos (Interpreter::begin/resume); one whose slice
+// ended goes to the back of the queue. So every queued run gets its slice
+// in turn, however long the others take, and one that goes over its Budget
+// fails then without having held up the rest. Slices are timed rather than
+// counted in steps: a tree-walker step costs several VM instructions, and
+// runs on either engine get the same turns. Thousands may be queued: a
+// run that waits is its context's heap stacks and nothing else.
+//
+// A run's slices may go on different threads, one after another. Parallel
+// builtins in it still use the ThreadPool, within a slice.
+struct Scheduler {
+    // Sets up a run's context before its first slice (output, budget, ...).
+    using Prepare = std::function<void(Interpreter&)>;
+    // Called on a scheduler thread once a run has ended, with the error
+    // that ended it or null.
+    using Done = std::function<void(std::exception_ptr error)>;
+
+    explicit Scheduler(size_t threads);
+    ~Scheduler();            // after the runs still queued have ended
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // Queues a run of `program` from empty globals, on the VM when `useVM`.
+    void submit(std::shared_ptr<const Program> program, bool useVM, Prepare prepare, Done done);
+
+    size_t size() const { return threads.size(); }
+    size_t live() const;                // runs submitted and not ended
+    uint64_t slices() const;            // slices run so far
+
+private:
+    struct Run;
+
+    std::vector<std::thread> threads;
+    mutable std::mutex lock;            // guards the fields below
+    std::condition_variable ready;
+    std::deque<std::unique_ptr<Run>> queue;
+    size_t running = 0;                 // queued or in a slice
+    uint64_t sliced = 0;
+    bool stopping = false;
+
+    void work();
+};
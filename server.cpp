@@ -0,0 +1,362 @@
+#include "server.h"
+#include "interpreter.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdexcept>
+#include <streambuf>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static constexpr char kServeMagic[4] = {'C', 'X', 'S', '1'};
+
+static sockaddr_un addressOf(const std::string& path){
+    sockaddr_un a{};
+    a.sun_family = AF_UNIX;
+    if (path.size()>=sizeof a.sun_path) throw std::runtime_error("Socket path too long: "+path);
+    std::memcpy(a.sun_path, path.c_str(), path.size()+1);
+    return a;
+}
+
+// False when the peer has gone.
+static bool sendAll(int fd, const void* p, size_t n){
+    const char* c = static_cast<const char*>(p);
+    while (n){
+        ssize_t k = ::send(fd, c, n, MSG_NOSIGNAL);
+        if (k<0){
+            if (errno==EINTR) continue;
+            return false;
+        }
+        c += k; n -= size_t(k);
+    }
+    return true;
+}
+
+static bool recvAll(int fd, void* p, size_t n){
+    char* c = static_cast<char*>(p);
+    while (n){
+        ssize_t k = ::recv(fd, c, n, 0);
+        if (k==0) return false;
+        if (k<0){
+            if (errno==EINTR) continue;
+            return false;
+        }
+        c += k; n -= size_t(k);
+    }
+    return true;
+}
+
+static bool sendFrame(int fd, FrameHeader::Kind kind, const char* p, size_t n){
+    FrameHeader h{kind, uint32_t(n)};
+    return sendAll(fd, &h, sizeof h) && sendAll(fd, p, n);
+}
+
+// What a run's Output hands on, as Printed frames: at most a block each.
+struct FrameBuf : std::streambuf {
+    int fd;
+    explicit FrameBuf(int f): fd(f) {}
+
+    std::streamsize xsputn(const char* p, std::streamsize n) override {
+        if (!sendFrame(fd, FrameHeader::Printed, p, size_t(n)))
+            throw std::runtime_error(std::string("Cannot write output: ")+std::strerror(errno));
+        return n;
+    }
+    int_type overflow(int_type c) override {
+        if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+        char ch = traits_type::to_char_type(c);
+        xsputn(&ch, 1);
+        return c;
+    }
+};
+
+// A submission being run, and where what it prints goes.
+struct Submission {
+    struct Closer { int fd; ~Closer(){ ::close(fd); } } closer;   // last, after the output's final flush
+    FrameBuf frames;
+    std::ostream stream;
+    Output out;
+
+    explicit Submission(int fd): closer{fd}, frames(fd), stream(&frames), out(stream) {
+        stream.exceptions(std::ios::badbit);   // the client hung up: stop the run
+    }
+};
+
+// The Error and Status frames that end a response.
+static void finish(int fd, std::exception_ptr error, Output* out){
+    uint32_t status = 0;
+    if (error){
+        std::string why;
+        try { std::rethrow_exception(error); }
+        catch (const std::exception& ex){ why = ex.what(); }
+        catch (...){ why = "unknown error"; }
+        // what was printed before the error comes first
+        if (out) try { out->flush(); } catch (const std::exception&){}
+        sendFrame(fd, FrameHeader::Error, why.data(), why.size());
+        status = 1;
+    }
+    FrameHeader end{FrameHeader::Status, status};
+    sendAll(fd, &end, sizeof end);
+}
+
+Server::Server(const std::string& p, size_t threads, Budget b, std::shared_ptr<const Runtime> rt): path(p), budget(b), runtime(std::move(rt)) {
+    sockaddr_un a = addressOf(path);
+    // a socket file nothing answers on was left by a server that died
+    struct stat st;
+    if (::lstat(path.c_str(), &st)==0){
+        if (!S_ISSOCK(st.st_mode)) throw std::runtime_error("Not a socket: "+path);
+        int probe = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool live = probe>=0 && ::connect(probe, reinterpret_cast<sockaddr*>(&a), sizeof a)==0;
+        if (probe>=0) ::close(probe);
+        if (live) throw std::runtime_error("Another server is listening on "+path);
+        ::unlink(path.c_str());
+    }
+    listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener<0 || ::bind(listener, reinterpret_cast<sockaddr*>(&a), sizeof a)<0 || ::listen(listener, 128)<0
+        || ::pipe2(wakeup, O_CLOEXEC)<0){
+        std::string why = std::strerror(errno);
+        if (listener>=0) ::close(listener);
+        throw std::runtime_error("Cannot listen on "+path+": "+why);
+    }
+    // a run's values die with it, so the names of scripts dropped from `programs` can go
+    symbols().freeNames();
+    // like the pool's helpers, the workers leave signals to the other threads
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (size_t i=0;i<std::max<size_t>(threads, 1);++i) workers.emplace_back([this]{ work(); });
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    runs.reset(new Scheduler(threads));
+}
+
+Server::~Server(){
+    drain();
+    ::close(listener);
+    ::close(wakeup[0]);
+    ::close(wakeup[1]);
+    ::unlink(path.c_str());
+}
+
+void Server::serve(){
+    std::vector<pollfd> fds;
+    for (;;){
+        fds.assign({{listener, POLLIN, 0}, {wakeup[0], POLLIN, 0}});
+        for (auto& c: incoming) fds.push_back({c.fd, POLLIN, 0});
+        // with requests coming in, wake up now and then to drop the silent ones
+        if (::poll(fds.data(), fds.size(), incoming.empty() ? -1 : 1000)<0){
+            if (errno==EINTR) continue;
+            throw std::runtime_error(std::string("Cannot wait for connections: ")+std::strerror(errno));
+        }
+        if (fds[1].revents){
+            char c;
+            (void)::read(wakeup[0], &c, 1);
+            drain();
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        size_t kept = 0;
+        for (size_t i=0;i<incoming.size();++i){
+            Incoming& c = incoming[i];
+            if (fds[i+2].revents){
+                if (!read(c)){
+                    ::close(c.fd);
+                    continue;
+                }
+                c.heard = now;
+            } else if (now-c.heard>kPatience){
+                ::close(c.fd);
+                continue;
+            }
+            if (c.got>=sizeof c.h && c.got==sizeof c.h+c.source.size()){
+                // what it prints is sent as the run goes, blocking, for up to kPatience a frame
+                ::fcntl(c.fd, F_SETFL, ::fcntl(c.fd, F_GETFL) & ~O_NONBLOCK);
+                timeval patience{kPatience.count()/1000, (kPatience.count()%1000)*1000};
+                ::setsockopt(c.fd, SOL_SOCKET, SO_SNDTIMEO, &patience, sizeof patience);
+                {
+                    std::lock_guard<std::mutex> g(lock);
+                    waiting.push_back(Request{c.fd, c.h.flags, std::move(c.source)});
+                }
+                ready.notify_one();
+                continue;
+            }
+            if (kept!=i) incoming[kept] = std::move(c);
+            ++kept;
+        }
+        incoming.erase(incoming.begin()+kept, incoming.end());
+        if (fds[0].revents){
+            int fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            // else the client gave up, or out of descriptors for now
+            if (fd>=0) incoming.push_back(Incoming{fd, {}, 0, {}, now});
+        }
+    }
+}
+
+// Reads what has come of c's request, without waiting for more.
+bool Server::read(Incoming& c){
+    for (;;){
+        char* p;
+        size_t n;
+        if (c.got<sizeof c.h){
+            p = reinterpret_cast<char*>(&c.h)+c.got;
+            n = sizeof c.h-c.got;
+        } else {
+            p = &c.source[0]+(c.got-sizeof c.h);
+            n = c.source.size()-(c.got-sizeof c.h);
+        }
+        if (n==0) return true;
+        ssize_t k = ::recv(c.fd, p, n, 0);
+        if (k==0) return false;
+        if (k<0){
+            if (errno==EINTR) continue;
+            return errno==EAGAIN || errno==EWOULDBLOCK;
+        }
+        c.got += size_t(k);
+        if (c.got==sizeof c.h){
+            if (std::memcmp(c.h.magic, kServeMagic, 4)!=0 || c.h.size>kMaxScript) return false;
+            c.source.resize(c.h.size);
+        }
+    }
+}
+
+// Answers the requests already read and waits for their runs. Connections
+// whose requests have not all come are cut.
+void Server::drain(){
+    for (auto& c: incoming){
+        ::shutdown(c.fd, SHUT_RDWR);
+        ::close(c.fd);
+    }
+    incoming.clear();
+    {
+        std::lock_guard<std::mutex> g(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto& w: workers) w.join();
+    workers.clear();
+    runs.reset();
+}
+
+void Server::stop(){
+    char c = 0;
+    (void)!::write(wakeup[1], &c, 1);
+}
+
+uint64_t Server::served() const {
+    std::lock_guard<std::mutex> g(lock);
+    return count;
+}
+
+uint64_t Server::programHits() const {
+    std::lock_guard<std::mutex> g(lock);
+    return hits;
+}
+
+void Server::work(){
+    for (;;){
+        Request r;
+        {
+            std::unique_lock<std::mutex> g(lock);
+            ready.wait(g, [&]{ return stopping || !waiting.empty(); });
+            if (waiting.empty()) return;
+            r = std::move(waiting.front());
+            waiting.pop_front();
+        }
+        answer(std::move(r));
+    }
+}
+
+void Server::answer(Request r){
+    int fd = r.fd;
+    std::shared_ptr<const Program> P;
+    try {
+        P = program(std::move(r.source));
+    } catch (...){
+        finish(fd, std::current_exception(), nullptr);
+        ::close(fd);
+        answered();
+        return;
+    }
+    auto s = std::make_shared<Submission>(fd);
+    runs->submit(std::move(P), r.flags & ServeVM, [this, s, flags = r.flags](Interpreter& context){
+        context.out = &s->out;
+        context.jit = flags & ServeJIT;
+        context.memo = !(flags & ServeNoMemo);
+        context.budget = budget;
+    }, [this, s](std::exception_ptr error){
+        finish(s->closer.fd, error, &s->out);
+        answered();
+    });
+}
+
+void Server::answered(){
+    std::lock_guard<std::mutex> g(lock);
+    ++count;
+}
+
+std::shared_ptr<const Program> Server::program(std::string source){
+    uint64_t key = SymbolTable::hashOf(source);
+    {
+        std::lock_guard<std::mutex> g(lock);
+        auto it = programs.find(key);
+        if (it!=programs.end() && it->second.source==source){
+            ages.splice(ages.begin(), ages, it->second.age);
+            ++hits;
+            return it->second.program;
+        }
+    }
+    // built outside the lock: two threads sent the same new script both build it
+    auto P = Program::parse(source, runtime);
+    std::lock_guard<std::mutex> g(lock);
+    auto it = programs.find(key);
+    if (it!=programs.end()){
+        ages.erase(it->second.age);
+        programs.erase(it);
+    } else if (programs.size()==kProgramsKept){
+        programs.erase(ages.back());
+        ages.pop_back();
+    }
+    ages.push_front(key);
+    programs.emplace(key, Kept{std::move(source), P, ages.begin()});
+    return P;
+}
+
+int submit(const std::string& path, std::string_view script, uint32_t flags, Output& out, std::ostream& err){
+    sockaddr_un a = addressOf(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd<0 || ::connect(fd, reinterpret_cast<sockaddr*>(&a), sizeof a)<0){
+        std::string why = std::strerror(errno);
+        if (fd>=0) ::close(fd);
+        throw std::runtime_error("Cannot connect to "+path+": "+why);
+    }
+    struct Closer { int fd; ~Closer(){ ::close(fd); } } closer{fd};
+    RequestHeader h;
+    std::memcpy(h.magic, kServeMagic, 4);
+    h.flags = flags;
+    h.size = script.size();
+    const std::string hungUp = "Server hung up: "+path;
+    if (!sendAll(fd, &h, sizeof h) || !sendAll(fd, script.data(), script.size())) throw std::runtime_error(hungUp);
+    std::string text;
+    for (;;){
+        FrameHeader f;
+        if (!recvAll(fd, &f, sizeof f)) throw std::runtime_error(hungUp);
+        if (f.kind==FrameHeader::Status){
+            out.flush();
+            return int(f.size);
+        }
+        text.resize(f.size);
+        if (!recvAll(fd, &text[0], text.size())) throw std::runtime_error(hungUp);
+        if (f.kind==FrameHeader::Printed){
+            out.write(text);
+            out.flush();
+        } else {
+            out.flush();
+            err << "Error: " << text << "\n";
+        }
+    }
+}
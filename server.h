@@ -0,0 +1,126 @@
+#pragma once
+#include "program.h"
+#include "output.h"
+#include "scheduler.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Warm-interpreter daemon (--serve SOCKET) and its client (--connect SOCKET).
+// The server makes the builtins once and keeps the last kProgramsKept
+// programs it was sent, parsed, optimized and compiled, keyed by a hash of
+// their text. Each submission runs in a fresh Interpreter, so a script
+// starts from empty globals as it would in a process of its own; the names
+// a script brings go when its program and runs are gone (see symbols.h),
+// so a server sent ever new scripts does not grow for good. The runs
+// take turns on the server's Scheduler, each within the server's Budget,
+// so a script that loops forever neither blocks a thread nor delays the
+// others more than a slice at a time. Requests are read as they come in,
+// beside accepting, so a client that connects and sends nothing holds up
+// no one; one that has gone kPatience without sending or reading is
+// dropped.
+//
+// On the socket, one script per connection:
+//   request   RequestHeader, then `size` bytes of script
+//   response  frames: a FrameHeader, then `size` bytes for Printed and
+//             Error frames. Printed carries what print wrote, as it is
+//             flushed; Error the message of the error that ended the run.
+//             The last frame is Status, whose `size` is the exit status
+//             (0, or 1 after an error) and which has no bytes.
+constexpr uint32_t ServeVM = 1, ServeJIT = 2, ServeNoMemo = 4;   // RequestHeader::flags
+
+struct RequestHeader {
+    char magic[4];           // "CXS1"
+    uint32_t flags;
+    uint64_t size;
+};
+
+struct FrameHeader {
+    enum Kind : uint32_t { Printed, Error, Status };
+    uint32_t kind;
+    uint32_t size;
+};
+
+struct Server {
+    static constexpr size_t kProgramsKept = 256;
+    static constexpr uint64_t kMaxScript = uint64_t(64)<<20;
+    static constexpr std::chrono::milliseconds kPatience{10000};
+
+    // Listens on `path`, replacing a socket file no server answers on.
+    // `threads` parse requests and as many run scripts.
+    Server(const std::string& path, size_t threads, Budget budget = Budget(), std::shared_ptr<const Runtime> rt = Runtime::standard());
+    ~Server();               // stops; the socket file is removed
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    // Accepts connections and reads their requests until stop(), then
+    // returns once the runs still going have ended. Requests not all sent
+    // by then are not answered. Call it once.
+    void serve();
+    // Makes serve() return. Async-signal-safe, so a SIGINT handler may call it.
+    void stop();
+
+    uint64_t served() const;            // submissions answered so far
+    uint64_t programHits() const;       // of them, ones whose program was kept
+
+private:
+    // A connection whose request is still coming in.
+    struct Incoming {
+        int fd;
+        RequestHeader h;
+        size_t got;                     // bytes of `h`, then of `source`
+        std::string source;
+        std::chrono::steady_clock::time_point heard;   // last bytes, or accepted
+    };
+    // One read in full, for a worker to parse and queue.
+    struct Request {
+        int fd;
+        uint32_t flags;
+        std::string source;
+    };
+    struct Kept {
+        std::string source;
+        std::shared_ptr<const Program> program;
+        std::list<uint64_t>::iterator age;
+    };
+
+    std::string path;
+    Budget budget;
+    std::shared_ptr<const Runtime> runtime;
+    int listener = -1;
+    int wakeup[2] = {-1, -1};           // stop() writes to [1]
+    std::vector<Incoming> incoming;     // serve()'s own
+
+    std::vector<std::thread> workers;   // parse requests
+    std::unique_ptr<Scheduler> runs;
+    mutable std::mutex lock;            // guards the fields below
+    std::condition_variable ready;
+    std::deque<Request> waiting;        // read, not yet parsed
+    bool stopping = false;
+    std::unordered_map<uint64_t, Kept> programs;
+    std::list<uint64_t> ages;           // keys of `programs`, most recently used first
+    uint64_t count = 0, hits = 0;
+
+    bool read(Incoming& c);  // false: drop it
+    void work();
+    void answer(Request r);  // closes r.fd, now or when the run has ended
+    void answered();
+    void drain();
+    std::shared_ptr<const Program> program(std::string source);
+};
+
+// Sends `script` to the server at `path` and writes what it prints to
+// `out` and its error, if any, to `err` as the command line would. Returns
+// the exit status of the run; throws when the server cannot be reached or
+// hangs up early.
+int submit(const std::string& path, std::string_view script, uint32_t flags, Output& out, std::ostream& err);
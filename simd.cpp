@@ -0,0 +1,65 @@
+#include "simd_kernels.h"
+#include <cstdlib>
+#include <cstring>
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+struct ScalarLanes {
+    using V = double;
+    static constexpr size_t W = 1;
+    static V load(const double* p){ return *p; }
+    static void store(double* p, V v){ *p = v; }
+    static V set1(double x){ return x; }
+    static V add(V x, V y){ return x+y; }
+    static V sub(V x, V y){ return x-y; }
+    static V mul(V x, V y){ return x*y; }
+    static V div(V x, V y){ return x/y; }
+    static V min(V x, V y){ return x<y ? x : y; }
+    static V max(V x, V y){ return x>y ? x : y; }
+    template<VecOp op> static V cmp(V x, V y){
+        bool r = op==VecOp::Eq ? x==y : op==VecOp::Ne ? x!=y : op==VecOp::Lt ? x<y
+               : op==VecOp::Le ? x<=y : op==VecOp::Gt ? x>y : x>=y;
+        return r ? 1.0 : 0.0;
+    }
+};
+
+const VecKernels kScalarKernels = kernelsFor<ScalarLanes>("scalar");
+
+#if defined(__x86_64__)
+// SSE2 is part of x86-64, so this needs no check
+struct Sse2Lanes {
+    using V = __m128d;
+    static constexpr size_t W = 2;
+    static V load(const double* p){ return _mm_loadu_pd(p); }
+    static void store(double* p, V v){ _mm_storeu_pd(p, v); }
+    static V set1(double x){ return _mm_set1_pd(x); }
+    static V add(V x, V y){ return _mm_add_pd(x, y); }
+    static V sub(V x, V y){ return _mm_sub_pd(x, y); }
+    static V mul(V x, V y){ return _mm_mul_pd(x, y); }
+    static V div(V x, V y){ return _mm_div_pd(x, y); }
+    static V min(V x, V y){ return _mm_min_pd(x, y); }   // x<y ? x : y, lane by lane
+    static V max(V x, V y){ return _mm_max_pd(x, y); }
+    template<VecOp op> static V cmp(V x, V y){
+        V m = op==VecOp::Eq ? _mm_cmpeq_pd(x, y) : op==VecOp::Ne ? _mm_cmpneq_pd(x, y) : op==VecOp::Lt ? _mm_cmplt_pd(x, y)
+            : op==VecOp::Le ? _mm_cmple_pd(x, y) : op==VecOp::Gt ? _mm_cmpgt_pd(x, y) : _mm_cmpge_pd(x, y);
+        return _mm_and_pd(m, _mm_set1_pd(1.0));
+    }
+};
+
+const VecKernels kSse2Kernels = kernelsFor<Sse2Lanes>("sse2");
+#endif
+
+const VecKernels& vec(){
+    static const VecKernels* picked = []{
+        const char* want = std::getenv("CALLIX_SIMD");
+        auto wanted = [&](const char* name){ return !want || std::strcmp(want, name)==0; };
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (wanted("avx2") && __builtin_cpu_supports("avx2")) return &kAvx2Kernels;
+        if (wanted("sse2")) return &kSse2Kernels;
+#endif
+        return &kScalarKernels;
+    }();
+    return *picked;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Loops over arrays of doubles behind the array builtins. There are AVX2,
+// SSE2 and plain C++ versions; the best one the CPU supports is picked on
+// first use (CALLIX_SIMD=avx2|sse2|scalar forces one, e.g. to compare).
+//
+// The elementwise operations are exact in every version. The reductions
+// keep eight partial results, element i going to partial i%8, and combine
+// them pairwise in a fixed order, so sum and dot round the same way whichever
+// version runs. No version fuses multiply and add.
+enum class VecOp : uint8_t { Add, Sub, Mul, Div, Eq, Ne, Lt, Le, Gt, Ge };
+
+struct VecKernels {
+    const char* name;
+    // out[i] = a[i] op b[i], where a side marked scalar is *a (or *b) for every i;
+    // comparisons give 1 or 0. out may be a or b.
+    void (*binary)(VecOp op, const double* a, bool aScalar, const double* b, bool bScalar, double* out, size_t n);
+    double (*sum)(const double* a, size_t n);
+    double (*dot)(const double* a, const double* b, size_t n);
+    double (*min)(const double* a, size_t n);   // NaNs are skipped; +inf when there is nothing else
+    double (*max)(const double* a, size_t n);   // -inf likewise
+};
+
+const VecKernels& vec();
+
+// the versions themselves, for vec() and callix_bench
+extern const VecKernels kScalarKernels;
+#if defined(__x86_64__)
+extern const VecKernels kSse2Kernels;
+extern const VecKernels kAvx2Kernels;
+#endif
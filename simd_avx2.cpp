@@ -0,0 +1,31 @@
+// AVX2 kernels. Only this file is compiled for AVX2, and vec() only picks
+// them on a CPU that has it.
+#if defined(__x86_64__)
+#include "simd.h"
+#include <limits>            // before the pragma: only the kernels below are AVX2 code
+#pragma GCC target("avx2")
+#include "simd_kernels.h"
+#include <immintrin.h>
+
+struct Avx2Lanes {
+    using V = __m256d;
+    static constexpr size_t W = 4;
+    static V load(const double* p){ return _mm256_loadu_pd(p); }
+    static void store(double* p, V v){ _mm256_storeu_pd(p, v); }
+    static V set1(double x){ return _mm256_set1_pd(x); }
+    static V add(V x, V y){ return _mm256_add_pd(x, y); }
+    static V sub(V x, V y){ return _mm256_sub_pd(x, y); }
+    static V mul(V x, V y){ return _mm256_mul_pd(x, y); }
+    static V div(V x, V y){ return _mm256_div_pd(x, y); }
+    static V min(V x, V y){ return _mm256_min_pd(x, y); }   // x<y ? x : y, lane by lane
+    static V max(V x, V y){ return _mm256_max_pd(x, y); }
+    template<VecOp op> static V cmp(V x, V y){
+        V m = op==VecOp::Eq ? _mm256_cmp_pd(x, y, _CMP_EQ_OQ) : op==VecOp::Ne ? _mm256_cmp_pd(x, y, _CMP_NEQ_UQ)
+            : op==VecOp::Lt ? _mm256_cmp_pd(x, y, _CMP_LT_OQ) : op==VecOp::Le ? _mm256_cmp_pd(x, y, _CMP_LE_OQ)
+            : op==VecOp::Gt ? _mm256_cmp_pd(x, y, _CMP_GT_OQ) : _mm256_cmp_pd(x, y, _CMP_GE_OQ);
+        return _mm256_and_pd(m, _mm256_set1_pd(1.0));
+    }
+};
+
+const VecKernels kAvx2Kernels = kernelsFor<Avx2Lanes>("avx2");
+#endif
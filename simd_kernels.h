@@ -0,0 +1,109 @@
+#pragma once
+// Kernel bodies for simd.h, written once over a lane type L:
+//   V, W (lanes per V), load, store, set1, add, sub, mul, div, min, max and
+//   cmp<VecOp>, which gives 1.0 or 0.0 per lane.
+// Included by simd.cpp (scalar, SSE2) and simd_avx2.cpp, which compiles it
+// for AVX2. Everything here is static, so each includer gets its own copy.
+#include "simd.h"
+#include <limits>
+
+template<class L, VecOp op>
+static typename L::V apply(typename L::V x, typename L::V y){
+    if constexpr (op==VecOp::Add) return L::add(x, y);
+    else if constexpr (op==VecOp::Sub) return L::sub(x, y);
+    else if constexpr (op==VecOp::Mul) return L::mul(x, y);
+    else if constexpr (op==VecOp::Div) return L::div(x, y);
+    else return L::template cmp<op>(x, y);
+}
+
+template<class L, VecOp op>
+static void mapLanes(const double* a, bool aScalar, const double* b, bool bScalar, double* out, size_t n){
+    if (n==0) return;
+    typename L::V as = L::set1(*a), bs = L::set1(*b);
+    size_t i = 0;
+    for (; i+L::W<=n; i+=L::W){
+        typename L::V x = aScalar ? as : L::load(a+i), y = bScalar ? bs : L::load(b+i);
+        L::store(out+i, apply<L, op>(x, y));
+    }
+    for (; i<n; ++i){
+        double r[L::W];
+        L::store(r, apply<L, op>(L::set1(aScalar ? *a : a[i]), L::set1(bScalar ? *b : b[i])));
+        out[i] = r[0];
+    }
+}
+
+template<class L>
+static void binaryKernel(VecOp op, const double* a, bool aScalar, const double* b, bool bScalar, double* out, size_t n){
+    switch(op){
+        case VecOp::Add: return mapLanes<L, VecOp::Add>(a, aScalar, b, bScalar, out, n);
+        case VecOp::Sub: return mapLanes<L, VecOp::Sub>(a, aScalar, b, bScalar, out, n);
+        case VecOp::Mul: return mapLanes<L, VecOp::Mul>(a, aScalar, b, bScalar, out, n);
+        case VecOp::Div: return mapLanes<L, VecOp::Div>(a, aScalar, b, bScalar, out, n);
+        case VecOp::Eq:  return mapLanes<L, VecOp::Eq>(a, aScalar, b, bScalar, out, n);
+        case VecOp::Ne:  return mapLanes<L, VecOp::Ne>(a, aScalar, b, bScalar, out, n);
+        case VecOp::Lt:  return mapLanes<L, VecOp::Lt>(a, aScalar, b, bScalar, out, n);
+        case VecOp::Le:  return mapLanes<L, VecOp::Le>(a, aScalar, b, bScalar, out, n);
+        case VecOp::Gt:  return mapLanes<L, VecOp::Gt>(a, aScalar, b, bScalar, out, n);
+        case VecOp::Ge:  return mapLanes<L, VecOp::Ge>(a, aScalar, b, bScalar, out, n);
+    }
+}
+
+// Eight partials as 8/W registers. step(acc, i) folds elements i..i+8 into
+// them, tail(part, i) folds element i into part[i%8].
+template<class L, class Step, class Tail>
+static double reduce8(double init, size_t n, Step step, Tail tail, double (*join)(double, double)){
+    constexpr size_t R = 8/L::W;
+    typename L::V acc[R];
+    for (size_t r=0;r<R;++r) acc[r] = L::set1(init);
+    size_t i = 0;
+    for (; i+8<=n; i+=8) step(acc, i);
+    double part[8];
+    for (size_t r=0;r<R;++r) L::store(part+r*L::W, acc[r]);
+    for (; i<n; ++i) tail(part, i);
+    return join(join(join(part[0], part[1]), join(part[2], part[3])), join(join(part[4], part[5]), join(part[6], part[7])));
+}
+
+static double joinAdd(double x, double y){ return x+y; }
+static double joinMin(double x, double y){ return y<x ? y : x; }
+static double joinMax(double x, double y){ return y>x ? y : x; }
+
+template<class L>
+static double sumKernel(const double* a, size_t n){
+    using V = typename L::V;
+    return reduce8<L>(0.0, n,
+        [&](V* acc, size_t i){ for (size_t r=0;r<8/L::W;++r) acc[r] = L::add(acc[r], L::load(a+i+r*L::W)); },
+        [&](double* part, size_t i){ part[i%8] += a[i]; }, joinAdd);
+}
+
+template<class L>
+static double dotKernel(const double* a, const double* b, size_t n){
+    using V = typename L::V;
+    return reduce8<L>(0.0, n,
+        [&](V* acc, size_t i){
+            for (size_t r=0;r<8/L::W;++r) acc[r] = L::add(acc[r], L::mul(L::load(a+i+r*L::W), L::load(b+i+r*L::W)));
+        },
+        [&](double* part, size_t i){ part[i%8] += a[i]*b[i]; }, joinAdd);
+}
+
+// min/max keep a partial unless the element is smaller (larger), so NaNs,
+// which compare false, never replace one
+template<class L>
+static double minKernel(const double* a, size_t n){
+    using V = typename L::V;
+    return reduce8<L>(std::numeric_limits<double>::infinity(), n,
+        [&](V* acc, size_t i){ for (size_t r=0;r<8/L::W;++r) acc[r] = L::min(L::load(a+i+r*L::W), acc[r]); },
+        [&](double* part, size_t i){ if (a[i]<part[i%8]) part[i%8] = a[i]; }, joinMin);
+}
+
+template<class L>
+static double maxKernel(const double* a, size_t n){
+    using V = typename L::V;
+    return reduce8<L>(-std::numeric_limits<double>::infinity(), n,
+        [&](V* acc, size_t i){ for (size_t r=0;r<8/L::W;++r) acc[r] = L::max(L::load(a+i+r*L::W), acc[r]); },
+        [&](double* part, size_t i){ if (a[i]>part[i%8]) part[i%8] = a[i]; }, joinMax);
+}
+
+template<class L>
+static VecKernels kernelsFor(const char* name){
+    return VecKernels{name, binaryKernel<L>, sumKernel<L>, dotKernel<L>, minKernel<L>, maxKernel<L>};
+}
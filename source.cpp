@@ -0,0 +1,84 @@
+#include "source.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr size_t kChunk = 64*1024;
+
+StringSource::StringSource(std::string s): text(std::move(s)) {
+    data = text.data();
+    size = text.size();
+}
+
+MappedSource::MappedSource(int fd, size_t length){
+    if (length==0) return;
+    void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p==MAP_FAILED) throw std::runtime_error("Cannot map source file");
+    madvise(p, length, MADV_SEQUENTIAL);
+    data = static_cast<const char*>(p);
+    size = length;
+}
+
+MappedSource::~MappedSource(){
+    if (data) munmap(const_cast<char*>(data), size);
+}
+
+void MappedSource::discard(size_t upTo){
+    // give whole pages behind the parser back to the kernel
+    static const size_t page = size_t(sysconf(_SC_PAGESIZE));
+    size_t end = upTo/page*page;
+    if (end<=released+16*page) return;
+    madvise(const_cast<char*>(data)+released, end-released, MADV_DONTNEED);
+    released = end;
+}
+
+StreamSource::StreamSource(int f, bool own): fd(f), owned(own) {
+    buf.reserve(kChunk);
+}
+
+StreamSource::~StreamSource(){
+    if (owned) close(fd);
+}
+
+bool StreamSource::more(){
+    if (eof) return false;
+    size_t used = size;
+    buf.resize(used+kChunk);
+    ssize_t n;
+    do { n = read(fd, buf.data()+used, kChunk); } while (n<0 && errno==EINTR);
+    if (n<0) throw std::runtime_error(std::string("Read error: ")+std::strerror(errno));
+    buf.resize(used+size_t(n));
+    data = buf.data();
+    size = buf.size();
+    if (n==0){ eof = true; return false; }
+    return true;
+}
+
+void StreamSource::discard(size_t upTo){
+    size_t drop = upTo-base;
+    // compact only once the dead prefix dominates, so each byte moves O(1) times
+    if (drop<kChunk || drop*2<size) return;
+    std::memmove(buf.data(), buf.data()+drop, size-drop);
+    buf.resize(size-drop);
+    base += drop;
+    data = buf.data();
+    size = buf.size();
+}
+
+std::unique_ptr<Source> openSource(const char* path){
+    int fd = open(path, O_RDONLY);
+    if (fd<0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st)==0 && S_ISREG(st.st_mode)){
+        std::unique_ptr<Source> src;
+        try { src = std::make_unique<MappedSource>(fd, size_t(st.st_size)); }
+        catch (...) { close(fd); throw; }
+        close(fd);   // the mapping stays valid
+        return src;
+    }
+    return std::make_unique<StreamSource>(fd, true);
+}
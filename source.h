@@ -0,0 +1,59 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Input for the lexer. The available bytes are the window
+// [base, base+size) of the whole input, addressed by absolute offset.
+// Streaming sources grow the window on demand and drop bytes the parser has
+// finished with, so memory is bounded by the largest pending statement.
+struct Source {
+    const char* data = nullptr;
+    size_t base = 0, size = 0;
+
+    virtual ~Source() = default;
+
+    // Extends the window with more input; false at end of input.
+    virtual bool more(){ return false; }
+    // Bytes before absolute offset `upTo` will not be read again.
+    virtual void discard(size_t upTo){ (void)upTo; }
+
+    bool has(size_t off){
+        while (off>=base+size) if (!more()) return false;
+        return true;
+    }
+    char at(size_t off) const { return data[off-base]; }
+    std::string_view view(size_t from, size_t to) const { return {data+(from-base), to-from}; }
+};
+
+struct StringSource : Source {
+    std::string text;
+    explicit StringSource(std::string s);
+};
+
+// Read-only mapping of a regular file; discarded pages are handed back.
+struct MappedSource : Source {
+    explicit MappedSource(int fd, size_t length);
+    ~MappedSource() override;
+    void discard(size_t upTo) override;
+private:
+    size_t released = 0;
+};
+
+// Reads a file descriptor (pipe, stdin, ...) in fixed-size chunks.
+struct StreamSource : Source {
+    explicit StreamSource(int fd, bool owned=false);
+    ~StreamSource() override;
+    bool more() override;
+    void discard(size_t upTo) override;
+private:
+    int fd;
+    bool owned;
+    bool eof = false;
+    std::vector<char> buf;
+};
+
+// Maps regular files and streams everything else; nullptr if `path` can't be opened.
+std::unique_ptr<Source> openSource(const char* path);
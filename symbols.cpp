@@ -0,0 +1,164 @@
+#include "symbols.h"
+
+SymbolTable& symbols(){
+    static SymbolTable table;
+    return table;
+}
+
+uint64_t SymbolTable::hashOf(std::string_view s){
+    uint64_t h = 1469598103934665603ull;    // FNV-1a
+    for (unsigned char c: s){ h ^= c; h *= 1099511628211ull; }
+    return h;
+}
+
+SymbolTable::Buckets::Buckets(size_t n): mask(n-1), slots(new std::atomic<Symbol>[n]) {
+    for (size_t b=0;b<n;++b) slots[b].store(NoSymbol, std::memory_order_relaxed);
+}
+
+SymbolTable::SymbolTable(){
+    tables.emplace_back(new Buckets(64));
+    buckets.store(tables.back().get(), std::memory_order_release);
+}
+
+SymbolTable::~SymbolTable(){
+    for (Symbol s=0, n=count.load(); s<n; ++s) delete entry(s).obj;
+    for (auto& b: blocks) delete[] b.load(std::memory_order_relaxed);
+}
+
+SymbolOwner::~SymbolOwner(){
+    if (!held.empty()) symbols().release(*this);
+}
+
+// Called with `lock` held, shared or not, once names are freed.
+Symbol SymbolTable::lookup(std::string_view s, uint64_t h) const {
+    const Buckets& t = *buckets.load(std::memory_order_acquire);
+    for (size_t b = h & t.mask;; b = (b+1) & t.mask){
+        Symbol id = t.slots[b].load(std::memory_order_acquire);
+        if (id==NoSymbol) return NoSymbol;
+        const Entry& e = entry(id);
+        if (e.hash==h && e.obj->s==s) return id;
+    }
+}
+
+// Called with `lock` held alone.
+void SymbolTable::grow(){
+    const Buckets& old = *tables.back();
+    tables.emplace_back(new Buckets((old.mask+1)*2));
+    Buckets& t = *tables.back();
+    for (Symbol id=0, n=count.load(std::memory_order_relaxed); id<n; ++id){
+        if (!entry(id).obj) continue;
+        size_t b = entry(id).hash & t.mask;     // stored hash: no string rehashing
+        while (t.slots[b].load(std::memory_order_relaxed)!=NoSymbol) b = (b+1) & t.mask;
+        t.slots[b].store(id, std::memory_order_relaxed);
+    }
+    buckets.store(&t, std::memory_order_release);
+}
+
+size_t SymbolTable::size() const {
+    std::shared_lock<std::shared_mutex> g(lock);
+    return count.load(std::memory_order_relaxed)-unused.size();
+}
+
+Symbol SymbolTable::find(std::string_view s) const {
+    std::shared_lock<std::shared_mutex> g(lock, std::defer_lock);
+    if (freeing.load(std::memory_order_acquire)) g.lock();
+    return lookup(s, hashOf(s));
+}
+
+Symbol SymbolTable::intern(std::string_view s, SymbolOwner* owner){
+    uint64_t h = hashOf(s);
+    bool shared = freeing.load(std::memory_order_acquire);
+    if (!shared) owner = nullptr;               // nothing is freed: every name is kept
+    {
+        std::shared_lock<std::shared_mutex> g(lock, std::defer_lock);
+        if (shared) g.lock();
+        Symbol id = lookup(s, h);
+        if (id!=NoSymbol){
+            hold(id, owner);
+            return id;
+        }
+    }
+    std::unique_lock<std::shared_mutex> g(lock);
+    Symbol id = lookup(s, h);                   // another thread may have added it meanwhile
+    if (id==NoSymbol) id = add(s, h);
+    hold(id, owner);
+    return id;
+}
+
+// Called with `lock` held, shared or not (see lookup): a held name is not
+// freed meanwhile.
+void SymbolTable::hold(Symbol id, SymbolOwner* owner){
+    Entry& e = entry(id);
+    if (!owner){
+        if (!e.pinned.load(std::memory_order_relaxed)) e.pinned.store(true, std::memory_order_release);
+        return;
+    }
+    if (id<owner->holds.size() && owner->holds[id]) return;
+    if (id>=owner->holds.size()) owner->holds.resize(size_t(id)+1);
+    owner->holds[id] = true;
+    owner->held.push_back(id);
+    e.owners.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Called with `lock` held alone.
+Symbol SymbolTable::add(std::string_view s, uint64_t h){
+    Symbol id;
+    if (!unused.empty()){
+        id = unused.back();
+        unused.pop_back();
+    } else {
+        id = count.load(std::memory_order_relaxed);
+        size_t i = size_t(id)+(size_t(1)<<kFirstBlock);
+        unsigned b = 63-unsigned(__builtin_clzll(i));
+        if (i==(size_t(1)<<b)) blocks[b-kFirstBlock].store(new Entry[size_t(1)<<b], std::memory_order_release);
+        count.store(id+1, std::memory_order_release);
+    }
+    HeapScope shared(nullptr);                  // not any one context's
+    auto* obj = new StrObj(std::string(s));
+    obj->sym = id;
+    obj->immortal = true;                       // the table owns it
+    obj->read();                                // shared by every thread, so never written later
+    Entry& e = entry(id);
+    e.hash = h;
+    e.obj = obj;
+    Buckets& t = *tables.back();
+    size_t slot = h & t.mask;
+    while (t.slots[slot].load(std::memory_order_relaxed)!=NoSymbol) slot = (slot+1) & t.mask;
+    t.slots[slot].store(id, std::memory_order_release);
+    if ((count.load(std::memory_order_relaxed)-unused.size())*2 > t.mask+1) grow();
+    return id;
+}
+
+void SymbolTable::release(SymbolOwner& owner){
+    std::unique_lock<std::shared_mutex> g(lock);
+    for (Symbol id: owner.held){
+        Entry& e = entry(id);
+        if (e.owners.fetch_sub(1, std::memory_order_relaxed)==1 && !e.pinned.load(std::memory_order_relaxed)) free(id);
+    }
+    owner.held.clear();
+    owner.holds.clear();
+}
+
+// Called with `lock` held alone, so no lookup is probing. Takes id out of
+// the buckets, moving up the names after it that would not be found past
+// the gap (linear probing needs no tombstones then).
+void SymbolTable::free(Symbol id){
+    Entry& e = entry(id);
+    Buckets& t = *tables.back();
+    size_t gap = e.hash & t.mask;
+    while (t.slots[gap].load(std::memory_order_relaxed)!=id) gap = (gap+1) & t.mask;
+    for (size_t b = (gap+1) & t.mask;; b = (b+1) & t.mask){
+        Symbol other = t.slots[b].load(std::memory_order_relaxed);
+        if (other==NoSymbol) break;
+        size_t home = entry(other).hash & t.mask;
+        // `other` may move into the gap if its home is not in (gap, b]
+        if (((b-home) & t.mask) >= ((b-gap) & t.mask)){
+            t.slots[gap].store(other, std::memory_order_relaxed);
+            gap = b;
+        }
+    }
+    t.slots[gap].store(NoSymbol, std::memory_order_relaxed);
+    delete e.obj;
+    e.obj = nullptr;
+    unused.push_back(id);
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include "value.h"
+#include <atomic>
+#include <shared_mutex>
+#include <string_view>
+#include <vector>
+
+// Process-wide intern table. The tokenizer turns every identifier and string
+// literal into a Symbol, so name lookups downstream are integer compares.
+// Each symbol owns an immortal StrObj that Values can point at directly.
+//
+// Names are kept for good, unless freeNames() was called: from then on, a
+// symbol interned for a SymbolOwner lasts as long as some owner holds it,
+// and then its StrObj is freed and its number given to the next new name.
+// Others are still kept (pinned), the builtins' names among them. Parsed
+// Programs and contexts own theirs, so the names of scripts the server no
+// longer keeps do not pile up.
+//
+// Any thread may use it at any time. name(), hash() and value() take no
+// lock: entries never move once written, and one that is held is not freed.
+// Lookups take none either until names are freed; then they share a lock
+// that adding and freeing names take alone.
+using Symbol = uint32_t;
+constexpr Symbol NoSymbol = ~0u;
+
+// The symbols interned for something that goes away: a Program, a context.
+// Used by one thread at a time.
+struct SymbolOwner {
+    SymbolOwner() = default;
+    ~SymbolOwner();          // lets go of them all
+    SymbolOwner(const SymbolOwner&) = delete;
+    SymbolOwner& operator=(const SymbolOwner&) = delete;
+
+private:
+    friend struct SymbolTable;
+    std::vector<bool> holds; // by Symbol
+    std::vector<Symbol> held;
+};
+
+struct SymbolTable {
+    SymbolTable();
+    ~SymbolTable();
+    SymbolTable(const SymbolTable&) = delete;
+    SymbolTable& operator=(const SymbolTable&) = delete;
+
+    // With an owner, s is kept at least until the owner goes away; without,
+    // for good.
+    Symbol intern(std::string_view s, SymbolOwner* owner = nullptr);
+    Symbol find(std::string_view s) const;              // NoSymbol if not interned
+    bool pinned(Symbol s) const { return entry(s).pinned.load(std::memory_order_acquire); }
+    // Frees names no owner holds any more, from now on: for a process in
+    // which no Value outlives the Program and context it came from, like
+    // the server. Call it while no other thread is interning.
+    void freeNames(){ freeing.store(true, std::memory_order_release); }
+    const std::string& name(Symbol s) const { return entry(s).obj->s; }
+    uint64_t hash(Symbol s) const { return entry(s).hash; }
+    Value value(Symbol s) const { return Value(entry(s).obj); }
+    size_t size() const;                                 // names interned and not freed
+
+    static uint64_t hashOf(std::string_view s);
+
+private:
+    friend struct SymbolOwner;
+    struct Entry {
+        uint64_t hash;
+        StrObj* obj;                    // null while the number is unused
+        std::atomic<uint32_t> owners{0};
+        std::atomic<bool> pinned{false};
+    };
+    // open addressing, linear probing; NoSymbol = empty
+    struct Buckets {
+        size_t mask;
+        std::unique_ptr<std::atomic<Symbol>[]> slots;
+        explicit Buckets(size_t n);
+    };
+
+    // Entries indexed by Symbol, in blocks of 64, 128, 256, ... entries:
+    // symbol s is entry s+64-2^b of block b-6, where 2^b <= s+64 < 2^(b+1).
+    static constexpr unsigned kFirstBlock = 6;
+    std::atomic<Entry*> blocks[32] = {};
+    std::atomic<uint32_t> count{0};     // numbers given out
+    std::atomic<Buckets*> buckets;
+    std::vector<std::unique_ptr<Buckets>> tables;   // the current one last
+    std::vector<Symbol> unused;         // numbers of freed names, for new ones
+    mutable std::shared_mutex lock;
+    std::atomic<bool> freeing{false};
+
+    Entry& entry(Symbol s) const {
+        size_t i = size_t(s)+(size_t(1)<<kFirstBlock);
+        unsigned b = 63-unsigned(__builtin_clzll(i));
+        return blocks[b-kFirstBlock].load(std::memory_order_acquire)[i-(size_t(1)<<b)];
+    }
+    Symbol lookup(std::string_view s, uint64_t h) const;
+    Symbol add(std::string_view s, uint64_t h);
+    void hold(Symbol id, SymbolOwner* owner);
+    void release(SymbolOwner& owner);
+    void free(Symbol id);
+    void grow();
+};
+
+SymbolTable& symbols();
+
+inline Symbol intern(std::string_view s, SymbolOwner* owner = nullptr){ return symbols().intern(s, owner); }
+inline const std::string& symbolName(Symbol s){ return symbols().name(s); }
+
+// Symbol for a string Value, held for `owner` (see intern); interned
+// literals already carry theirs. Other strings remember one that is pinned,
+// except in a parallel section, where another thread may be reading the
+// same string.
+inline Symbol symbolOf(const Value& v, SymbolOwner* owner = nullptr){
+    StrObj* o = v.strObj();
+    if (o->sym!=NoSymbol) return o->sym;
+    Symbol s = intern(o->s, owner);
+    if (!inParallel() && symbols().pinned(s)) o->sym = s;
+    return s;
+}
@@ -1,41 +1,196 @@
 #pragma once
-#include <variant>
-#include <string>
+#include "heap.h"
+#include <cstdint>
+#include <cstring>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
 #include <functional>
 
-struct ASTNode; // forward
+struct AST; // forward
 
 struct Function;
 
+// Heap objects referenced from a Value carry an intrusive refcount. It is a
+// plain integer, updated with atomic instructions only by the threads
+// running the tasks of a parallel builtin (see pool.h); the pool's start and
+// finish order those updates against the plain ones.
+//
+// Immortal objects are not counted at all. They belong to something that
+// outlives every Value pointing at them (the symbol table, a Runtime) and
+// may be shared by contexts on any number of threads.
+enum class ObjKind : uint8_t { String, Function, Environment, Array };
+
+extern __thread uint64_t objectsAllocated;       // heap objects created so far on this thread; the profiler reads it
+extern __thread bool parallelSection;            // this thread is working on a ThreadPool job
+
+inline bool inParallel(){ return parallelSection; }
+
+// Objects are made with new, which takes their memory from the current
+// Heap (heap.h); a header in front of each says which.
+struct Object {
+    uint32_t refs = 0;
+    ObjKind kind;
+    bool immortal = false;
+    explicit Object(ObjKind k): kind(k) { ++objectsAllocated; }
+    Object(const Object& o): kind(o.kind) { ++objectsAllocated; }   // a copy starts unreferenced
+    Object& operator=(const Object&) = delete;
+
+    static void* operator new(size_t n);
+    static void operator delete(void* p, size_t n);
+    Heap* heap() const;             // null: from operator new
+    void charge(size_t bytes);      // memory it holds some other way, counted against its Heap until it is freed
+};
+
+void releaseObject(Object* o); // frees `o` once its last reference is gone
+
+inline void retain(Object* o){
+    if (__builtin_expect(o->immortal, 0)) return;
+    if (__builtin_expect(inParallel(), 0)) __atomic_fetch_add(&o->refs, 1, __ATOMIC_RELAXED);
+    else ++o->refs;
+}
+inline void release(Object* o){
+    if (__builtin_expect(o->immortal, 0)) return;
+    uint32_t left = __builtin_expect(inParallel(), 0) ? __atomic_sub_fetch(&o->refs, 1, __ATOMIC_ACQ_REL) : --o->refs;
+    if (left==0) releaseObject(o);
+}
+
+// Reads a number at the start of s the way std::stod does (blanks, a sign,
+// decimal or 0x hex digits, inf or nan; the rest is ignored), but without
+// exceptions: false when there is none or it is out of range.
+bool parseNumber(std::string_view s, double& out);
+
+struct StrObj : Object {
+    std::string s;
+    uint32_t sym = ~0u;   // interned Symbol for this text, filled in on first use as a name
+    enum Reading : uint8_t { Unread, Number, NotNumber };
+    Reading reading = Unread; // s as a number (see numberOf), found on first use
+    double num = 0;           // that number, if reading==Number
+    explicit StrObj(std::string v);
+    void read(){ reading = parseNumber(s, num) ? Number : NotNumber; }
+};
+
+// Array of doubles, fixed once built: the array builtins make a new one for
+// each result, reusing an argument in place only when nothing else refers to
+// it (see Value::sole()).
+struct ArrObj : Object {
+    size_t size;
+    double* data;         // from the object's Heap
+    explicit ArrObj(size_t n);
+    ~ArrObj();
+};
+
+// Owning handle to a refcounted heap object.
+template<class T>
+struct Ref {
+    T* p = nullptr;
+
+    Ref() = default;
+    Ref(std::nullptr_t) {}
+    explicit Ref(T* x): p(x) { if (p) retain(p); }
+    Ref(const Ref& o): p(o.p) { if (p) retain(p); }
+    Ref(Ref&& o) noexcept : p(o.p) { o.p = nullptr; }
+    ~Ref(){ if (p) release(p); }
+
+    Ref& operator=(Ref o) noexcept { std::swap(p, o.p); return *this; }
+
+    T* get() const { return p; }
+    T* operator->() const { return p; }
+    T& operator*() const { return *p; }
+    explicit operator bool() const { return p!=nullptr; }
+    void reset(){ Ref().swap(*this); }
+    void swap(Ref& o) noexcept { std::swap(p, o.p); }
+    bool operator==(const Ref& o) const { return p==o.p; }
+    bool operator!=(const Ref& o) const { return p!=o.p; }
+};
+
+template<class T, class... A>
+Ref<T> makeRef(A&&... a){ return Ref<T>(new T(std::forward<A>(a)...)); }
+
 using Number   = double;
 using String   = std::string;
-using FuncPtr  = std::shared_ptr<Function>;
-using ASTPtr   = std::shared_ptr<ASTNode>;
+using FuncPtr  = Ref<Function>;
+using ASTPtr   = std::shared_ptr<AST>;
 
+// 8-byte NaN-boxed value. Any double is stored as itself (NaNs are
+// canonicalised to the positive quiet NaN); everything else lives in the
+// negative quiet-NaN space: a 3-bit tag in bits 48..50 and a 48-bit object
+// pointer below it.
 struct Value {
-    std::variant<std::monostate, Number, String, FuncPtr> data;
+    uint64_t bits;
+
+    static constexpr uint64_t BoxMask  = 0xfff8000000000000ull;
+    static constexpr uint64_t PtrMask  = 0x0000ffffffffffffull;
+    static constexpr uint64_t CanonNaN = 0x7ff8000000000000ull;
+    enum Tag : uint64_t { NilTag=0, StrTag=1, FuncTag=2, ArrTag=3 };
 
-    Value() : data(std::monostate{}) {}
-    Value(Number n) : data(n) {}
-    Value(const String& s) : data(s) {}
-    Value(const char* s) : data(String(s)) {}
-    Value(FuncPtr f) : data(std::move(f)) {}
+    Value(): bits(box(NilTag)) {}
+    Value(Number n){
+        if (n!=n) bits = CanonNaN;
+        else std::memcpy(&bits, &n, sizeof bits);
+    }
+    Value(const String& s): Value(new StrObj(s), StrTag) {}
+    Value(const char* s): Value(new StrObj(s), StrTag) {}
+    explicit Value(StrObj* s): Value(s, StrTag) {} // shares s, e.g. an interned string
+    explicit Value(ArrObj* a): Value(a, ArrTag) {}
+    Value(FuncPtr f); // defined in ast.h, where Function is complete
 
-    bool isNil() const { return std::holds_alternative<std::monostate>(data); }
-    bool isNum() const { return std::holds_alternative<Number>(data); }
-    bool isStr() const { return std::holds_alternative<String>(data); }
-    bool isFunc()const { return std::holds_alternative<FuncPtr>(data); }
+    Value(const Value& o): bits(o.bits) { if (isObj()) retain(obj()); }
+    Value(Value&& o) noexcept : bits(o.bits) { o.bits = box(NilTag); }
+    ~Value(){ if (isObj()) release(obj()); }
+    Value& operator=(const Value& o){
+        if (o.isObj()) retain(o.obj());
+        if (isObj()) release(obj());
+        bits = o.bits;
+        return *this;
+    }
+    Value& operator=(Value&& o) noexcept {
+        if (this!=&o){
+            if (isObj()) release(obj());
+            bits = o.bits;
+            o.bits = box(NilTag);
+        }
+        return *this;
+    }
+
+    bool isNil() const { return bits==box(NilTag); }
+    bool isNum() const { return (bits & BoxMask)!=BoxMask; }
+    bool isStr() const { return bits>>48==(BoxMask>>48 | StrTag); }
+    bool isFunc()const { return bits>>48==(BoxMask>>48 | FuncTag); }
+    bool isArr() const { return bits>>48==(BoxMask>>48 | ArrTag); }
 
     Number asNum() const;
     const String& asStr() const;
     FuncPtr asFunc() const;
-
+    const ArrObj& asArr() const;
 
     bool truthy() const;
+
+private:
+    static constexpr uint64_t box(uint64_t tag){ return BoxMask | tag<<48; }
+    bool isObj() const { return (bits & BoxMask)==BoxMask && (bits>>48 & 7)!=NilTag; }
+    Object* obj() const { return reinterpret_cast<Object*>(bits & PtrMask); }
+    Value(Object* o, Tag t): bits(box(t) | reinterpret_cast<uintptr_t>(o)) { retain(o); }
+
+    [[noreturn]] void typeError(const char* expected) const;
+
+public:
+    // unchecked accessors for callers that already tested the type
+    Number num() const { Number n; std::memcpy(&n, &bits, sizeof n); return n; }
+    const String& str() const { return strObj()->s; }
+    StrObj* strObj() const { return static_cast<StrObj*>(obj()); }
+    ArrObj* arrObj() const { return static_cast<ArrObj*>(obj()); }
+    bool sole() const { return isObj() && obj()->refs==1; }   // this Value is the only reference
+    Function* func() const;   // borrowed, no reference taken; defined in ast.h
 };
 
+static_assert(sizeof(Value)==8, "Value must stay NaN-boxed");
+
+inline Number Value::asNum() const { if (!isNum()) typeError("number"); return num(); }
+inline const String& Value::asStr() const { if (!isStr()) typeError("string"); return str(); }
+inline const ArrObj& Value::asArr() const { if (!isArr()) typeError("array"); return *arrObj(); }
+
 inline Value num(double x){ return Value(x); }
 inline Value str(const std::string& s){ return Value(s); }
@@ -0,0 +1,358 @@
+#include "vm.h"
+#include "compiler.h"
+#include "resolver.h"
+#include "builtins.h"
+#include "jit.h"
+#include "profiler.h"
+#include <stdexcept>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CALLIX_COMPUTED_GOTO 1
+#else
+#define CALLIX_COMPUTED_GOTO 0
+#endif
+
+void VM::run(const ASTPtr& program){
+    I.proceed();
+    Resolver(I.globals).program(*program);
+    Chunk main = Compiler().compileProgram(*program);
+    execute(main);
+}
+
+void VM::run(const Program& program){
+    begin(program);
+    while (!resume()){}
+}
+
+void VM::begin(const Program& program){
+    if (!program.main) throw std::runtime_error("program was built without bytecode");
+    I.start(program);
+    programCaches.resize(program.chunks.size());
+    for (size_t i=0;i<programCaches.size();++i){
+        programCaches[i].fns.assign(program.chunks[i]->names.size(), nullptr);
+        programCaches[i].version = ~0ull;
+    }
+    frames.clear();
+    stack.clear();
+    frames.push_back(Frame{program.main.get(), program.main->code.data(), 0, nullptr});
+}
+
+bool VM::resume(){
+    HeapScope scope(I.heap);
+    try {
+        I.proceed();
+        while (!dispatch(0)) if (sliceOver) return false;
+    } catch (...){
+        unwind(0, 0, 0);
+        throw;
+    }
+    stack.clear();   // the value of the program
+    I.out->flush();
+    return true;
+}
+
+// After an error: back to `entry` frames and `height` values.
+void VM::unwind(size_t entry, size_t height, size_t profiled){
+    for (size_t f=entry; f<frames.size(); ++f) if (frames[f].memoFn) frames[f].memoFn->memo.abandon(frames[f].memoCall);
+    frames.resize(entry);
+    stack.resize(height);
+    if (I.profiler) I.profiler->unwind(profiled);
+}
+
+const Chunk& VM::compiled(Function& F){
+    if (!F.compiled) F.compiled = std::make_shared<Chunk>(Compiler().compileBody(F.body));
+    return *F.compiled;
+}
+
+void VM::pushName(Symbol n){
+    Value v;
+    if (!I.globals.get(n, v)) throw std::runtime_error("Undefined identifier: "+symbolName(n));
+    stack.push_back(std::move(v));
+}
+
+void VM::pushLocal(uint32_t a){
+    uint32_t depth = a>>16, slot = a & 0xffff;
+    const Frame& fr = frames.back();
+    Value v = depth==0 ? stack[fr.base+slot] : fr.fn->captured->up(depth-1).slots[slot];
+    stack.push_back(std::move(v));
+}
+
+void VM::pushCallee(const Chunk& chunk, uint32_t a, uint32_t local){
+    CallCache& cache = chunk.id==Chunk::Private ? chunk.cache : programCaches[chunk.id];
+    if (cache.version!=I.functionsVersion){
+        for (auto& f: cache.fns) f = nullptr;
+        cache.version = I.functionsVersion;
+    }
+    Function*& cached = cache.fns[a];
+    if (!cached){
+        auto it = I.functions.find(chunk.names[a]);
+        if (it!=I.functions.end()) cached = it->second.get();
+    }
+    if (cached){ stack.push_back(Value(FuncPtr(cached))); return; }
+    // maybe a variable holds a function
+    if (local!=kNoLocal) pushLocal(local);
+    else {
+        Value callable;
+        I.globals.get(chunk.names[a], callable);
+        stack.push_back(std::move(callable));
+    }
+    if (!stack.back().isFunc()) throw std::runtime_error("Unknown function: "+symbolName(chunk.names[a]));
+}
+
+// Copies share the template's body and bytecode; a closure's `captured`
+// holds the current parameters. The template is only read: it may belong to
+// a Program other threads are running.
+void VM::pushClosure(const Value& tmpl, bool capture){
+    Function& T = *tmpl.func();
+    Frame& fr = frames.back();
+    auto F = makeRef<Function>();
+    F->params = T.params;
+    F->code = T.code;
+    F->body = T.body;
+    F->resolved = true;
+    compiled(T);
+    F->compiled = T.compiled;
+    if (capture && fr.fn){
+        if (!fr.snapshot) fr.snapshot = Interpreter::capture(*fr.fn, stack.data()+fr.base);
+        F->captured = fr.snapshot;
+    }
+    stack.push_back(Value(std::move(F)));
+}
+
+// Calls stack[pos] on the argc values above it. Builtins and compiled code
+// replace them with the result at once; user functions get a Frame (or take
+// over the current one) and do so on Return.
+void VM::invoke(size_t pos, size_t argc, Symbol name, bool tail, uint8_t force){
+    FuncPtr F = stack[pos].asFunc();
+    if (F->isSpecial) throw std::runtime_error("special form cannot be called indirectly");
+    Value* argv = stack.data()+pos+1;
+    if (F->isBuiltin){
+        Value r = I.native(*F, name, argv, argc);
+        stack.resize(pos);
+        stack.push_back(std::move(r));
+        return;
+    }
+    if (argc!=F->params.size()){
+        if (name!=NoSymbol && I.functions.count(name)) throw std::runtime_error("Arity mismatch for "+symbolName(name));
+        throw std::runtime_error("Arity mismatch calling function variable");
+    }
+    Memo::Pending pending;
+    {
+        Value r;
+        if (I.recall(*F, name, argv, argc, !tail, r, pending)){
+            stack.resize(pos);
+            stack.push_back(std::move(r));
+            return;
+        }
+    }
+    Profiler* prof = I.profiler;
+    // a call whose result is memoized runs here, so its own calls are looked up too
+    if (I.jitting() && !pending.id){
+        Value r;
+        if (prof) prof->enter(name);
+        if (jitCall(I, *F, argv, argc, r)){
+            if (prof) prof->leave();
+            stack.resize(pos);
+            stack.push_back(std::move(r));
+            return;
+        }
+        if (prof) prof->cancel();
+    }
+    I.prepare(*F);
+    const Chunk& body = compiled(*F);
+    Frame& fr = frames.back();
+    if (tail && fr.fn && (!force || !fr.forces || fr.forceKind==force-1)){
+        if (prof) prof->replace(name);
+        // replace the current call: what is left of it only passes the value on
+        std::move(stack.begin()+pos+1, stack.end(), stack.begin()+fr.base);
+        stack.resize(fr.base+argc);
+        fr.fn = std::move(F);
+        fr.chunk = &body;
+        fr.ip = body.code.data();
+        fr.snapshot.reset();
+        if (force){ fr.forceKind = force-1; ++fr.forces; }
+        return;
+    }
+    if (prof) prof->enter(name);
+    frames.push_back(Frame{&body, body.code.data(), pos+1, F});
+    if (pending.id){ frames.back().memoFn = std::move(F); frames.back().memoCall = pending; }
+}
+
+void VM::thunk(uint32_t a){
+    if (!stack.back().isFunc()) return;
+    if (!stack.back().asFunc()->params.empty()) throw std::runtime_error(kThunkErrors[a & 3]);
+    invoke(stack.size()-1, 0, NoSymbol, (a>>2) & 1, uint8_t(a>>3));
+}
+
+// Return from the top frame; true when it was the one execute() started.
+bool VM::ret(size_t entry){
+    Frame& fr = frames.back();
+    if (fr.forces && stack.back().isFunc()){
+        if (!stack.back().asFunc()->params.empty()) throw std::runtime_error(kThunkErrors[fr.forceKind]);
+        --fr.forces;
+        invoke(stack.size()-1, 0, NoSymbol, true, 0);
+        return false;
+    }
+    Value r = std::move(stack.back());
+    if (fr.memoFn) fr.memoFn->memo.finish(fr.memoCall, r);
+    bool done = frames.size()==entry+1;
+    stack.resize(done ? fr.base : fr.base-1);
+    stack.push_back(std::move(r));
+    frames.pop_back();
+    if (!done && I.profiler) I.profiler->leave();
+    return done;
+}
+
+bool VM::caseNe(){
+    double c = asNumStrict(stack.back());
+    stack.pop_back();
+    return stack.back().num()!=c;
+}
+
+Value VM::execute(const Chunk& main){
+    const size_t entry = frames.size(), height = stack.size();
+    const size_t profiled = I.profiler ? I.profiler->depth() : 0;
+    frames.push_back(Frame{&main, main.code.data(), height, nullptr});
+    HeapScope scope(I.heap);
+    try {
+        while (!dispatch(entry)){}
+    } catch (...){
+        unwind(entry, height, profiled);
+        throw;
+    }
+    Value r = std::move(stack.back());
+    stack.pop_back();
+    return r;
+}
+
+// Runs the top frame until the frame at `entry` returns (true), or until
+// the fuel runs out (false, after the check; the frames are saved, and
+// another call goes on). Handlers must not leave locals with destructors
+// in scope when they DISPATCH(): a computed goto skips their destructors.
+// Whatever may switch frames, or run code that burns fuel, saves ip and
+// fuel first and reloads chunk, ip and fuel after.
+bool VM::dispatch(size_t entry){
+    const Chunk* chunk = frames.back().chunk;
+    const uint32_t* ip = frames.back().ip;
+    uint64_t fuel = I.fuel;
+    uint32_t w;
+
+#if CALLIX_COMPUTED_GOTO
+    static void* const labels[] = { &&op_Const, &&op_Load, &&op_LoadLocal, &&op_LoadGlobal, &&op_GetGlobal,
+                                    &&op_StoreGlobal, &&op_Callee, &&op_Call, &&op_TailCall, &&op_Pop, &&op_Return,
+                                    &&op_Jump, &&op_JumpIfFalse, &&op_ToNumber, &&op_JumpIfNe, &&op_Thunk, &&op_Fail,
+                                    &&op_Closure, &&op_Lambda };
+#define DISPATCH() do { if (--fuel==0) goto refuel; w = *ip++; goto *labels[w & 0xff]; } while(0)
+#define CASE(o) op_##o:
+#define SAVE() (frames.back().ip = ip, I.fuel = fuel)
+#define LOAD() (chunk = frames.back().chunk, ip = frames.back().ip, fuel = I.fuel)
+    DISPATCH();
+#else
+#define DISPATCH() break
+#define CASE(o) case Op::o:
+#define SAVE() (frames.back().ip = ip, I.fuel = fuel)
+#define LOAD() (chunk = frames.back().chunk, ip = frames.back().ip, fuel = I.fuel)
+    for(;;){ if (--fuel==0) goto refuel; w = *ip++; switch(opOf(w)){
+#endif
+
+    CASE(Const){
+        stack.push_back(chunk->consts[argOf(w)]);
+        DISPATCH();
+    }
+    CASE(Load){
+        pushName(chunk->names[argOf(w)]);
+        DISPATCH();
+    }
+    CASE(LoadLocal){
+        pushLocal(argOf(w));
+        DISPATCH();
+    }
+    CASE(LoadGlobal){
+        stack.push_back(I.loadGlobal(argOf(w), "Undefined identifier: "));
+        DISPATCH();
+    }
+    CASE(GetGlobal){
+        stack.push_back(I.loadGlobal(argOf(w), "Undefined variable: "));
+        DISPATCH();
+    }
+    CASE(StoreGlobal){
+        I.globals.bind(argOf(w), stack.back());
+        DISPATCH();
+    }
+    CASE(Callee){
+        pushCallee(*chunk, argOf(w), *ip++);
+        DISPATCH();
+    }
+    CASE(Call){
+        ip += 1;
+        SAVE();
+        invoke(stack.size()-ip[-1]-1, ip[-1], chunk->names[argOf(w)], false, 0);
+        LOAD();
+        DISPATCH();
+    }
+    CASE(TailCall){
+        ip += 1;
+        SAVE();
+        invoke(stack.size()-(ip[-1] & 0xffffff)-1, ip[-1] & 0xffffff, chunk->names[argOf(w)], true, uint8_t(ip[-1]>>24));
+        LOAD();
+        DISPATCH();
+    }
+    CASE(Pop){
+        stack.pop_back();
+        DISPATCH();
+    }
+    CASE(Jump){
+        ip = chunk->code.data()+argOf(w);
+        DISPATCH();
+    }
+    CASE(JumpIfFalse){
+        bool t = stack.back().truthy();
+        stack.pop_back();
+        if (!t) ip = chunk->code.data()+argOf(w);
+        DISPATCH();
+    }
+    CASE(ToNumber){
+        stack.back() = Value(asNumStrict(stack.back()));
+        DISPATCH();
+    }
+    CASE(JumpIfNe){
+        if (caseNe()) ip = chunk->code.data()+argOf(w);
+        DISPATCH();
+    }
+    CASE(Thunk){
+        SAVE();
+        thunk(argOf(w));
+        LOAD();
+        DISPATCH();
+    }
+    CASE(Fail){
+        throw std::runtime_error(chunk->consts[argOf(w)].asStr());
+    }
+    CASE(Closure){
+        pushClosure(chunk->consts[argOf(w)], true);
+        DISPATCH();
+    }
+    CASE(Lambda){
+        pushClosure(chunk->consts[argOf(w)], false);
+        DISPATCH();
+    }
+    CASE(Return){
+        SAVE();
+        if (ret(entry)) return true;
+        LOAD();
+        DISPATCH();
+    }
+
+#if !CALLIX_COMPUTED_GOTO
+    }}
+#endif
+refuel:
+    SAVE();
+    I.vmFrameBytes = frames.capacity()*sizeof(Frame);
+    sliceOver = I.outOfFuel();
+    return false;
+#undef DISPATCH
+#undef CASE
+#undef SAVE
+#undef LOAD
+}
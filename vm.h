@@ -0,0 +1,51 @@
+#pragma once
+#include "interpreter.h"
+#include "bytecode.h"
+#include "program.h"
+#include <memory>
+
+// Stack machine executing compiled Chunks against an Interpreter's
+// globals and function table. Like the tree-walker it does not recurse on
+// the C++ stack: each call pushes a Frame, and TailCall reuses the current
+// one.
+struct VM {
+    Interpreter& I;
+    std::vector<Value>& stack; // Interpreter::stack, so builtins read their arguments in place
+
+    explicit VM(Interpreter& in): I(in), stack(in.stack) {}
+
+    void run(const ASTPtr& program);   // compiled for this context, as Interpreter::run
+    void run(const Program& program);  // from empty globals, as Interpreter::run
+    // run(program) in slices, as Interpreter::begin and resume
+    void begin(const Program& program);
+    bool resume();
+    Value execute(const Chunk& chunk);
+
+private:
+    struct Frame {
+        const Chunk* chunk;
+        const uint32_t* ip;      // where to continue once the frame above returns
+        size_t base;             // parameters are stack[base..); the callee sits just below
+        FuncPtr fn;              // null for the program itself
+        Ref<Environment> snapshot{}; // parameters as captured by closures, made on first use
+        uint32_t forces = 0;     // arms left by tail calls, still to force on return...
+        uint8_t forceKind = 0;   // ...all of this ThunkKind
+        FuncPtr memoFn{};        // whose memo gets the result, at `memoCall`
+        Memo::Pending memoCall{};
+    };
+    std::vector<Frame> frames;
+    std::vector<CallCache> programCaches; // by Chunk::id, for the chunks of the Program being run
+    bool sliceOver = false;  // what the last check said (Interpreter::outOfFuel)
+
+    bool dispatch(size_t entry);
+    void unwind(size_t entry, size_t height, size_t profiled);
+    void pushName(Symbol n);
+    void pushLocal(uint32_t a);
+    void pushCallee(const Chunk& chunk, uint32_t a, uint32_t local);
+    void pushClosure(const Value& tmpl, bool capture);
+    void invoke(size_t pos, size_t argc, Symbol name, bool tail, uint8_t force);
+    void thunk(uint32_t a);
+    bool ret(size_t entry);
+    bool caseNe();
+    static const Chunk& compiled(Function& F);
+};